@@ -3,6 +3,10 @@
 
 #include <thread>
 #include <chrono>
+#include <string>
+#include <locale>
+#include <codecvt>
+#include <stdexcept>
 
 #include "Alt-Link.h"
 #include "CMSIS-DAP.h"
@@ -10,6 +14,7 @@
 #include "ADIv5TI.h"
 #include "RspServer.h"
 #include "HttpServer.h"
+#include "ProbeServer.h"
 
 void dump(ADIv5TI& ti, uint64_t start, uint32_t len)
 {
@@ -39,14 +44,176 @@ void dump(ADIv5TI& ti, uint64_t start, uint32_t len)
 	}
 }
 
+static std::string toString(const _TCHAR* s)
+{
+#if defined(_UNICODE)
+	return std::wstring_convert<std::codecvt_utf8<wchar_t>, wchar_t>().to_bytes(s);
+#else
+	return s;
+#endif
+}
+
+// 最初のプローブ (simConfig があればシミュレータ) を TCP で共有する
+int shareProbe(uint16_t port, const CMSISDAPSim::Config* simConfig)
+{
+	std::shared_ptr<DAPTransport> transport;
+	std::string name;
+	if (simConfig != nullptr)
+	{
+		auto sim = std::make_shared<CMSISDAPSim>(std::make_shared<CortexMSim>(), *simConfig);
+		transport = std::make_shared<LoopbackTransport>(sim);
+		name = simConfig->name;
+	}
+	else
+	{
+		std::vector<CMSISDAP::DeviceInfo> info;
+		if (CMSISDAP::enumerate(&info) != OK || info.size() <= 0)
+		{
+			_ERRPRT("No CMSIS-DAP devices.\n");
+			return OK;
+		}
+
+		transport = HidTransport::open(info[0].vid, info[0].pid);
+		if (transport == nullptr)
+		{
+			_ERRPRT("Failed to open CMSIS-DAP device.\n");
+			return OK;
+		}
+		name = info[0].productString;
+	}
+
+	ProbeServer server(transport, port);
+	_DBGPRT("Sharing %s on port %u\n", name.c_str(), server.port());
+
+	while (1)
+	{
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+	}
+
+	return 0;
+}
+
 AltLink altlink;
 
+/*
+ * -s <port>       share the first probe (or the simulated one with -sim) over TCP
+ * -r <host:port>  use a probe shared by another host
+ * -sim <latency>   use the simulated probe with the given packet latency [us]
+ * -trace <file>    record probe traffic
+ * -replay <file>   replay recorded probe traffic instead of using a probe
+ * -summary <file>  print round trips and time per GDB operation of a trace
+ * -tune <file>     tune the SWJ clock, results are cached in the file
+ * -tuneram <addr>  also verify the clock with a pattern test on RAM at addr
+ * -topology <file> cache the AP/ROM table topology in the file
+ * -nocache <addr:size> never cache memory reads in the region (may be repeated)
+ */
 int _tmain(int argc, _TCHAR* argv[])
 {
+	std::string remote;
+	std::string trace;
+	std::string replay;
+	std::string tuneCache;
+	int64_t tuneRam = -1;
+	std::string topologyCache;
+	std::vector<std::pair<uint64_t, uint64_t>> uncached;
+	int32_t sharePort = -1;
+	bool simulated = false;
+	CMSISDAPSim::Config simConfig;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = toString(argv[i]);
+		bool hasValue = arg == "-s" || arg == "-r" || arg == "-trace" || arg == "-replay" || arg == "-tune" || arg == "-tuneram"
+			|| arg == "-topology" || arg == "-nocache" || arg == "-summary" || arg == "-sim";
+		if (!hasValue)
+			continue;
+		if (i + 1 >= argc)
+		{
+			_ERRPRT("Missing value. (%s)\n", arg.c_str());
+			return EINVAL;
+		}
+		std::string value = toString(argv[++i]);
+
+		try
+		{
+			if (arg == "-s")
+				sharePort = (int32_t)std::stoul(value);
+			if (arg == "-r")
+				remote = value;
+			if (arg == "-trace")
+				trace = value;
+			if (arg == "-replay")
+				replay = value;
+			if (arg == "-tune")
+				tuneCache = value;
+			if (arg == "-tuneram")
+				tuneRam = (int64_t)std::stoull(value, nullptr, 0);
+			if (arg == "-topology")
+				topologyCache = value;
+			if (arg == "-nocache")
+			{
+				size_t colon = value.find(':');
+				if (colon == std::string::npos)
+				{
+					_ERRPRT("Invalid region. (%s)\n", value.c_str());
+					return EINVAL;
+				}
+				uncached.push_back({ std::stoull(value.substr(0, colon), nullptr, 0), std::stoull(value.substr(colon + 1), nullptr, 0) });
+			}
+			if (arg == "-summary")
+				return TraceTransport::summarize(value);
+			if (arg == "-sim")
+			{
+				simulated = true;
+				simConfig.latency = std::stoul(value);
+			}
+		}
+		catch (std::exception& e)
+		{
+			_ERRPRT("Invalid value. (%s %s: %s)\n", arg.c_str(), value.c_str(), e.what());
+			return EINVAL;
+		}
+	}
+
+	if (sharePort >= 0)
+		return shareProbe((uint16_t)sharePort, simulated ? &simConfig : nullptr);
+
 	startHttpServer();
 
-	if (altlink.enumerate() != OK)
-		return OK;
+	if (!replay.empty())
+	{
+		if (altlink.replay(replay) != OK)
+			return OK;
+	}
+	else if (simulated)
+	{
+		altlink.simulate(simConfig);
+	}
+	else if (remote.empty())
+	{
+		if (altlink.enumerate() != OK)
+			return OK;
+	}
+	else
+	{
+		size_t colon = remote.rfind(':');
+		if (colon == std::string::npos)
+		{
+			_ERRPRT("Invalid remote probe address. (%s)\n", remote.c_str());
+			return EINVAL;
+		}
+		uint16_t port;
+		try
+		{
+			port = (uint16_t)std::stoul(remote.substr(colon + 1));
+		}
+		catch (std::exception& e)
+		{
+			_ERRPRT("Invalid remote probe address. (%s: %s)\n", remote.c_str(), e.what());
+			return EINVAL;
+		}
+		if (altlink.connect(remote.substr(0, colon), port) != OK)
+			return OK;
+	}
 
 	auto devices = altlink.getDevices();
 	
@@ -55,6 +222,11 @@ int _tmain(int argc, _TCHAR* argv[])
 		return OK;
 	}
 
+	if (!trace.empty())
+		devices[0]->setTrace(trace);
+	if (!topologyCache.empty())
+		devices[0]->setTopologyCache(topologyCache);
+
 	if (devices[0]->open() != OK)
 		return OK;
 
@@ -102,10 +274,18 @@ int _tmain(int argc, _TCHAR* argv[])
 	if (devices[0]->setConnectionType(type) != OK)
 		return OK;
 
+	if (!tuneCache.empty())
+		(void)devices[0]->tuneSpeed(tuneCache, tuneRam);
+
 	if (devices[0]->scan() != OK)
 		return OK;
 
 	auto ti = devices[0]->getTI();
+	if (ti && ti->getMemoryCache())
+	{
+		for (auto& region : uncached)
+			ti->getMemoryCache()->addRegion(region.first, region.second, false);
+	}
 
 	//dump(ti, 0xFFFF0000, 0x80);
 	//dump(ti, 0xFFFF0000, 0x80);
@@ -5,6 +5,7 @@
 
 #include <thread>
 #include <chrono>
+#include <algorithm>
 
 #define AP_ABORT_DAPABORT 0x01     /* generate a DAP abort */
 #define AP_ABORT_STK_CMP_CLR 0x02  /* clear STICKYCMP sticky compare flag */
@@ -14,6 +15,9 @@
 
 #define BANK_REG(bank, reg) (((bank) << 4) | (reg))
 
+/* reads a value match wait makes before it times out, on the probe and the host together */
+#define MATCH_WAIT_READS 100000
+
 /* A[3:0] for DP registers; A[1:0] are always zero.
  * - JTAG accesses all of these via JTAG_DP_DPACC, except for
  *   IDCODE (JTAG_DP_IDCODE) and ABORT (JTAG_DP_ABORT).
@@ -27,6 +31,10 @@
 #define DP_RDBUFF			BANK_REG(0x0, 0xC)	/* read-only */
 #define DP_WCR				BANK_REG(0x1, 0x4)	/* SWD: r/w */
 
+/* CTRL/STAT: bits the host requests, and W1C sticky flags (JTAG-DP) */
+#define CTRL_STAT_REQUEST_MASK	0x54FFFF0D
+#define CTRL_STAT_CLEAR_MASK	0x00000032
+
 #define WCR_TO_TRN(wcr) ((uint32_t)(1 + (3 & ((wcr)) >> 8))) /* 1..4 clocks */
 #define WCR_TO_PRESCALE(wcr) ((uint32_t)(7 & ((wcr))))       /* impl defined */
 
@@ -152,6 +160,12 @@ static_assert(CONFIRM_UINT32(MEM_AP_CFG));
 /* Generic AP register address */
 #define AP_REG_IDR 0xFC
 
+/* TAR auto-increment is only guaranteed within a 1KB boundary */
+#define TAR_AUTOINC_WINDOW	0x400
+
+/* ROM table entries occupy 0x000-0xEFC */
+#define ROM_TABLE_MAX_ENTRIES	960
+
 /* Fields of the MEM-AP's CSW register */
 #define CSW_8BIT 0
 #define CSW_16BIT 1
@@ -177,6 +191,22 @@ int32_t ADIv5::getIDCODE(DP_IDCODE* idcode)
 	return dap->dpRead(DP_REG_IDCODE, &idcode->raw);
 }
 
+// IDCODE を一度にまとめて読み、すべて期待値と一致するか確認する
+int32_t ADIv5::checkIDCODE(const DP_IDCODE& expected, uint32_t count)
+{
+	std::vector<DAP::Transfer> transfers(count, DAP::Transfer::dpRead(DP_REG_IDCODE));
+	int32_t ret = dap->transfer(transfers);
+	if (ret != OK)
+		return ret;
+
+	for (auto& t : transfers)
+	{
+		if (t.data != expected.raw)
+			return CMSISDAP_ERR_VERIFY;
+	}
+	return OK;
+}
+
 void ADIv5::DP_IDCODE::print()
 {
 	_DBGPRT("  IDCODE      : 0x%08x\n", raw);
@@ -205,17 +235,92 @@ void ADIv5::DP_IDCODE::print()
 	}
 }
 
+// WAIT/FAULT ではレジスタの状態は保たれる。それ以外 (NO ACK, プロトコルエラー, 通信エラー) はどこまで届いたか分からない
+static bool isLinkError(int32_t ret)
+{
+	return ret != OK && ret != CMSISDAP_ERR_ACKFAULT && ret != CMSISDAP_ERR_ACKWAIT && ret != CMSISDAP_ERR_VALUE_MISMATCH;
+}
+
+// MEM-AP BASE のデバッグエントリ. scanAPs とトポロジキャッシュのキーで同じ判定を使う
+static bool hasDebugEntry(uint32_t base)
+{
+	if (base == 0xFFFFFFFF)
+		return false;
+	if ((base & 0x02) == 0)
+		return true;	// legacy format
+	return (base & 0x1) ? true : false;
+}
+
+void ADIv5::ShadowStats::print() const
+{
+	_DBGPRT("  Shadow registers saved %llu accesses\n", (unsigned long long)saved());
+	_DBGPRT("    SELECT: %llu CTRL/STAT: %llu CSW: %llu TAR: %llu (invalidated: %llu)\n",
+		(unsigned long long)selectWrites, (unsigned long long)ctrlStatWrites,
+		(unsigned long long)cswReads, (unsigned long long)tarWrites, (unsigned long long)invalidations);
+}
+
+void ADIv5::invalidateShadows()
+{
+	ap.selectValid = false;
+	ap.shadows.clear();
+	ctrlStatValid = false;
+	shadowStats.invalidations++;
+}
+
+void ADIv5::syncShadows()
+{
+	// 再接続の前に取った値は使えない
+	if (shadowEpoch != dap->getLinkEpoch())
+	{
+		invalidateShadows();
+		shadowEpoch = dap->getLinkEpoch();
+	}
+}
+
 int32_t ADIv5::getCtrlStat(DP_CTRL_STAT* ctrlStat)
 {
 	if (ctrlStat == nullptr)
 		return CMSISDAP_ERR_INVALID_ARGUMENT;
 
-	return dap->dpRead(DP_REG_CTRL_STAT, &ctrlStat->raw);
+	syncShadows();
+	int32_t ret = dap->dpRead(DP_REG_CTRL_STAT, &ctrlStat->raw);
+	if (ret != OK)
+	{
+		if (isLinkError(ret))
+			invalidateShadows();
+		return ret;
+	}
+
+	ctrlStatShadow = ctrlStat->raw & CTRL_STAT_REQUEST_MASK;
+	ctrlStatValid = true;
+	return OK;
 }
 
 int32_t ADIv5::setCtrlStat(DP_CTRL_STAT& ctrlStat)
 {
-	return dap->dpWrite(DP_REG_CTRL_STAT, ctrlStat.raw);
+	syncShadows();
+
+	// 要求ビットが変わらず、W1C のビットも立てていなければ書く必要はない
+	if (ctrlStatValid
+		&& (ctrlStat.raw & CTRL_STAT_REQUEST_MASK) == ctrlStatShadow
+		&& (ctrlStat.raw & CTRL_STAT_CLEAR_MASK) == 0)
+	{
+		shadowStats.ctrlStatWrites++;
+		return OK;
+	}
+
+	int32_t ret = dap->dpWrite(DP_REG_CTRL_STAT, ctrlStat.raw);
+	if (ret != OK)
+	{
+		ctrlStatValid = false;
+		if (isLinkError(ret))
+			invalidateShadows();
+		return ret;
+	}
+
+	ctrlStatShadow = ctrlStat.raw & CTRL_STAT_REQUEST_MASK;
+	ctrlStatValid = true;
+	return OK;
 }
 
 void ADIv5::DP_CTRL_STAT::print()
@@ -263,26 +368,52 @@ int32_t ADIv5::powerupDebug()
 		if (ret != OK)
 			return ret;
 
+		// CDBGPWRUPACK はプローブ側でポーリングする
+		DP_CTRL_STAT ack;
+		ack.raw = 0;
+		ack.CDBGPWRUPACK = 1;
+		uint32_t counter = 0;
 		while (1)
 		{
-			ret = getCtrlStat(&ctrlStat);
-			if (ret != OK)
-				return ret;
-
-			if (ctrlStat.CDBGPWRUPACK)
+			ret = waitForDP(DP_REG_CTRL_STAT, ack.raw, ack.raw);
+			if (ret == OK)
 				break;
+			if (ret != CMSISDAP_ERR_VALUE_MISMATCH)
+				return ret;
 
-			// [TODO] timeout
-
-			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			counter++;
+			if (counter >= ap.getMatchWaitRounds())
+			{
+				_ERRPRT("Debug power up is not acknowledged.\n");
+				return ret;
+			}
 		}
 
+		ret = getCtrlStat(&ctrlStat);
+		if (ret != OK)
+			return ret;
+
 		_DBGPRT("DBG Power up\n");
 		ctrlStat.print();
 	}
 	return OK;
 }
 
+uint32_t ADIv5::AP::getMatchWaitRounds() const
+{
+	uint32_t retry = dap.getMatchRetry();
+	return (MATCH_WAIT_READS + retry - 1) / retry;
+}
+
+int32_t ADIv5::waitForDP(uint32_t reg, uint32_t mask, uint32_t value)
+{
+	std::vector<DAP::Transfer> transfers = { DAP::Transfer::dpReadMatch(reg, mask, value) };
+	int32_t ret = dap->transfer(transfers);
+	if (isLinkError(ret))
+		invalidateShadows();
+	return ret;
+}
+
 void MEM_AP_CSW::print()
 {
 	_DBGPRT("    Control/Status    : 0x%08x\n", raw);
@@ -357,48 +488,37 @@ int32_t ADIv5::scanAPs()
 
 		if (idr.Class == AP_IDR::MemoryAccessPort)
 		{
-			bool hasDebugEntry = false;
-			uint32_t base;
-			ret = ap.read(i, MEM_AP_REG_BASE, &base);
+			// BASE, CSW と CFG (影に残る) をまとめて読む
+			std::vector<AP::Access> accesses = {
+				{ i, MEM_AP_REG_BASE, true, 0, false, 0 },
+				{ i, MEM_AP_REG_CSW, true, 0, false, 0 }
+			};
+			if (!ap.shadow(i).cfgValid)
+				accesses.push_back({ i, MEM_AP_REG_CFG, true, 0, false, 0 });
+			ret = ap.transfer(accesses);
 			if (ret != OK) {
 				return ret;
 			}
+
+			uint32_t base = accesses[0].data;
 			_DBGPRT("    BASE : 0x%08x (%x)\n", base & 0xFFFFF000, base);
-			if (base == 0xFFFFFFFF)
-			{
-				_DBGPRT("      Debug entry : no (legacy format)\n");
-			}
-			else if ((base & 0x02) == 0)
-			{
-				_DBGPRT("      Debug entry : present (legacy format)\n");
-				hasDebugEntry = true;
-			}
-			else
-			{
-				_DBGPRT("      Debug entry : %s\n", base & 0x1 ? "present" : "no");
-				hasDebugEntry = (base & 0x1) ? true : false;
-			}
+			_DBGPRT("      Debug entry : %s%s\n", hasDebugEntry(base) ? "present" : "no",
+				(base == 0xFFFFFFFF || (base & 0x02) == 0) ? " (legacy format)" : "");
 
 			if (idr.isAHB())
 			{
 				AHB_AP_CSW csw;
-				ret = ap.read(i, MEM_AP_REG_CSW, &csw.raw);
-				if (ret != OK) {
-					return ret;
-				}
+				csw.raw = accesses[1].data;
 				csw.print();
 			}
 			else
 			{
 				MEM_AP_CSW csw;
-				ret = ap.read(i, MEM_AP_REG_CSW, &csw.raw);
-				if (ret != OK) {
-					return ret;
-				}
+				csw.raw = accesses[1].data;
 				csw.print();
 			}
 
-			if (!hasDebugEntry)
+			if (!hasDebugEntry(base))
 			{
 				// Debug Entry なしの AHB bus は sysmem なので登録する
 				if (idr.isAHB())
@@ -448,29 +568,261 @@ int32_t ADIv5::scanAPs()
 	return OK;
 }
 
+errno_t ADIv5::readTopologyKey(TopologyKey* key)
+{
+	ASSERT_RELEASE(key != nullptr);
+
+	DP_IDCODE idcode;
+	errno_t ret = getIDCODE(&idcode);
+	if (ret != OK)
+		return ret;
+
+	AP_IDR idr;
+	ret = ap.read(0, AP_REG_IDR, &idr.raw);
+	if (ret != OK)
+		return ret;
+
+	key->idcode = idcode.raw;
+	key->idr = idr.raw;
+	key->base = 0;
+	key->pid = 0;
+	key->cid = 0;
+
+	// BASE と CFG は MEM-AP にしかない. CFG は影に残る
+	if (idr.Class != AP_IDR::MemoryAccessPort)
+		return OK;
+
+	std::vector<AP::Access> accesses = {
+		{ 0, MEM_AP_REG_BASE, true, 0, false, 0 },
+		{ 0, MEM_AP_REG_CFG, true, 0, false, 0 }
+	};
+	ret = ap.transfer(accesses);
+	if (ret != OK)
+		return ret;
+	key->base = accesses[0].data;
+
+	if (hasDebugEntry(key->base))
+	{
+		MEM_AP memAp(0, ap);
+		Component root(Memory(memAp, key->base & 0xFFFFF000));
+		ret = root.readPidCid();
+		if (ret != OK)
+			return ret;
+		key->pid = root.getPid().raw;
+		key->cid = root.getCid().raw;
+	}
+	return OK;
+}
+
+void ADIv5::getTopology(Topology* topology) const
+{
+	ASSERT_RELEASE(topology != nullptr);
+
+	topology->aps.clear();
+	for (auto& a : aps)
+	{
+		Topology::Ap t = {};
+		t.index = a.first;
+		t.idr = a.second.raw;
+
+		for (auto& memAp : memAps)
+		{
+			if (memAp.first->getIndex() == a.first)
+			{
+				t.hasRomTable = true;
+				memAp.second.getTopology(&t.rom);
+			}
+		}
+		for (auto& memAp : ahbSysmemAps)
+		{
+			if (memAp->getIndex() == a.first)
+				t.ahbSysmem = true;
+		}
+		topology->aps.push_back(t);
+	}
+}
+
+errno_t ADIv5::setTopology(const Topology& topology)
+{
+	// IDR を一括で読み直し、スキャンが止まる位置 (IDR == 0) まで一致することを確認する
+	std::vector<AP::Access> accesses;
+	for (auto& a : topology.aps)
+		accesses.push_back({ a.index, AP_REG_IDR, true, 0, false, 0 });
+	uint32_t next = topology.aps.empty() ? 0 : topology.aps.back().index + 1;
+	if (next < 255)
+		accesses.push_back({ next, AP_REG_IDR, true, 0, false, 0 });
+	size_t idrs = accesses.size();
+
+	// MEM-AP の CFG も同じバッチで影に読んでおく
+	for (auto& a : topology.aps)
+	{
+		if ((a.ahbSysmem || a.hasRomTable) && !ap.shadow(a.index).cfgValid)
+			accesses.push_back({ a.index, MEM_AP_REG_CFG, true, 0, false, 0 });
+	}
+
+	errno_t ret = ap.transfer(accesses);
+	if (ret != OK)
+		return ret;
+
+	for (size_t i = 0; i < idrs; i++)
+	{
+		uint32_t expected = (i < topology.aps.size()) ? topology.aps[i].idr : 0;
+		if (accesses[i].data != expected)
+		{
+			_DBGPRT("AP #%d IDR 0x%08x does not match the cached topology (0x%08x)\n", accesses[i].ap, accesses[i].data, expected);
+			return CMSISDAP_ERR_VERIFY;
+		}
+	}
+
+	aps.clear();
+	memAps.clear();
+	ahbSysmemAps.clear();
+	for (auto& a : topology.aps)
+	{
+		AP_IDR idr;
+		idr.raw = a.idr;
+		aps.push_back(std::make_pair(a.index, idr));
+
+		if (a.ahbSysmem)
+			ahbSysmemAps.push_back(std::make_shared<MEM_AP>(a.index, ap));
+
+		if (a.hasRomTable)
+		{
+			std::shared_ptr<MEM_AP> memAp = std::make_shared<MEM_AP>(a.index, ap);
+			std::shared_ptr<Component> component = std::make_shared<Component>(Memory(*memAp, a.rom.base));
+			component->setPidCid(a.rom.pid, a.rom.cid);
+			memAps.push_back(std::make_pair(memAp, ROM_TABLE(component)));
+			memAps.back().second.setTopology(a.rom);
+		}
+	}
+	_DBGPRT("AP SCAN (cached) : %d APs, %d ROM tables\n", (int)aps.size(), (int)memAps.size());
+	return OK;
+}
+
+static uint32_t makeSelect(uint32_t ap, uint32_t bank)
+{
+	/* APSEL, APBANKSEL を設定 */
+	DP_SELECT select;
+	select.APSEL = ap;
+	select.Reserved[0] = 0;
+	select.Reserved[1] = 0;
+	select.APBANKSEL = bank >> 4;
+	select.DPBANKSEL = 0;
+	return select.raw;
+}
+
 int32_t ADIv5::AP::select(uint32_t ap, uint32_t reg)
 {
 	uint32_t bank = reg & 0xF0;
 
-	if (ap != lastAp || bank != lastApBank)
+	adi.syncShadows();
+	if (selectValid && ap == lastAp && bank == lastApBank)
 	{
-		/* APSEL, APBANKSEL を設定 */
-		DP_SELECT select;
-		select.APSEL = ap;
-		select.Reserved[0] = 0;
-		select.Reserved[1] = 0;
-		select.APBANKSEL = bank >> 4;
-		select.DPBANKSEL = 0;
+		stats().selectWrites++;
+		return OK;
+	}
 
-		int ret = dap.dpWrite(DP_REG_SELECT, select.raw);
-		if (ret != OK) {
-			return ret;
+	int ret = dap.dpWrite(DP_REG_SELECT, makeSelect(ap, bank));
+	if (ret != OK) {
+		selectValid = false;
+		invalidate(ap, ret);
+		return ret;
+	}
+
+	selectValid = true;
+	lastAp = ap;
+	lastApBank = bank;
+	return OK;
+}
+
+ADIv5::AP::Shadow& ADIv5::AP::shadow(uint32_t ap)
+{
+	adi.syncShadows();
+	return shadows[ap];
+}
+
+/*
+ * 成功したアクセスを CSW/TAR の影に反映する
+ * count: DRW への連続アクセス数 (TAR の自動インクリメント分)
+ */
+void ADIv5::AP::track(uint32_t ap, uint32_t reg, bool read, uint32_t data, size_t count)
+{
+	Shadow& s = shadows[ap];
+	switch (reg)
+	{
+	case MEM_AP_REG_CSW:
+		s.csw = data;
+		s.cswValid = true;
+		break;
+
+	case MEM_AP_REG_TAR:
+		s.tar = data;
+		s.tarValid = true;
+		break;
+
+	case MEM_AP_REG_TAR2:
+		s.tar2 = data;
+		s.tar2Valid = true;
+		break;
+
+	case MEM_AP_REG_CFG:
+		if (read)
+		{
+			s.cfg = data;
+			s.cfgValid = true;
 		}
+		break;
+
+	case MEM_AP_REG_DRW:
+	{
+		if (!s.tarValid)
+			break;
+
+		MEM_AP_CSW csw;
+		csw.raw = s.csw;
+		uint32_t step;
+		if (!s.cswValid)
+			step = TAR_AUTOINC_WINDOW;
+		else if (csw.AddrInc == MEM_AP::ADDRINC_OFF)
+			step = 0;
+		else if (csw.AddrInc == MEM_AP::ADDRINC_SINGLE && csw.Size > MEM_AP::SIZE_32BIT)
+			step = (count % 2 == 0) ? 4 : TAR_AUTOINC_WINDOW;	// 64-bit 以上は DRW 2 回以上で 1 転送
+		else if (csw.AddrInc == MEM_AP::ADDRINC_SINGLE)
+			step = 1 << csw.Size;
+		else if (csw.AddrInc == MEM_AP::ADDRINC_PACKED)
+			step = 4;
+		else
+			step = TAR_AUTOINC_WINDOW;
 
-		lastAp = ap;
-		lastApBank = bank;
+		// 自動インクリメントが保証されるのは 1KB の範囲内だけ
+		uint64_t tar = s.tar + (uint64_t)step * count;
+		if (tar / TAR_AUTOINC_WINDOW != s.tar / TAR_AUTOINC_WINDOW)
+			s.tarValid = false;
+		else
+			s.tar = (uint32_t)tar;
+		break;
+	}
+
+	default:
+		break;
+	}
+}
+
+void ADIv5::AP::invalidate(uint32_t ap, int32_t error)
+{
+	if (isLinkError(error))
+	{
+		adi.invalidateShadows();
+		return;
+	}
+
+	// 失敗したアクセスで TAR が進んだかは分からない
+	auto it = shadows.find(ap);
+	if (it != shadows.end())
+	{
+		it->second.tarValid = false;
+		it->second.tar2Valid = false;
 	}
-	return OK;
 }
 
 errno_t ADIv5::clearError()
@@ -488,6 +840,10 @@ errno_t ADIv5::clearError()
 			_DBGPRT("Protocol Error is detected. ");
 		_DBGPRT("Trying to clear... ");
 
+		// 書き込みデータのパリティエラーでは、どの書き込みが失われたか分からない
+		if (ctrlStat.WDATAERR)
+			invalidateShadows();
+
 		if (dap->getConnectionType() == DAP::JTAG)
 		{
 			ret = setCtrlStat(ctrlStat);
@@ -579,11 +935,20 @@ int32_t ADIv5::AP::read(uint32_t ap, uint32_t reg, uint32_t *data)
 	ret = dap.apRead(reg, data);
 	if (ret != OK)
 	{
+		invalidate(ap, ret);
 		errno_t ret2 = checkStatus(ap);
 		if (ret2 != OK)
 			return ret;
-		ret = dap.apRead(reg, data);
+		ret = select(ap, reg);
+		if (ret == OK)
+			ret = dap.apRead(reg, data);
+		if (ret != OK)
+		{
+			invalidate(ap, ret);
+			return ret;
+		}
 	}
+	track(ap, reg, true, *data);
 	return ret;
 }
 
@@ -603,179 +968,1363 @@ int32_t ADIv5::AP::write(uint32_t ap, uint32_t reg, uint32_t data)
 	ret = dap.apWrite(reg, data);
 	if (ret != OK)
 	{
+		invalidate(ap, ret);
 		errno_t ret2 = checkStatus(ap);
 		if (ret2 != OK)
 			return ret;
-		ret = dap.apWrite(reg, data);
+		ret = select(ap, reg);
+		if (ret == OK)
+			ret = dap.apWrite(reg, data);
+		if (ret != OK)
+		{
+			invalidate(ap, ret);
+			return ret;
+		}
 	}
+	track(ap, reg, false, data);
 	return ret;
 }
 
-bool ADIv5::MEM_AP::isSameTAR(uint32_t addr)
-{
-	if (lastTAR == addr)
-		return true;
-	return false;
-}
-
-bool ADIv5::MEM_AP::isSame32BitAlignedTAR(uint32_t addr, uint32_t* reg)
+int32_t ADIv5::AP::readBlock(uint32_t ap, uint32_t reg, uint32_t* data, size_t count, size_t* done)
 {
-	if (reg == nullptr)
-		return false;
+	*done = 0;
 
-	if ((lastTAR & 0xFFFFFFF0) == (addr & 0xFFFFFFF0))
+	int ret = select(ap, reg);
+	if (ret != OK)
 	{
-		if ((addr & 0xF) == 0x0)
-			*reg = MEM_AP_REG_BD0;
-		else if ((addr & 0xF) == 0x4)
-			*reg = MEM_AP_REG_BD1;
-		else if ((addr & 0xF) == 0x8)
-			*reg = MEM_AP_REG_BD2;
-		else if ((addr & 0xF) == 0xC)
-			*reg = MEM_AP_REG_BD3;
-		return true;
+		errno_t ret2 = checkStatus(ap);
+		if (ret2 != OK)
+			return ret;
+		ret = select(ap, reg);
 	}
-	return false;
-}
-
-bool ADIv5::MEM_AP::is32BitAligned(uint32_t addr)
-{
-	if ((addr & 0x3) == 0)
-		return true;
-	return false;
-}
-
-bool ADIv5::MEM_AP::is16BitAligned(uint32_t addr)
-{
-	if ((addr & 0x1) == 0)
-		return true;
-	return false;
-}
-
-int32_t ADIv5::MEM_AP::read(uint32_t addr, uint32_t *data)
-{
-	uint32_t reg;
-	errno_t ret = setAccessSize(SIZE_32BIT);
 	if (ret != OK)
 		return ret;
 
-	if (is32BitAligned(lastTAR) && isSame32BitAlignedTAR(addr, &reg))
+	ret = dap.apReadBlock(reg, data, count, done);
+	if (ret == OK && adi.isDeferredErrorCheck())
 	{
-		ret = ap.read(index, reg, data);
+		// 途中で失敗していても ACK では分からないので、ブロック全体をやり直させる
+		ret = checkSticky(ap);
 		if (ret != OK)
-			return ret;
+			*done = 0;
 	}
-	else
+	if (*done > 0)
+		track(ap, reg, true, data[*done - 1], *done);
+	if (ret != OK)
 	{
-		ret = ap.write(index, MEM_AP_REG_TAR, addr);
-		if (ret != OK) {
-			return ret;
-		}
-		lastTAR = addr;
-
-		ret = ap.read(index, MEM_AP_REG_DRW, data);
-		if (ret != OK) {
-			return ret;
-		}
+		// the caller resumes from *done, just clear the error here
+		invalidate(ap, ret);
+		checkStatus(ap);
 	}
-	return OK;
+	return ret;
 }
 
-int32_t ADIv5::MEM_AP::write(uint32_t addr, uint32_t val)
+int32_t ADIv5::AP::writeBlock(uint32_t ap, uint32_t reg, const uint32_t* data, size_t count, size_t* done)
 {
-	uint32_t reg;
-	ASSERT_RELEASE(is32BitAligned(addr));
+	*done = 0;
 
-	errno_t ret = setAccessSize(SIZE_32BIT);
+	int ret = select(ap, reg);
 	if (ret != OK)
-		return ret;
-
-	if (is32BitAligned(lastTAR) && isSame32BitAlignedTAR(addr, &reg))
 	{
-		ret = ap.write(index, reg, val);
-		if (ret != OK)
-			return ret;
+		errno_t ret2 = checkStatus(ap);
+		if (ret2 != OK)
+			return ret;
+		ret = select(ap, reg);
+	}
+	if (ret != OK)
+		return ret;
+
+	ret = dap.apWriteBlock(reg, data, count, done);
+	if (ret == OK && adi.isDeferredErrorCheck())
+	{
+		ret = checkSticky(ap);
+		if (ret != OK)
+			*done = 0;
+	}
+	if (*done > 0)
+		track(ap, reg, false, data[*done - 1], *done);
+	if (ret != OK)
+	{
+		invalidate(ap, ret);
+		checkStatus(ap);
+	}
+	return ret;
+}
+
+/*
+ * ブロック転送の後で STICKYERR/WDATAERR を確認する
+ */
+int32_t ADIv5::AP::checkSticky(uint32_t ap)
+{
+	DP_CTRL_STAT ctrlStat;
+	int32_t ret = adi.getCtrlStat(&ctrlStat);
+	if (ret != OK)
+		return ret;
+
+	if (ctrlStat.STICKYERR || ctrlStat.WDATAERR)
+	{
+		_DBGPRT("Sticky error after block transfer on AP #%d\n", ap);
+		return CMSISDAP_ERR_ACKFAULT;
+	}
+	return OK;
+}
+
+int32_t ADIv5::AP::transfer(std::vector<Access>& accesses, size_t* failed)
+{
+	size_t index = accesses.size();
+	int32_t ret = replay(accesses, 0, accesses.size(), &index);
+	if (ret != OK && ret != CMSISDAP_ERR_VALUE_MISMATCH && index < accesses.size())
+	{
+		// clear error and retry the rest of the batch
+		errno_t ret2 = checkStatus(accesses[index].ap);
+		if (ret2 == OK)
+			ret = replay(accesses, index, accesses.size(), &index);
+	}
+	if (failed != nullptr)
+		*failed = (ret == OK) ? accesses.size() : index;
+	return ret;
+}
+
+/*
+ * [offset, end) を転送し、遅延チェックで STICKYERR が見つかったら半分ずつ再実行して
+ * 失敗したアクセスを特定する。ACK で失敗が分かった場合はそのまま返す。
+ */
+int32_t ADIv5::AP::replay(std::vector<Access>& accesses, size_t offset, size_t end, size_t* failed)
+{
+	if (offset == end)
+		return OK;
+
+	bool sticky = false;
+	int32_t ret = transfer(accesses, offset, end, failed, &sticky);
+	if (ret != OK || !sticky)
+		return ret;
+
+	// どのアクセスまで実行されたか分からないので、範囲内の TAR は信用しない
+	for (size_t i = offset; i < end; i++)
+		invalidate(accesses[i].ap, CMSISDAP_ERR_ACKFAULT);
+
+	errno_t ret2 = adi.clearError();
+	if (ret2 != OK)
+	{
+		*failed = offset;
+		return ret2;
+	}
+
+	if (end - offset == 1)
+	{
+		_DBGPRT("Sticky error at AP #%d reg 0x%02x\n", accesses[offset].ap, accesses[offset].reg);
+		*failed = offset;
+		return CMSISDAP_ERR_ACKFAULT;
+	}
+
+	size_t mid = offset + (end - offset) / 2;
+	ret = replay(accesses, offset, mid, failed);
+	if (ret != OK)
+		return ret;
+	return replay(accesses, mid, end, failed);
+}
+
+int32_t ADIv5::AP::transfer(std::vector<Access>& accesses, size_t offset, size_t end, size_t* failed, bool* sticky)
+{
+	std::vector<DAP::Transfer> transfers;
+	std::vector<size_t> origin;	// index of the access each transfer belongs to
+
+	adi.syncShadows();
+	bool valid = selectValid;
+	uint32_t ap = lastAp;
+	uint32_t bank = lastApBank;
+	if (valid && offset < accesses.size() && accesses[offset].ap == ap && (accesses[offset].reg & 0xF0) == bank)
+		stats().selectWrites++;
+
+	for (size_t i = offset; i < end; i++)
+	{
+		const Access& a = accesses[i];
+		if (!valid || a.ap != ap || (a.reg & 0xF0) != bank)
+		{
+			valid = true;
+			ap = a.ap;
+			bank = a.reg & 0xF0;
+			transfers.push_back(DAP::Transfer::dpWrite(DP_REG_SELECT, makeSelect(ap, bank)));
+			origin.push_back(i);
+		}
+		if (a.read && a.match)
+			transfers.push_back(DAP::Transfer::apReadMatch(a.reg, a.mask, a.data));
+		else
+			transfers.push_back(a.read ? DAP::Transfer::apRead(a.reg) : DAP::Transfer::apWrite(a.reg, a.data));
+		origin.push_back(i);
+	}
+
+	// 同じパケットの末尾で CTRL/STAT を読む (SELECT.DPBANKSEL は常に 0)
+	*sticky = false;
+	bool deferred = adi.isDeferredErrorCheck();
+	if (deferred)
+	{
+		transfers.push_back(DAP::Transfer::dpRead(DP_REG_CTRL_STAT));
+		origin.push_back(end);
+	}
+
+	size_t done = 0;
+	int32_t ret = dap.transfer(transfers, &done);
+	if (ret == OK)
+		done = transfers.size();
+	else if (done >= transfers.size())
+	{
+		// 最後の AP 書き込みの FAULT/WAIT は RDBUFF の確認で分かるので、転送数には含まれている
+		done = transfers.size() - 1;
+	}
+
+	if (deferred && done == transfers.size())
+	{
+		DP_CTRL_STAT ctrlStat;
+		ctrlStat.raw = transfers.back().data;
+		*sticky = ctrlStat.STICKYERR || ctrlStat.WDATAERR;
+		transfers.pop_back();
+		origin.pop_back();
+		done--;
+	}
+
+	for (size_t i = 0; i < done; i++)
+	{
+		const DAP::Transfer& t = transfers[i];
+		if (!t.ap)
+		{
+			DP_SELECT select;
+			select.raw = t.data;
+			selectValid = true;
+			lastAp = select.APSEL;
+			lastApBank = select.APBANKSEL << 4;
+		}
+		else if (t.match)
+		{
+			// 照合はプローブ側で何回読んだか分からない
+			if (t.reg == MEM_AP_REG_DRW)
+				shadows[accesses[origin[i]].ap].tarValid = false;
+		}
+		else
+		{
+			if (t.read)
+				accesses[origin[i]].data = t.data;
+			track(accesses[origin[i]].ap, t.reg, t.read, t.data);
+		}
+	}
+
+	if (ret != OK)
+	{
+		// CTRL/STAT の読み出しで失敗した場合は end を返す
+		*failed = origin[done];
+		if (*failed == end)
+		{
+			adi.invalidateShadows();
+			return ret;
+		}
+		if (!transfers[done].ap)
+			selectValid = false;
+		invalidate(accesses[*failed].ap, ret);
+	}
+	return ret;
+}
+
+bool ADIv5::MEM_AP::isSameTAR(uint32_t addr)
+{
+	AP::Shadow& shadow = ap.shadow(index);
+	if (shadow.tarValid && shadow.tar == addr)
+		return true;
+	return false;
+}
+
+bool ADIv5::MEM_AP::isSame32BitAlignedTAR(uint32_t addr, uint32_t* reg)
+{
+	if (reg == nullptr)
+		return false;
+
+	AP::Shadow& shadow = ap.shadow(index);
+	if (shadow.tarValid && is32BitAligned(shadow.tar) && (shadow.tar & 0xFFFFFFF0) == (addr & 0xFFFFFFF0))
+	{
+		if ((addr & 0xF) == 0x0)
+			*reg = MEM_AP_REG_BD0;
+		else if ((addr & 0xF) == 0x4)
+			*reg = MEM_AP_REG_BD1;
+		else if ((addr & 0xF) == 0x8)
+			*reg = MEM_AP_REG_BD2;
+		else if ((addr & 0xF) == 0xC)
+			*reg = MEM_AP_REG_BD3;
+		return true;
+	}
+	return false;
+}
+
+bool ADIv5::MEM_AP::is32BitAligned(uint32_t addr)
+{
+	if ((addr & 0x3) == 0)
+		return true;
+	return false;
+}
+
+bool ADIv5::MEM_AP::is16BitAligned(uint32_t addr)
+{
+	if ((addr & 0x1) == 0)
+		return true;
+	return false;
+}
+
+int32_t ADIv5::MEM_AP::read(uint32_t addr, uint32_t *data)
+{
+	uint32_t reg;
+	errno_t ret = setAccessSize(SIZE_32BIT);
+	if (ret == OK)
+		ret = setUpperTAR(0);
+	if (ret != OK)
+		return ret;
+
+	if (isSame32BitAlignedTAR(addr, &reg))
+	{
+		ap.stats().tarWrites++;
+		ret = ap.read(index, reg, data);
+		if (ret != OK)
+			return ret;
+	}
+	else
+	{
+		ret = ap.write(index, MEM_AP_REG_TAR, addr);
+		if (ret != OK) {
+			return ret;
+		}
+
+		ret = ap.read(index, MEM_AP_REG_DRW, data);
+		if (ret != OK) {
+			return ret;
+		}
+	}
+	return OK;
+}
+
+int32_t ADIv5::MEM_AP::write(uint32_t addr, uint32_t val)
+{
+	uint32_t reg;
+	ASSERT_RELEASE(is32BitAligned(addr));
+
+	errno_t ret = setAccessSize(SIZE_32BIT);
+	if (ret == OK)
+		ret = setUpperTAR(0);
+	if (ret != OK)
+		return ret;
+
+	if (isSame32BitAlignedTAR(addr, &reg))
+	{
+		ap.stats().tarWrites++;
+		ret = ap.write(index, reg, val);
+		if (ret != OK)
+			return ret;
+	}
+	else
+	{
+		int ret = ap.write(index, MEM_AP_REG_TAR, addr);
+		if (ret != OK) {
+			return ret;
+		}
+
+		ret = ap.write(index, MEM_AP_REG_DRW, val);
+		if (ret != OK) {
+			return ret;
+		}
+	}
+	return OK;
+}
+
+int32_t ADIv5::MEM_AP::write(uint32_t addr, uint16_t val)
+{
+	ASSERT_RELEASE(is16BitAligned(addr));
+
+	errno_t ret = setAccessSize(SIZE_16BIT);
+	if (ret != OK)
+		return ret;
+
+	ret = setTAR(addr);
+	if (ret != OK)
+		return ret;
+
+	ret = ap.write(index, MEM_AP_REG_DRW, (addr & 2) ? ((uint32_t)val) << 16 : val);
+	if (ret != OK)
+		return ret;
+
+	return OK;
+}
+
+int32_t ADIv5::MEM_AP::write(uint32_t addr, uint8_t val)
+{
+	errno_t ret = setAccessSize(SIZE_8BIT);
+	if (ret != OK)
+		return ret;
+
+	ret = setTAR(addr);
+	if (ret != OK)
+		return ret;
+
+	ret = ap.write(index, MEM_AP_REG_DRW,
+		(addr & 3) == 3 ? ((uint32_t)val) << 24 :
+		(addr & 3) == 2 ? ((uint32_t)val) << 16 :
+		(addr & 3) == 1 ? ((uint32_t)val) <<  8 : val );
+	if (ret != OK)
+		return ret;
+
+	return OK;
+}
+int32_t ADIv5::MEM_AP::read(uint32_t addr, uint16_t* data)
+{
+	ASSERT_RELEASE(is16BitAligned(addr));
+
+	errno_t ret = setAccessSize(SIZE_16BIT);
+	if (ret != OK)
+		return ret;
+
+	ret = setTAR(addr);
+	if (ret != OK)
+		return ret;
+
+	uint32_t val;
+	ret = ap.read(index, MEM_AP_REG_DRW, &val);
+	if (ret != OK)
+		return ret;
+
+	*data = (uint16_t)(val >> ((addr & 2) * 8));
+	return OK;
+}
+
+int32_t ADIv5::MEM_AP::read(uint32_t addr, uint8_t* data)
+{
+	errno_t ret = setAccessSize(SIZE_8BIT);
+	if (ret != OK)
+		return ret;
+
+	ret = setTAR(addr);
+	if (ret != OK)
+		return ret;
+
+	uint32_t val;
+	ret = ap.read(index, MEM_AP_REG_DRW, &val);
+	if (ret != OK)
+		return ret;
+
+	*data = (uint8_t)(val >> ((addr & 3) * 8));
+	return OK;
+}
+
+errno_t ADIv5::MEM_AP::transfer(std::vector<Access>& accesses)
+{
+	errno_t ret = setAccessSize(SIZE_32BIT);
+	if (ret == OK)
+		ret = setUpperTAR(0);
+	if (ret != OK)
+		return ret;
+
+	// 同じ 16 バイト境界内は TAR を書き直さず BDx でアクセスする
+	std::vector<AP::Access> apAccesses;
+	std::vector<size_t> origin;
+	AP::Shadow& shadow = ap.shadow(index);
+	uint32_t tar = shadow.tar;
+	bool tarValid = shadow.tarValid && is32BitAligned(shadow.tar);
+	for (size_t i = 0; i < accesses.size(); i++)
+	{
+		const Access& a = accesses[i];
+		ASSERT_RELEASE(is32BitAligned(a.addr));
+
+		if (!tarValid || (tar & 0xFFFFFFF0) != (a.addr & 0xFFFFFFF0))
+		{
+			tar = a.addr & 0xFFFFFFF0;
+			tarValid = true;
+			apAccesses.push_back({ index, MEM_AP_REG_TAR, false, tar, false, 0 });
+			origin.push_back(i);
+		}
+		else if (i == 0)
+		{
+			ap.stats().tarWrites++;
+		}
+		apAccesses.push_back({ index, MEM_AP_REG_BD0 + (a.addr & 0xC), a.read, a.data, a.match, a.mask });
+		origin.push_back(i);
+	}
+
+	ret = ap.transfer(apAccesses);
+	if (ret != OK)
+		return ret;
+
+	for (size_t i = 0; i < apAccesses.size(); i++)
+	{
+		if (apAccesses[i].read && !apAccesses[i].match)
+			accesses[origin[i]].data = apAccesses[i].data;
+	}
+	return OK;
+}
+
+errno_t ADIv5::MEM_AP::read(const std::vector<uint32_t>& addrs, std::vector<uint32_t>* data)
+{
+	if (data == nullptr)
+		return EINVAL;
+
+	Planner planner;
+	for (auto addr : addrs)
+		planner.read(*this, addr);
+
+	errno_t ret = planner.execute();
+	if (ret != OK)
+		return ret;
+
+	data->clear();
+	for (size_t i = 0; i < planner.size(); i++)
+		data->push_back(planner.getData(i));
+	return OK;
+}
+
+errno_t ADIv5::MEM_AP::waitFor(uint32_t addr, uint32_t mask, uint32_t value, uint32_t* data)
+{
+	std::vector<Access> accesses = { { addr, true, value, true, mask } };
+	if (data != nullptr)
+		accesses.push_back({ addr, true, 0, false, 0 });
+
+	errno_t ret = transfer(accesses);
+	if (ret == OK)
+	{
+		if (data != nullptr)
+			*data = accesses.back().data;
+	}
+	else if (ret == CMSISDAP_ERR_VALUE_MISMATCH && data != nullptr)
+	{
+		errno_t ret2 = read(addr, data);
+		if (ret2 != OK)
+			return ret2;
+	}
+	return ret;
+}
+
+static const size_t NO_OP = (size_t)-1;
+
+size_t ADIv5::Planner::add(AP& ap, const Op& op)
+{
+	ASSERT_RELEASE(owner == nullptr || owner == &ap);
+	owner = &ap;
+	ops.push_back(op);
+	return ops.size() - 1;
+}
+
+size_t ADIv5::Planner::read(MEM_AP& mem, uint32_t addr, bool ordered)
+{
+	ASSERT_RELEASE((addr & 0x3) == 0);
+	return add(mem.ap, { &mem, mem.index, addr, true, 0, false, 0, ordered, false });
+}
+
+size_t ADIv5::Planner::write(MEM_AP& mem, uint32_t addr, uint32_t data, bool ordered)
+{
+	ASSERT_RELEASE((addr & 0x3) == 0);
+	return add(mem.ap, { &mem, mem.index, addr, false, data, false, 0, ordered, false });
+}
+
+size_t ADIv5::Planner::waitFor(MEM_AP& mem, uint32_t addr, uint32_t mask, uint32_t value)
+{
+	ASSERT_RELEASE((addr & 0x3) == 0);
+	return add(mem.ap, { &mem, mem.index, addr, true, value, true, mask, true, false });
+}
+
+size_t ADIv5::Planner::read(AP& ap, uint32_t index, uint32_t reg)
+{
+	ASSERT_RELEASE(reg > MEM_AP_REG_BD3);
+	return add(ap, { nullptr, index, reg, true, 0, false, 0, true, false });
+}
+
+size_t ADIv5::Planner::write(AP& ap, uint32_t index, uint32_t reg, uint32_t data)
+{
+	ASSERT_RELEASE(reg > MEM_AP_REG_BD3);
+	return add(ap, { nullptr, index, reg, false, data, false, 0, true, false });
+}
+
+/*
+ * BDx も DRW も 32-bit でアクセスし、TAR2 は 0 にしておく
+ */
+errno_t ADIv5::Planner::prepare()
+{
+	std::vector<MEM_AP*> mems;
+	for (auto& op : ops)
+	{
+		if (op.mem != nullptr && std::find(mems.begin(), mems.end(), op.mem) == mems.end())
+			mems.push_back(op.mem);
+	}
+
+	for (auto mem : mems)
+	{
+		AP::Shadow& shadow = ap().shadow(mem->index);
+		MEM_AP_CSW csw;
+		csw.raw = shadow.csw;
+		errno_t ret = OK;
+		if (!shadow.cswValid || csw.Size != MEM_AP::SIZE_32BIT)
+			ret = mem->setCSW(MEM_AP::SIZE_32BIT, MEM_AP::ADDRINC_OFF);
+		if (ret == OK)
+			ret = mem->setUpperTAR(0);
+		if (ret != OK)
+			return ret;
+	}
+	return OK;
+}
+
+static size_t countSelects(const std::vector<ADIv5::AP::Access>& accesses, bool valid, uint32_t ap, uint32_t bank)
+{
+	size_t n = 0;
+	for (auto& a : accesses)
+	{
+		if (!valid || a.ap != ap || (a.reg & 0xF0) != bank)
+		{
+			n++;
+			valid = true;
+			ap = a.ap;
+			bank = a.reg & 0xF0;
+		}
+	}
+	return n;
+}
+
+/*
+ * optimize: false なら登録順に BDx だけでアクセスする (MEM_AP::transfer と同じ)
+ */
+void ADIv5::Planner::build(bool optimize, std::vector<AP::Access>* accesses, std::vector<size_t>* origin, Summary* summary)
+{
+	struct State
+	{
+		uint32_t csw;
+		bool tarValid;
+		uint32_t tar;
+	};
+	std::map<uint32_t, State> states;
+
+	ap().adi.syncShadows();
+	bool selectValid = ap().selectValid;
+	uint32_t selectAp = ap().lastAp;
+	uint32_t selectBank = ap().lastApBank;
+
+	std::vector<size_t> order(ops.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+
+	if (optimize)
+	{
+		// 順序付きのアクセスの間を AP、アドレスの順に並べる。選択中の AP を先にする
+		uint32_t first = selectAp;
+		size_t begin = 0;
+		while (begin < ops.size())
+		{
+			size_t end = begin;
+			while (end < ops.size() && !ops[end].ordered)
+				end++;
+
+			std::stable_sort(order.begin() + begin, order.begin() + end, [&](size_t a, size_t b) {
+				uint32_t apA = ops[a].ap;
+				uint32_t apB = ops[b].ap;
+				if (apA != apB)
+				{
+					if (apA == first || apB == first)
+						return apA == first;
+					return apA < apB;
+				}
+				return ops[a].addr < ops[b].addr;
+			});
+
+			if (end < ops.size())
+				first = ops[end].ap;
+			else if (end > begin)
+				first = ops[order[end - 1]].ap;
+			begin = end + 1;
+		}
+	}
+
+	for (size_t i = 0; i < order.size(); )
+	{
+		const Op& op = ops[order[i]];
+		uint32_t ap = op.ap;
+
+		// AP のレジスタはそのまま
+		if (op.mem == nullptr)
+		{
+			accesses->push_back({ ap, op.addr, op.read, op.data, false, 0 });
+			origin->push_back(order[i]);
+			selectValid = true;
+			selectAp = ap;
+			selectBank = op.addr & 0xF0;
+			i++;
+			continue;
+		}
+
+		auto it = states.find(ap);
+		if (it == states.end())
+		{
+			AP::Shadow& shadow = this->ap().shadow(ap);
+			it = states.insert({ ap, { shadow.csw, shadow.tarValid && (shadow.tar & 0x3) == 0, shadow.tar } }).first;
+		}
+		State& state = it->second;
+
+		// 同じ向きで連続するアドレス
+		size_t n = 1;
+		if (optimize && !op.ordered)
+		{
+			while (i + n < order.size())
+			{
+				const Op& next = ops[order[i + n]];
+				if (next.ordered || next.ap != ap || next.read != op.read || next.addr != op.addr + (uint32_t)n * 4)
+					break;
+				n++;
+			}
+		}
+
+		// 16 バイト境界ごとに TAR を書いて BDx でアクセスする
+		std::vector<AP::Access> bd;
+		std::vector<size_t> bdOrigin;
+		State bdState = state;
+		size_t bdTars = 0;
+		for (size_t k = 0; k < n; k++)
+		{
+			const Op& o = ops[order[i + k]];
+			if (!bdState.tarValid || (bdState.tar & 0xFFFFFFF0) != (o.addr & 0xFFFFFFF0))
+			{
+				bdState.tar = o.addr & 0xFFFFFFF0;
+				bdState.tarValid = true;
+				bd.push_back({ ap, MEM_AP_REG_TAR, false, bdState.tar, false, 0 });
+				bdOrigin.push_back(NO_OP);
+				bdTars++;
+			}
+			bd.push_back({ ap, MEM_AP_REG_BD0 + (o.addr & 0xC), o.read, o.data, o.match, o.mask });
+			bdOrigin.push_back(order[i + k]);
+		}
+
+		// TAR の自動インクリメントで DRW にアクセスする (BDx と違いバンクが TAR と同じ)
+		std::vector<AP::Access> drw;
+		std::vector<size_t> drwOrigin;
+		State drwState = state;
+		size_t drwTars = 0;
+		size_t drwCsws = 0;
+		if (optimize && !op.match)
+		{
+			MEM_AP_CSW csw;
+			csw.raw = drwState.csw;
+			if (csw.AddrInc != MEM_AP::ADDRINC_SINGLE)
+			{
+				csw.AddrInc = MEM_AP::ADDRINC_SINGLE;
+				drwState.csw = csw.raw;
+				drw.push_back({ ap, MEM_AP_REG_CSW, false, csw.raw, false, 0 });
+				drwOrigin.push_back(NO_OP);
+				drwCsws++;
+			}
+			for (size_t k = 0; k < n; k++)
+			{
+				const Op& o = ops[order[i + k]];
+				if (!drwState.tarValid || drwState.tar != o.addr)
+				{
+					drwState.tar = o.addr;
+					drwState.tarValid = true;
+					drw.push_back({ ap, MEM_AP_REG_TAR, false, o.addr, false, 0 });
+					drwOrigin.push_back(NO_OP);
+					drwTars++;
+				}
+				drw.push_back({ ap, MEM_AP_REG_DRW, o.read, o.data, false, 0 });
+				drwOrigin.push_back(order[i + k]);
+
+				// 自動インクリメントが保証されるのは 1KB の範囲内だけ
+				drwState.tar += 4;
+				if ((drwState.tar & (TAR_AUTOINC_WINDOW - 1)) == 0)
+					drwState.tarValid = false;
+			}
+		}
+
+		bool useDRW = !drw.empty() && drw.size() + countSelects(drw, selectValid, selectAp, selectBank)
+			< bd.size() + countSelects(bd, selectValid, selectAp, selectBank);
+		const std::vector<AP::Access>& chosen = useDRW ? drw : bd;
+		const std::vector<size_t>& chosenOrigin = useDRW ? drwOrigin : bdOrigin;
+		accesses->insert(accesses->end(), chosen.begin(), chosen.end());
+		origin->insert(origin->end(), chosenOrigin.begin(), chosenOrigin.end());
+		state = useDRW ? drwState : bdState;
+		summary->tars += useDRW ? drwTars : bdTars;
+		summary->csws += useDRW ? drwCsws : 0;
+		if (useDRW && n > 1)
+			summary->runs++;
+
+		if (!chosen.empty())
+		{
+			selectValid = true;
+			selectAp = chosen.back().ap;
+			selectBank = chosen.back().reg & 0xF0;
+		}
+		i += n;
+	}
+
+	summary->selects = countSelects(*accesses, ap().selectValid, ap().lastAp, ap().lastApBank);
+}
+
+static const char* getMemApRegName(uint32_t reg)
+{
+	switch (reg)
+	{
+	case MEM_AP_REG_CSW:	return "CSW";
+	case MEM_AP_REG_TAR:	return "TAR";
+	case MEM_AP_REG_DRW:	return "DRW";
+	case MEM_AP_REG_BD0:	return "BD0";
+	case MEM_AP_REG_BD1:	return "BD1";
+	case MEM_AP_REG_BD2:	return "BD2";
+	case MEM_AP_REG_BD3:	return "BD3";
+	default:				return "???";
+	}
+}
+
+void ADIv5::Planner::print(const std::vector<AP::Access>& accesses, const std::vector<size_t>& origin, const Summary& summary)
+{
+	_DBGPRT("  Plan: %d accesses -> %d AP accesses + %d SELECT (TAR: %d CSW: %d runs: %d)\n",
+		(int)ops.size(), (int)accesses.size(), (int)summary.selects, (int)summary.tars, (int)summary.csws, (int)summary.runs);
+	for (size_t i = 0; i < accesses.size(); i++)
+	{
+		const AP::Access& a = accesses[i];
+		if (origin[i] == NO_OP)
+			_DBGPRT("    AP#%d %s <- 0x%08x\n", a.ap, getMemApRegName(a.reg), a.data);
+		else if (ops[origin[i]].mem == nullptr && a.read)
+			_DBGPRT("    AP#%d reg 0x%02x read\n", a.ap, a.reg);
+		else if (ops[origin[i]].mem == nullptr)
+			_DBGPRT("    AP#%d reg 0x%02x <- 0x%08x\n", a.ap, a.reg, a.data);
+		else if (a.match)
+			_DBGPRT("    AP#%d %s [0x%08x] & 0x%08x == 0x%08x\n", a.ap, getMemApRegName(a.reg), ops[origin[i]].addr, a.mask, a.data);
+		else if (a.read)
+			_DBGPRT("    AP#%d %s [0x%08x] read\n", a.ap, getMemApRegName(a.reg), ops[origin[i]].addr);
+		else
+			_DBGPRT("    AP#%d %s [0x%08x] <- 0x%08x\n", a.ap, getMemApRegName(a.reg), ops[origin[i]].addr, a.data);
+	}
+}
+
+errno_t ADIv5::Planner::explain()
+{
+	if (ops.empty())
+		return OK;
+
+	errno_t ret = prepare();
+	if (ret != OK)
+		return ret;
+
+	std::vector<AP::Access> accesses;
+	std::vector<size_t> origin;
+	Summary summary;
+	build(false, &accesses, &origin, &summary);
+	_DBGPRT("  Unplanned: %d accesses -> %d AP accesses + %d SELECT (TAR: %d)\n",
+		(int)ops.size(), (int)accesses.size(), (int)summary.selects, (int)summary.tars);
+
+	accesses.clear();
+	origin.clear();
+	summary = Summary();
+	build(true, &accesses, &origin, &summary);
+	print(accesses, origin, summary);
+	return OK;
+}
+
+errno_t ADIv5::Planner::execute()
+{
+	if (ops.empty())
+		return OK;
+
+	for (auto& op : ops)
+		op.done = false;
+
+	errno_t ret = prepare();
+	if (ret != OK)
+		return ret;
+
+	std::vector<AP::Access> accesses;
+	std::vector<size_t> origin;
+	Summary summary;
+	build(true, &accesses, &origin, &summary);
+	if (explainOnExecute)
+		print(accesses, origin, summary);
+
+	size_t failed;
+	ret = ap().transfer(accesses, &failed);
+
+	// 失敗した位置より前に全部のアクセスが済んだものが完了
+	for (auto& op : ops)
+		op.done = true;
+	for (size_t i = 0; i < accesses.size(); i++)
+	{
+		if (origin[i] == NO_OP)
+			continue;
+
+		Op& op = ops[origin[i]];
+		if (i >= failed)
+			op.done = false;
+		else if (accesses[i].read && !accesses[i].match)
+			op.data = accesses[i].data;
+	}
+	return ret;
+}
+
+std::future<int32_t> ADIv5::enqueue(size_t first, std::vector<uint32_t*> outputs)
+{
+	auto result = std::make_shared<DAP::AsyncResult>();
+	pending.push_back({ first, std::move(outputs), result });
+	return std::async(std::launch::deferred, [this, result]() {
+		if (!result->done)
+			flush();
+		return result->ret;
+	});
+}
+
+std::future<int32_t> ADIv5::readAsync(MEM_AP& mem, uint32_t addr, uint32_t* data)
+{
+	ASSERT_RELEASE(data != nullptr);
+	return enqueue(queued.read(mem, addr), { data });
+}
+
+std::future<int32_t> ADIv5::writeAsync(MEM_AP& mem, uint32_t addr, uint32_t val)
+{
+	return enqueue(queued.write(mem, addr, val), { nullptr });
+}
+
+std::future<int32_t> ADIv5::waitForAsync(MEM_AP& mem, uint32_t addr, uint32_t mask, uint32_t value)
+{
+	return enqueue(queued.waitFor(mem, addr, mask, value), { nullptr });
+}
+
+std::future<int32_t> ADIv5::readAsync(uint32_t index, uint32_t reg, uint32_t* data)
+{
+	ASSERT_RELEASE(data != nullptr);
+	return enqueue(queued.read(ap, index, reg), { data });
+}
+
+std::future<int32_t> ADIv5::writeAsync(uint32_t index, uint32_t reg, uint32_t val)
+{
+	return enqueue(queued.write(ap, index, reg, val), { nullptr });
+}
+
+std::future<int32_t> ADIv5::readAsync(MEM_AP& mem, uint32_t addr, uint32_t* data, size_t count)
+{
+	ASSERT_RELEASE(data != nullptr && count > 0);
+
+	size_t first = queued.size();
+	std::vector<uint32_t*> outputs;
+	for (size_t i = 0; i < count; i++)
+	{
+		queued.read(mem, addr + (uint32_t)i * 4);
+		outputs.push_back(&data[i]);
+	}
+	return enqueue(first, std::move(outputs));
+}
+
+std::future<int32_t> ADIv5::writeAsync(MEM_AP& mem, uint32_t addr, const uint32_t* data, size_t count)
+{
+	ASSERT_RELEASE(data != nullptr && count > 0);
+
+	size_t first = queued.size();
+	for (size_t i = 0; i < count; i++)
+		queued.write(mem, addr + (uint32_t)i * 4, data[i]);
+	return enqueue(first, std::vector<uint32_t*>(count, nullptr));
+}
+
+int32_t ADIv5::flush()
+{
+	// 実行中に積まれた分は次回に回す
+	Planner planner;
+	std::swap(planner, queued);
+	std::vector<Pending> requests;
+	requests.swap(pending);
+	if (requests.empty())
+		return OK;
+
+	int32_t ret = planner.execute();
+	for (auto& request : requests)
+	{
+		int32_t result = OK;
+		for (size_t i = 0; i < request.outputs.size(); i++)
+		{
+			size_t index = request.first + i;
+			if (!planner.isDone(index))
+			{
+				result = ret;
+				continue;
+			}
+			if (request.outputs[i] != nullptr)
+				*request.outputs[i] = planner.getData(index);
+		}
+		request.result->ret = result;
+		request.result->done = true;
+	}
+	return ret;
+}
+
+errno_t ADIv5::MEM_AP::setAccessSize(ADIv5::MEM_AP::AccessSize size)
+{
+	// 単発のアクセスなら自動インクリメントは影で追えるので、SINGLE のままでよい
+	AP::Shadow& shadow = ap.shadow(index);
+	MEM_AP_CSW csw;
+	csw.raw = shadow.csw;
+	if (shadow.cswValid && csw.AddrInc == ADDRINC_SINGLE)
+		return setCSW(size, ADDRINC_SINGLE);
+	return setCSW(size, ADDRINC_OFF);
+}
+
+errno_t ADIv5::MEM_AP::setCSW(ADIv5::MEM_AP::AccessSize size, ADIv5::MEM_AP::AddrInc addrInc)
+{
+	// 影があれば読み直さずに書き換える
+	MEM_AP_CSW csw;
+	AP::Shadow& shadow = ap.shadow(index);
+	if (shadow.cswValid)
+	{
+		csw.raw = shadow.csw;
+		ap.stats().cswReads++;
 	}
 	else
 	{
-		int ret = ap.write(index, MEM_AP_REG_TAR, addr);
-		if (ret != OK) {
+		errno_t ret = ap.read(index, MEM_AP_REG_CSW, &csw.raw);
+		if (ret != OK)
 			return ret;
-		}
-		lastTAR = addr;
+	}
 
-		ret = ap.write(index, MEM_AP_REG_DRW, val);
-		if (ret != OK) {
+	if (size != csw.Size || addrInc != csw.AddrInc)
+	{
+		csw.Size = size;
+		csw.AddrInc = addrInc;
+		errno_t ret = ap.write(index, MEM_AP_REG_CSW, csw.raw);
+		if (ret != OK)
 			return ret;
-		}
 	}
 	return OK;
 }
 
-int32_t ADIv5::MEM_AP::write(uint32_t addr, uint16_t val)
+errno_t ADIv5::MEM_AP::readCFG()
 {
-	ASSERT_RELEASE(is16BitAligned(addr));
+	if (ap.shadow(index).cfgValid)
+		return OK;
 
-	errno_t ret = setAccessSize(SIZE_16BIT);
+	uint32_t cfg;
+	return ap.read(index, MEM_AP_REG_CFG, &cfg);
+}
+
+errno_t ADIv5::MEM_AP::getConfig(bool* longAddress, bool* largeData)
+{
+	errno_t ret = readCFG();
+	if (ret != OK)
+		return ret;
+
+	MEM_AP_CFG c;
+	c.raw = ap.shadow(index).cfg;
+	if (longAddress != nullptr)
+		*longAddress = c.LA ? true : false;
+	if (largeData != nullptr)
+		*largeData = c.LD ? true : false;
+	return OK;
+}
+
+/*
+ * TAR2 は LA を実装した AP だけにあり、32-bit のアクセスでも 0 にしておく必要がある
+ */
+errno_t ADIv5::MEM_AP::setUpperTAR(uint32_t upper)
+{
+	bool longAddress;
+	errno_t ret = getConfig(&longAddress, nullptr);
 	if (ret != OK)
 		return ret;
 
-	if (!isSameTAR(addr))
+	if (!longAddress)
+		return (upper == 0) ? OK : EINVAL;
+
+	AP::Shadow& shadow = ap.shadow(index);
+	if (shadow.tar2Valid && shadow.tar2 == upper)
 	{
-		ret = ap.write(index, MEM_AP_REG_TAR, addr);
-		if (ret != OK) {
-			return ret;
-		}
-		lastTAR = addr;
+		ap.stats().tarWrites++;
+		return OK;
 	}
+	return ap.write(index, MEM_AP_REG_TAR2, upper);
+}
 
-	ret = ap.write(index, MEM_AP_REG_DRW, (addr & 2) ? ((uint32_t)val) << 16 : val);
+errno_t ADIv5::MEM_AP::setTAR(uint64_t addr)
+{
+	errno_t ret = setUpperTAR((uint32_t)(addr >> 32));
+	if (ret != OK)
+		return ret;
+
+	if (isSameTAR((uint32_t)addr))
+	{
+		ap.stats().tarWrites++;
+		return OK;
+	}
+	return ap.write(index, MEM_AP_REG_TAR, (uint32_t)addr);
+}
+
+errno_t ADIv5::MEM_AP::readBlock64(uint64_t addr, uint32_t* data, size_t count)
+{
+	ASSERT_RELEASE((addr & 0x3) == 0);
+	return readDRW(addr, data, count, SIZE_32BIT, ADDRINC_SINGLE);
+}
+
+errno_t ADIv5::MEM_AP::writeBlock64(uint64_t addr, const uint32_t* data, size_t count)
+{
+	ASSERT_RELEASE((addr & 0x3) == 0);
+	return writeDRW(addr, data, count, SIZE_32BIT, ADDRINC_SINGLE);
+}
+
+errno_t ADIv5::MEM_AP::readBlock64(uint64_t addr, uint64_t* data, size_t count)
+{
+	ASSERT_RELEASE((addr & 0x7) == 0);
+
+	bool largeData;
+	errno_t ret = getConfig(nullptr, &largeData);
 	if (ret != OK)
 		return ret;
 
+	// 64-bit 転送でも DRW は下位、上位の順に 2 回アクセスする
+	std::vector<uint32_t> words(count * 2);
+	ret = readDRW(addr, words.data(), words.size(), largeData ? SIZE_64BIT : SIZE_32BIT, ADDRINC_SINGLE);
+	if (ret != OK)
+		return ret;
+
+	for (size_t i = 0; i < count; i++)
+		data[i] = words[i * 2] | ((uint64_t)words[i * 2 + 1] << 32);
 	return OK;
 }
 
-int32_t ADIv5::MEM_AP::write(uint32_t addr, uint8_t val)
+errno_t ADIv5::MEM_AP::writeBlock64(uint64_t addr, const uint64_t* data, size_t count)
 {
-	errno_t ret = setAccessSize(SIZE_8BIT);
+	ASSERT_RELEASE((addr & 0x7) == 0);
+
+	bool largeData;
+	errno_t ret = getConfig(nullptr, &largeData);
 	if (ret != OK)
 		return ret;
 
-	if (!isSameTAR(addr))
+	std::vector<uint32_t> words;
+	for (size_t i = 0; i < count; i++)
 	{
-		ret = ap.write(index, MEM_AP_REG_TAR, addr);
-		if (ret != OK) {
+		words.push_back((uint32_t)data[i]);
+		words.push_back((uint32_t)(data[i] >> 32));
+	}
+	return writeDRW(addr, words.data(), words.size(), largeData ? SIZE_64BIT : SIZE_32BIT, ADDRINC_SINGLE);
+}
+
+errno_t ADIv5::MEM_AP::readBlock(uint32_t addr, uint32_t* data, size_t count)
+{
+	ASSERT_RELEASE(is32BitAligned(addr));
+	return readDRW(addr, data, count, SIZE_32BIT, ADDRINC_SINGLE);
+}
+
+errno_t ADIv5::MEM_AP::writeBlock(uint32_t addr, const uint32_t* data, size_t count)
+{
+	ASSERT_RELEASE(is32BitAligned(addr));
+	return writeDRW(addr, data, count, SIZE_32BIT, ADDRINC_SINGLE);
+}
+
+errno_t ADIv5::MEM_AP::readBlock(uint32_t addr, uint8_t* data, size_t count)
+{
+	return readSized(addr, data, count, SIZE_8BIT);
+}
+
+errno_t ADIv5::MEM_AP::writeBlock(uint32_t addr, const uint8_t* data, size_t count)
+{
+	return writeSized(addr, data, count, SIZE_8BIT);
+}
+
+errno_t ADIv5::MEM_AP::readBlock(uint32_t addr, uint16_t* data, size_t count)
+{
+	ASSERT_RELEASE(is16BitAligned(addr));
+
+	std::vector<uint8_t> bytes(count * 2);
+	errno_t ret = readSized(addr, bytes.data(), bytes.size(), SIZE_16BIT);
+	if (ret != OK)
+		return ret;
+
+	for (size_t i = 0; i < count; i++)
+		data[i] = bytes[i * 2] | (bytes[i * 2 + 1] << 8);
+	return OK;
+}
+
+errno_t ADIv5::MEM_AP::writeBlock(uint32_t addr, const uint16_t* data, size_t count)
+{
+	ASSERT_RELEASE(is16BitAligned(addr));
+
+	std::vector<uint8_t> bytes;
+	for (size_t i = 0; i < count; i++)
+	{
+		bytes.push_back(data[i] & 0xFF);
+		bytes.push_back(data[i] >> 8);
+	}
+	return writeSized(addr, bytes.data(), bytes.size(), SIZE_16BIT);
+}
+
+errno_t ADIv5::MEM_AP::isPackedSupported(bool* supported)
+{
+	if (!packedChecked)
+	{
+		// packed をサポートしない AP では AddrInc=0b10 が書き込めない
+		errno_t ret = setCSW(SIZE_8BIT, ADDRINC_PACKED);
+		if (ret != OK)
 			return ret;
+
+		MEM_AP_CSW csw;
+		ret = ap.read(index, MEM_AP_REG_CSW, &csw.raw);
+		if (ret != OK)
+			return ret;
+
+		packedSupported = (csw.AddrInc == ADDRINC_PACKED && csw.Size == SIZE_8BIT);
+		packedChecked = true;
+		_DBGPRT("  MEM-AP #%d packed transfer : %s\n", index, packedSupported ? "Supported" : "NOT Supported");
+	}
+	*supported = packedSupported;
+	return OK;
+}
+
+/*
+ * length バイトを size 単位で転送する
+ * ワード境界までの先頭と末尾は 1 要素ずつ、間のワードは packed で 1 DRW に詰める
+ */
+errno_t ADIv5::MEM_AP::readSized(uint32_t addr, uint8_t* bytes, size_t length, AccessSize size)
+{
+	const uint32_t bytesPerAccess = 1 << size;
+	ASSERT_RELEASE((addr & (bytesPerAccess - 1)) == 0 && (length % bytesPerAccess) == 0);
+
+	bool packed;
+	errno_t ret = isPackedSupported(&packed);
+	if (ret != OK)
+		return ret;
+
+	size_t head = packed ? std::min<size_t>(length, (4 - (addr & 3)) & 3) : length;
+	size_t middle = packed ? (length - head) & ~(size_t)3 : 0;
+	size_t tail = length - head - middle;
+
+	auto readLanes = [&](uint32_t a, uint8_t* p, size_t n) -> errno_t {
+		if (n == 0)
+			return OK;
+		std::vector<uint32_t> words(n / bytesPerAccess);
+		errno_t ret = readDRW(a, words.data(), words.size(), size, ADDRINC_SINGLE);
+		if (ret != OK)
+			return ret;
+		for (size_t i = 0; i < words.size(); i++)
+		{
+			uint32_t lane = (a + (uint32_t)(i * bytesPerAccess)) & 3;
+			for (uint32_t b = 0; b < bytesPerAccess; b++)
+				*p++ = (words[i] >> ((lane + b) * 8)) & 0xFF;
+		}
+		return OK;
+	};
+
+	ret = readLanes(addr, bytes, head);
+	if (ret != OK)
+		return ret;
+
+	if (middle > 0)
+	{
+		std::vector<uint32_t> words(middle / 4);
+		ret = readDRW(addr + (uint32_t)head, words.data(), words.size(), size, ADDRINC_PACKED);
+		if (ret != OK)
+			return ret;
+		for (size_t i = 0; i < words.size(); i++)
+		{
+			for (uint32_t b = 0; b < 4; b++)
+				bytes[head + i * 4 + b] = (words[i] >> (b * 8)) & 0xFF;
 		}
-		lastTAR = addr;
 	}
 
-	ret = ap.write(index, MEM_AP_REG_DRW,
-		(addr & 3) == 3 ? ((uint32_t)val) << 24 :
-		(addr & 3) == 2 ? ((uint32_t)val) << 16 :
-		(addr & 3) == 1 ? ((uint32_t)val) <<  8 : val );
+	return readLanes(addr + (uint32_t)(head + middle), bytes + head + middle, tail);
+}
+
+errno_t ADIv5::MEM_AP::writeSized(uint32_t addr, const uint8_t* bytes, size_t length, AccessSize size)
+{
+	const uint32_t bytesPerAccess = 1 << size;
+	ASSERT_RELEASE((addr & (bytesPerAccess - 1)) == 0 && (length % bytesPerAccess) == 0);
+
+	bool packed;
+	errno_t ret = isPackedSupported(&packed);
+	if (ret != OK)
+		return ret;
+
+	size_t head = packed ? std::min<size_t>(length, (4 - (addr & 3)) & 3) : length;
+	size_t middle = packed ? (length - head) & ~(size_t)3 : 0;
+	size_t tail = length - head - middle;
+
+	auto writeLanes = [&](uint32_t a, const uint8_t* p, size_t n) -> errno_t {
+		if (n == 0)
+			return OK;
+		std::vector<uint32_t> words(n / bytesPerAccess, 0);
+		for (size_t i = 0; i < words.size(); i++)
+		{
+			uint32_t lane = (a + (uint32_t)(i * bytesPerAccess)) & 3;
+			for (uint32_t b = 0; b < bytesPerAccess; b++)
+				words[i] |= (uint32_t)*p++ << ((lane + b) * 8);
+		}
+		return writeDRW(a, words.data(), words.size(), size, ADDRINC_SINGLE);
+	};
+
+	ret = writeLanes(addr, bytes, head);
+	if (ret != OK)
+		return ret;
+
+	if (middle > 0)
+	{
+		std::vector<uint32_t> words(middle / 4, 0);
+		for (size_t i = 0; i < words.size(); i++)
+		{
+			for (uint32_t b = 0; b < 4; b++)
+				words[i] |= (uint32_t)bytes[head + i * 4 + b] << (b * 8);
+		}
+		ret = writeDRW(addr + (uint32_t)head, words.data(), words.size(), size, ADDRINC_PACKED);
+		if (ret != OK)
+			return ret;
+	}
+
+	return writeLanes(addr + (uint32_t)(head + middle), bytes + head + middle, tail);
+}
+
+errno_t ADIv5::MEM_AP::readDRW(uint64_t addr, uint32_t* data, size_t count, AccessSize size, AddrInc addrInc)
+{
+	errno_t ret = setCSW(size, addrInc);
 	if (ret != OK)
 		return ret;
 
+	// DRW 1 回あたりの TAR の進み幅 (packed と 64-bit 以上は 1 ワード分)
+	uint32_t step = (addrInc == ADDRINC_PACKED) ? 4 : std::min<uint32_t>(1 << size, 4);
+	bool retried = false;
+	while (count > 0)
+	{
+		size_t n = std::min<size_t>(count, (TAR_AUTOINC_WINDOW - ((uint32_t)addr & (TAR_AUTOINC_WINDOW - 1))) / step);
+		ret = setTAR(addr);
+		if (ret != OK)
+			return ret;
+
+		size_t done = 0;
+		ret = ap.readBlock(index, MEM_AP_REG_DRW, data, n, &done);
+		addr += (uint32_t)done * step;
+		data += done;
+		count -= done;
+		if (ret != OK)
+		{
+			// 転送されなかった最初のワードから一度だけ再開する
+			// 全部転送済みなら最後のワードが RDBUFF の確認で失敗したので再開しない
+			if (retried || done >= n)
+				return ret;
+			retried = true;
+		}
+	}
 	return OK;
 }
-errno_t ADIv5::MEM_AP::setAccessSize(ADIv5::MEM_AP::AccessSize size)
+
+errno_t ADIv5::MEM_AP::writeDRW(uint64_t addr, const uint32_t* data, size_t count, AccessSize size, AddrInc addrInc)
 {
-	if (size != lastAccessSize)
+	errno_t ret = setCSW(size, addrInc);
+	if (ret != OK)
+		return ret;
+
+	uint32_t step = (addrInc == ADDRINC_PACKED) ? 4 : std::min<uint32_t>(1 << size, 4);
+	bool retried = false;
+	while (count > 0)
 	{
-		MEM_AP_CSW csw;
-		errno_t ret = ap.read(index, MEM_AP_REG_CSW, &csw.raw);
+		size_t n = std::min<size_t>(count, (TAR_AUTOINC_WINDOW - ((uint32_t)addr & (TAR_AUTOINC_WINDOW - 1))) / step);
+		ret = setTAR(addr);
 		if (ret != OK)
 			return ret;
 
-		if (size != csw.Size)
+		size_t done = 0;
+		ret = ap.writeBlock(index, MEM_AP_REG_DRW, data, n, &done);
+		addr += (uint32_t)done * step;
+		data += done;
+		count -= done;
+		if (ret != OK)
 		{
-			csw.Size = size;
-			ret = ap.write(index, MEM_AP_REG_CSW, csw.raw);
-			if (ret != OK)
+			if (retried || done >= n)
 				return ret;
-			lastAccessSize = csw.Size;
+			retried = true;
 		}
 	}
 	return OK;
@@ -783,77 +2332,215 @@ errno_t ADIv5::MEM_AP::setAccessSize(ADIv5::MEM_AP::AccessSize size)
 
 int32_t ADIv5::ROM_TABLE::read()
 {
-	int ret;
-	uint32_t addr = component->base;
-
 	if (!component->isRomTable())
 		return OK;
 
-	_DBGPRT("ROM_TABLE\n");
-	_DBGPRT("  Base    : 0x%08x\n", addr);
-
-	uint32_t data;
-	ret = component->ap.read(addr + 0xFCC, &data);
-	if (ret != OK)
-		return ret;
-	sysmem = data ? true : false;
-	_DBGPRT("    MEMTYPE : %s\n", sysmem ? "SYSMEM is present" : "SYSMEM is NOT present");
+	// 幅優先で辿り、同じ深さのテーブルとコンポーネントはまとめて読む
+	std::vector<ROM_TABLE*> level = { this };
+	while (!level.empty())
+	{
+		std::vector<ROM_TABLE*> next;
+		int32_t ret = readLevel(level, &next);
+		if (ret != OK)
+			return ret;
+		level = next;
+	}
+	return OK;
+}
 
-	component->print();
+/*
+ * tables の MEMTYPE とエントリ、見つかったコンポーネントの PID/CID を読む
+ * next には子の ROM Table が返る
+ */
+int32_t ADIv5::ROM_TABLE::readLevel(const std::vector<ROM_TABLE*>& tables, std::vector<ROM_TABLE*>* next)
+{
+	int32_t ret;
+	MEM_AP& ap = tables[0]->component->ap;	// 1 つのツリーは同じ MEM-AP 上にある
 
-	while (1)
+	// エントリは各テーブル 16 個ずつ、終端が見つかるまで全テーブル分をまとめて読む
+	std::vector<std::vector<uint32_t>> raws(tables.size());
+	std::vector<bool> finished(tables.size(), false);
+	for (bool first = true; ; first = false)
 	{
-		Entry entry;
-		ret = component->ap.read(addr, &entry.raw);
+		std::vector<uint32_t> addrs;
+		std::vector<std::pair<size_t, bool>> owners;	// table, MEMTYPE or not
+		for (size_t t = 0; t < tables.size(); t++)
+		{
+			if (finished[t])
+				continue;
+
+			uint32_t base = tables[t]->component->base;
+			if (first)
+			{
+				addrs.push_back(base + 0xFCC);
+				owners.push_back(std::make_pair(t, true));
+			}
+			for (uint32_t i = 0; i < 16 && raws[t].size() + i < ROM_TABLE_MAX_ENTRIES; i++)
+			{
+				addrs.push_back(base + (uint32_t)(raws[t].size() + i) * 4);
+				owners.push_back(std::make_pair(t, false));
+			}
+		}
+		if (addrs.empty())
+			break;
+
+		std::vector<uint32_t> data;
+		ret = ap.read(addrs, &data);
 		if (ret != OK)
 			return ret;
 
-		if (entry.raw == 0x00)
-			break;
+		for (size_t i = 0; i < data.size(); i++)
+		{
+			size_t t = owners[i].first;
+			if (owners[i].second)
+			{
+				tables[t]->sysmem = data[i] ? true : false;
+			}
+			else if (!finished[t])
+			{
+				raws[t].push_back(data[i]);
+				if (data[i] == 0x00 || raws[t].size() >= ROM_TABLE_MAX_ENTRIES)
+					finished[t] = true;
+			}
+		}
+	}
+
+	struct Found
+	{
+		size_t table;
+		Entry entry;
+		std::shared_ptr<Component> component;
+	};
+	std::vector<Found> found;
 
-		uint32_t entryAddr = component->base + entry.addr();
-		_DBGPRT("  ENTRY          : 0x%08x (addr: 0x%08x)\n", entry.raw, entryAddr);
-		if (entry.FORMAT)
+	for (size_t t = 0; t < tables.size(); t++)
+	{
+		std::shared_ptr<Component> component = tables[t]->component;
+		_DBGPRT("ROM_TABLE\n");
+		_DBGPRT("  Base    : 0x%08x\n", component->base);
+		_DBGPRT("    MEMTYPE : %s\n", tables[t]->sysmem ? "SYSMEM is present" : "SYSMEM is NOT present");
+		component->print();
+
+		for (auto raw : raws[t])
 		{
-			_DBGPRT("    Present      : %s\n", entry.PRESENT ? "yes" : "no");
-			if (entry.PWR_DOMAIN_ID_VAILD)
-				_DBGPRT("    Power Domain ID : %x\n", entry.PWR_DOMAIN_ID);
+			Entry entry;
+			entry.raw = raw;
+			if (entry.raw == 0x00)
+				break;
 
-			if (entry.present())
+			uint32_t entryAddr = component->base + entry.addr();
+			_DBGPRT("  ENTRY          : 0x%08x (addr: 0x%08x)\n", entry.raw, entryAddr);
+			if (entry.FORMAT)
 			{
-				std::shared_ptr<Component> child = std::make_shared<Component>(Memory(component->ap, entryAddr));
-				
-				ret = child->readPidCid();
-				if (ret != OK)
-				{
-					_DBGPRT("    Failed to read child component\n");
-					continue;
-				}
+				_DBGPRT("    Present      : %s\n", entry.PRESENT ? "yes" : "no");
+				if (entry.PWR_DOMAIN_ID_VAILD)
+					_DBGPRT("    Power Domain ID : %x\n", entry.PWR_DOMAIN_ID);
 
-				if (child->isRomTable())
-				{
-					_DBGPRT("-> CHILD\n");
-					children.push_back(std::make_pair(entry, ROM_TABLE(child)));
-					children.back().second.read();
-					_DBGPRT("<-\n");
-				}
-				else
-				{
-					entries.push_back(std::make_pair(entry, child));
-					child->print();
-				}
+				if (entry.present())
+					found.push_back({ t, entry, std::make_shared<Component>(Memory(ap, entryAddr)) });
+			}
+			else
+			{
+				_DBGPRT("    Invalid entry\n");
 			}
 		}
+	}
+
+	// この深さのコンポーネントの PID/CID を 1 回でまとめて読む
+	// 失敗したら電源の落ちたドメインなどを避けるため 1 つずつ読み直す
+	std::vector<uint32_t> addrs;
+	for (auto& f : found)
+		f.component->appendPidCidAddrs(&addrs);
+
+	std::vector<uint32_t> data;
+	ret = found.empty() ? OK : ap.read(addrs, &data);
+
+	for (size_t i = 0; i < found.size(); i++)
+	{
+		Found& f = found[i];
+		if (ret == OK)
+		{
+			f.component->parsePidCid(&data[i * 9]);
+		}
+		else if (f.component->readPidCid() != OK)
+		{
+			_DBGPRT("    Failed to read child component at 0x%08x\n", f.component->base);
+			continue;
+		}
+
+		ROM_TABLE* table = tables[f.table];
+		if (f.component->isRomTable())
+		{
+			table->children.push_back(std::make_pair(f.entry, ROM_TABLE(f.component)));
+		}
 		else
 		{
-			_DBGPRT("    Invalid entry\n");
+			table->entries.push_back(std::make_pair(f.entry, f.component));
+			f.component->print();
 		}
-		addr += 4;
 	}
 
+	// children はもう増えないので要素へのポインタを返せる
+	for (auto table : tables)
+	{
+		for (auto& c : table->children)
+			next->push_back(&c.second);
+	}
 	return OK;
 }
 
+void ADIv5::ROM_TABLE::getTopology(Topology::Node* node) const
+{
+	node->base = component->base;
+	node->pid = component->getPid().raw;
+	node->cid = component->getCid().raw;
+	node->sysmem = sysmem;
+	node->children.clear();
+
+	for (auto& c : children)
+	{
+		Topology::Node child = {};
+		c.second.getTopology(&child);
+		child.entry = c.first.raw;
+		node->children.push_back(child);
+	}
+
+	for (auto& e : entries)
+	{
+		Topology::Node child = {};
+		child.entry = e.first.raw;
+		child.base = e.second->base;
+		child.pid = e.second->getPid().raw;
+		child.cid = e.second->getCid().raw;
+		node->children.push_back(child);
+	}
+}
+
+void ADIv5::ROM_TABLE::setTopology(const Topology::Node& node)
+{
+	sysmem = node.sysmem;
+	children.clear();
+	entries.clear();
+
+	for (auto& c : node.children)
+	{
+		Entry entry;
+		entry.raw = c.entry;
+
+		std::shared_ptr<Component> child = std::make_shared<Component>(Memory(component->ap, c.base));
+		child->setPidCid(c.pid, c.cid);
+		if (child->isRomTable())
+		{
+			children.push_back(std::make_pair(entry, ROM_TABLE(child)));
+			children.back().second.setTopology(c);
+		}
+		else
+		{
+			entries.push_back(std::make_pair(entry, child));
+		}
+	}
+}
+
 void ADIv5::ROM_TABLE::each(std::function<void(std::shared_ptr<Component>)> func)
 {
 	for (auto c : children)
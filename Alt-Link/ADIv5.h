@@ -5,6 +5,7 @@
 #include <vector>
 #include <memory>
 #include <functional>
+#include <map>
 #include "DAP.h"
 #include "JEP106.h"
 
@@ -56,15 +57,113 @@ private:
 	static_assert(CONFIRM_UINT32(DP_CTRL_STAT));
 
 public:
-	ADIv5(std::shared_ptr<DAP> _dap) : dap(_dap), ap(*this, *_dap) {}
+	// Accesses skipped thanks to the register shadows
+	struct ShadowStats
+	{
+		uint64_t selectWrites;		// DP SELECT
+		uint64_t ctrlStatWrites;	// DP CTRL/STAT
+		uint64_t cswReads;			// MEM-AP CSW
+		uint64_t tarWrites;			// MEM-AP TAR
+		uint64_t invalidations;		// all shadows dropped (reconnect, link errors)
+
+		ShadowStats() : selectWrites(0), ctrlStatWrites(0), cswReads(0), tarWrites(0), invalidations(0) {}
+		uint64_t saved() const { return selectWrites + ctrlStatWrites + cswReads + tarWrites; }
+		void print() const;
+	};
+
+	// AP and ROM table layout found by scanAPs(), enough to rebuild it without reading the target
+	struct Topology
+	{
+		struct Node
+		{
+			uint32_t entry;				// ROM table entry pointing to this component, 0 for a root table
+			uint32_t base;
+			uint64_t pid;
+			uint32_t cid;
+			bool sysmem;				// ROM tables only
+			std::vector<Node> children;	// ROM tables only
+
+			template <class Archive>
+			void serialize(Archive & archive)
+			{
+				archive(CEREAL_NVP(entry), CEREAL_NVP(base), CEREAL_NVP(pid), CEREAL_NVP(cid), CEREAL_NVP(sysmem), CEREAL_NVP(children));
+			}
+		};
+
+		struct Ap
+		{
+			uint32_t index;
+			uint32_t idr;
+			bool ahbSysmem;
+			bool hasRomTable;
+			Node rom;
+
+			template <class Archive>
+			void serialize(Archive & archive)
+			{
+				archive(CEREAL_NVP(index), CEREAL_NVP(idr), CEREAL_NVP(ahbSysmem), CEREAL_NVP(hasRomTable), CEREAL_NVP(rom));
+			}
+		};
+
+		std::vector<Ap> aps;
+
+		template <class Archive>
+		void serialize(Archive & archive)
+		{
+			archive(CEREAL_NVP(aps));
+		}
+	};
+
+	// Cheap reads identifying a target: DP IDCODE, AP #0 IDR/BASE and the root component PID/CID
+	struct TopologyKey
+	{
+		uint32_t idcode;
+		uint32_t idr;
+		uint32_t base;
+		uint64_t pid;
+		uint32_t cid;
+
+		bool operator==(const TopologyKey& rhs) const {
+			return idcode == rhs.idcode && idr == rhs.idr && base == rhs.base && pid == rhs.pid && cid == rhs.cid;
+		}
+
+		template <class Archive>
+		void serialize(Archive & archive)
+		{
+			archive(CEREAL_NVP(idcode), CEREAL_NVP(idr), CEREAL_NVP(base), CEREAL_NVP(pid), CEREAL_NVP(cid));
+		}
+	};
+
+	ADIv5(std::shared_ptr<DAP> _dap) : dap(_dap), ap(*this, *_dap) { shadowEpoch = _dap->getLinkEpoch(); }
 
 	int32_t getIDCODE(DP_IDCODE* idcode);
+	int32_t checkIDCODE(const DP_IDCODE& expected, uint32_t count);
 	int32_t getCtrlStat(DP_CTRL_STAT* ctrlStat);
 	int32_t setCtrlStat(DP_CTRL_STAT& ctrlStat);
 	errno_t clearError();
 	int32_t powerupDebug();
 	int32_t scanAPs();
 
+	errno_t readTopologyKey(TopologyKey* key);
+	void getTopology(Topology* topology) const;
+	// Rebuilds the AP and ROM table lists from a cached topology instead of scanAPs().
+	// The AP IDRs are read back in one batch; a mismatch returns CMSISDAP_ERR_VERIFY.
+	errno_t setTopology(const Topology& topology);
+	int32_t waitForDP(uint32_t reg, uint32_t mask, uint32_t value);
+
+	// Drops every register shadow, e.g. after the target was power cycled behind our back
+	void invalidateShadows();
+	const ShadowStats& getShadowStats() const { return shadowStats; }
+	std::shared_ptr<DAP> getDAP() const { return dap; }
+
+	// Reads CTRL/STAT at the end of every AP batch and block instead of trusting the ACK alone.
+	// A sticky error is narrowed down by replaying halves of the batch. Always on for JTAG,
+	// whose ACK cannot tell FAULT from OK.
+	void setDeferredErrorCheck(bool enable) { deferredErrorCheck = enable; }
+	bool isDeferredErrorCheck() const { return deferredErrorCheck || dap->getConnectionType() != DAP::SWJ_SWD; }
+
+	class Planner;
+
 	class AP
 	{
 	public:
@@ -72,14 +171,57 @@ public:
 		int32_t read(uint32_t ap, uint32_t reg, uint32_t *data);
 		int32_t write(uint32_t ap, uint32_t reg, uint32_t val);
 
+		struct Access
+		{
+			uint32_t ap;
+			uint32_t reg;
+			bool read;
+			uint32_t data;	// write: value to write, read: value read, match: value to match
+			bool match;		// read until (value & mask) == data
+			uint32_t mask;
+		};
+		// Submits all accesses through as few DAP transfers as possible.
+		// On failure, *failed is set to the index of the first access that was not completed.
+		int32_t transfer(std::vector<Access>& accesses, size_t* failed = nullptr);
+		// Repeated accesses to one register. *done is set to the number of words transferred.
+		int32_t readBlock(uint32_t ap, uint32_t reg, uint32_t* data, size_t count, size_t* done);
+		int32_t writeBlock(uint32_t ap, uint32_t reg, const uint32_t* data, size_t count, size_t* done);
+
+		// Shadow copies of a MEM-AP's CSW and TAR/TAR2, kept up to date by every access made through this class
+		struct Shadow
+		{
+			bool cswValid = false;
+			uint32_t csw = 0;
+			bool tarValid = false;
+			uint32_t tar = 0;
+			bool tar2Valid = false;
+			uint32_t tar2 = 0;
+			bool cfgValid = false;	// CFG is read only, shared by every MEM_AP object of the AP
+			uint32_t cfg = 0;
+		};
+		Shadow& shadow(uint32_t ap);
+		ShadowStats& stats() { return adi.shadowStats; }
+		// Host-side rounds of a value match wait, so that every wait polls about as often whatever the probe's retry count
+		uint32_t getMatchWaitRounds() const;
+
 	private:
+		friend class ADIv5;
+		friend class Planner;
+
 		ADIv5& adi;
 		DAP& dap;
+		bool selectValid = false;
 		uint32_t lastAp = 0;
 		uint32_t lastApBank = 0;
+		std::map<uint32_t, Shadow> shadows;
 
 		int32_t select(uint32_t ap, uint32_t reg);
+		void track(uint32_t ap, uint32_t reg, bool read, uint32_t data, size_t count = 1);
+		void invalidate(uint32_t ap, int32_t error);
 		errno_t checkStatus(uint32_t ap);
+		int32_t transfer(std::vector<Access>& accesses, size_t offset, size_t end, size_t* failed, bool* sticky);
+		int32_t replay(std::vector<Access>& accesses, size_t offset, size_t end, size_t* failed);
+		int32_t checkSticky(uint32_t ap);
 	} ap;
 
 	class MEM_AP
@@ -96,19 +238,83 @@ public:
 			INVALID		= 0xFFFFFFFF
 		};
 
+		enum AddrInc
+		{
+			ADDRINC_OFF		= 0,
+			ADDRINC_SINGLE	= 1,
+			ADDRINC_PACKED	= 2,
+			ADDRINC_INVALID	= 0xFFFFFFFF
+		};
+
 		MEM_AP(uint32_t _index, AP& _ap) : index(_index), ap(_ap) {}
 		errno_t read(uint32_t addr, uint32_t *data);
+		errno_t read(uint32_t addr, uint16_t *data);
+		errno_t read(uint32_t addr, uint8_t *data);
 		errno_t write(uint32_t addr, uint32_t val);
 		errno_t write(uint32_t addr, uint16_t val);
 		errno_t write(uint32_t addr, uint8_t val);
 		errno_t setAccessSize(AccessSize size);
 		uint32_t getIndex() const { return index; };
 
+		struct Access
+		{
+			uint32_t addr;
+			bool read;
+			uint32_t data;	// write: value to write, read: value read, match: value to match
+			bool match;		// read until (value & mask) == data
+			uint32_t mask;
+		};
+		// 32-bit accesses, submitted as one batch
+		errno_t transfer(std::vector<Access>& accesses);
+		// Independent reads, may be reordered by the Planner
+		errno_t read(const std::vector<uint32_t>& addrs, std::vector<uint32_t>* data);
+
+		// Waits until (*addr & mask) == value, polling on the probe up to its match retry count.
+		// Returns CMSISDAP_ERR_VALUE_MISMATCH on timeout. data receives the value after the match,
+		// or the last value on timeout.
+		errno_t waitFor(uint32_t addr, uint32_t mask, uint32_t value, uint32_t* data = nullptr);
+		uint32_t getMatchWaitRounds() const { return ap.getMatchWaitRounds(); }
+
+		// 32-bit sequential accesses using TAR auto-increment and DAP_TransferBlock
+		errno_t readBlock(uint32_t addr, uint32_t* data, size_t count);
+		errno_t writeBlock(uint32_t addr, const uint32_t* data, size_t count);
+
+		// 8/16-bit sequential accesses. The word aligned part uses packed transfers
+		// (one DRW access per word) when the AP supports them.
+		errno_t readBlock(uint32_t addr, uint8_t* data, size_t count);
+		errno_t writeBlock(uint32_t addr, const uint8_t* data, size_t count);
+		errno_t readBlock(uint32_t addr, uint16_t* data, size_t count);
+		errno_t writeBlock(uint32_t addr, const uint16_t* data, size_t count);
+
+		// Probes CSW.AddrInc once and remembers the result
+		errno_t isPackedSupported(bool* supported);
+
+		// CFG.LA: TAR2 holds address bits [63:32], CFG.LD: 64-bit and wider transfers
+		errno_t getConfig(bool* longAddress, bool* largeData);
+
+		// Block accesses with a 64-bit address, which needs CFG.LA above 4 GB.
+		// The uint64_t variants use 64-bit bus transfers when CFG.LD is set, otherwise pairs of 32-bit ones.
+		errno_t readBlock64(uint64_t addr, uint32_t* data, size_t count);
+		errno_t writeBlock64(uint64_t addr, const uint32_t* data, size_t count);
+		errno_t readBlock64(uint64_t addr, uint64_t* data, size_t count);
+		errno_t writeBlock64(uint64_t addr, const uint64_t* data, size_t count);
+
 	private:
+		friend class Planner;
+
 		AP& ap;
 		uint32_t index;
-		uint32_t lastTAR = 0;
-		AccessSize lastAccessSize = INVALID;
+		bool packedChecked = false;
+		bool packedSupported = false;
+
+		errno_t setCSW(AccessSize size, AddrInc addrInc);
+		errno_t readCFG();
+		errno_t setTAR(uint64_t addr);
+		errno_t setUpperTAR(uint32_t upper);
+		errno_t readDRW(uint64_t addr, uint32_t* data, size_t count, AccessSize size, AddrInc addrInc);
+		errno_t writeDRW(uint64_t addr, const uint32_t* data, size_t count, AccessSize size, AddrInc addrInc);
+		errno_t readSized(uint32_t addr, uint8_t* bytes, size_t length, AccessSize size);
+		errno_t writeSized(uint32_t addr, const uint8_t* bytes, size_t length, AccessSize size);
 
 		bool isSameTAR(uint32_t addr);
 		bool isSame32BitAlignedTAR(uint32_t addr, uint32_t* reg);
@@ -116,6 +322,84 @@ public:
 		bool is16BitAligned(uint32_t addr);
 	};
 
+	/*
+	 * Compiles a batch of 32-bit memory accesses on one or more MEM-APs into a single AP batch.
+	 * Between ordered accesses, the others are grouped per AP and sorted by address, contiguous
+	 * runs use TAR auto-increment, and SELECT/CSW/TAR writes already in place are left out.
+	 * Accesses to the same address keep their order.
+	 */
+	class Planner
+	{
+	public:
+		// Each returns the index of the access. All accesses must be on APs of the same DP.
+		// ordered: keeps its place relative to every other access, for registers with side effects.
+		// waitFor and AP register accesses are always ordered.
+		size_t read(MEM_AP& mem, uint32_t addr, bool ordered = false);
+		size_t write(MEM_AP& mem, uint32_t addr, uint32_t data, bool ordered = false);
+		size_t waitFor(MEM_AP& mem, uint32_t addr, uint32_t mask, uint32_t value);
+		// AP registers other than the MEM-AP CSW, TAR, TAR2, DRW and BDx (IDR, CFG, JTAG-AP ...)
+		size_t read(AP& ap, uint32_t index, uint32_t reg);
+		size_t write(AP& ap, uint32_t index, uint32_t reg, uint32_t data);
+
+		errno_t execute();
+		uint32_t getData(size_t index) const { return ops[index].data; }
+		// After a failed execute(), tells the accesses that were completed before the failure
+		bool isDone(size_t index) const { return ops[index].done; }
+		size_t size() const { return ops.size(); }
+		void clear() { ops.clear(); owner = nullptr; }
+
+		// Prints the plan and its cost against the accesses in submission order.
+		// Brings CSW and TAR2 of the MEM-APs in line first, as execute() does.
+		errno_t explain();
+		void setExplain(bool enable) { explainOnExecute = enable; }
+
+	private:
+		struct Op
+		{
+			MEM_AP* mem;	// nullptr for AP register accesses
+			uint32_t ap;
+			uint32_t addr;	// AP register accesses: register
+			bool read;
+			uint32_t data;	// write: value to write, read: value read, match: value to match
+			bool match;
+			uint32_t mask;
+			bool ordered;
+			bool done;
+		};
+
+		struct Summary
+		{
+			size_t selects = 0;
+			size_t csws = 0;
+			size_t tars = 0;
+			size_t runs = 0;
+		};
+
+		AP* owner = nullptr;
+		std::vector<Op> ops;
+		bool explainOnExecute = false;
+
+		AP& ap() { return *owner; }
+		size_t add(AP& ap, const Op& op);
+		errno_t prepare();
+		void build(bool optimize, std::vector<AP::Access>* accesses, std::vector<size_t>* origin, Summary* summary);
+		void print(const std::vector<AP::Access>& accesses, const std::vector<size_t>& origin, const Summary& summary);
+	};
+
+	// Deferred accesses. They are queued in one Planner and sent together on flush(), which get()
+	// on any of the returned futures calls. Outputs must stay valid until then, and accesses made
+	// by the synchronous API in the meantime go out first.
+	std::future<int32_t> readAsync(MEM_AP& mem, uint32_t addr, uint32_t* data);
+	std::future<int32_t> writeAsync(MEM_AP& mem, uint32_t addr, uint32_t val);
+	std::future<int32_t> waitForAsync(MEM_AP& mem, uint32_t addr, uint32_t mask, uint32_t value);
+	std::future<int32_t> readAsync(uint32_t index, uint32_t reg, uint32_t* data);
+	std::future<int32_t> writeAsync(uint32_t index, uint32_t reg, uint32_t val);
+	// Word reads and writes as a single request
+	std::future<int32_t> readAsync(MEM_AP& mem, uint32_t addr, uint32_t* data, size_t count);
+	std::future<int32_t> writeAsync(MEM_AP& mem, uint32_t addr, const uint32_t* data, size_t count);
+	int32_t flush();
+	size_t getQueuedCount() const { return queued.size(); }
+
 	class Memory
 	{
 	public:
@@ -226,6 +510,10 @@ public:
 		static_assert(CONFIRM_SIZE(PID, uint64_t));
 
 		int32_t readPidCid();
+		// Addresses of PID0-3, PID4 and CID0-3, in the order parsePidCid() expects them
+		void appendPidCidAddrs(std::vector<uint32_t>* addrs) const;
+		void parsePidCid(const uint32_t* data);
+		void setPidCid(uint64_t _pid, uint32_t _cid) { pid.raw = _pid; cid.raw = _cid; }
 		CID getCid() { return cid; }
 		PID getPid() { return pid; }
 		void print();
@@ -258,8 +546,6 @@ public:
 		PID pid;
 
 	private:
-		int32_t readPid();
-		int32_t readCid();
 		const char* getName() const;
 	};
 
@@ -272,6 +558,9 @@ public:
 		void each(std::function<void(std::shared_ptr<Component>)> func);
 		bool isSysmem() { return sysmem; }
 
+		void getTopology(Topology::Node* node) const;
+		void setTopology(const Topology::Node& node);
+
 	private:
 		union Entry
 		{
@@ -323,6 +612,9 @@ public:
 		std::shared_ptr<Component> component;
 
 		bool sysmem;
+
+		static int32_t readLevel(const std::vector<ROM_TABLE*>& tables, std::vector<ROM_TABLE*>* next);
+
 		std::vector<std::pair<Entry, ROM_TABLE>> children;
 		std::vector<std::pair<Entry, std::shared_ptr<Component>>> entries;
 	};
@@ -382,6 +674,26 @@ private:
 	std::vector<std::shared_ptr<MEM_AP>> ahbSysmemAps;
 	std::vector<std::pair<uint32_t, AP_IDR>> aps;
 	std::shared_ptr<DAP> dap;
+
+	// DP register shadows, dropped when the DAP link epoch changes
+	uint32_t shadowEpoch = 0;
+	bool ctrlStatValid = false;
+	uint32_t ctrlStatShadow = 0;	// request bits only, status bits are always read from the target
+	ShadowStats shadowStats;
+	bool deferredErrorCheck = false;
+
+	// 非同期アクセスの待ち行列
+	struct Pending
+	{
+		size_t first;
+		std::vector<uint32_t*> outputs;	// 操作ごと, 書き込みは nullptr
+		std::shared_ptr<DAP::AsyncResult> result;
+	};
+	Planner queued;
+	std::vector<Pending> pending;
+
+	void syncShadows();
+	std::future<int32_t> enqueue(size_t first, std::vector<uint32_t*> outputs);
 };
 
 template<class Archive>
@@ -3,6 +3,7 @@
 #include "ADIv5TI.h"
 
 #include <array>
+#include <algorithm>
 
 enum Signal
 {
@@ -12,6 +13,9 @@ enum Signal
 
 ADIv5TI::ADIv5TI(std::shared_ptr<ADIv5> _adi) : adi(_adi)
 {
+	registerValid.fill(false);
+	registerValue.fill(0);
+
 	auto _v7dif = adi->findARMv7ARDIF();
 	if (_v7dif.size() > 0)
 	{
@@ -107,6 +111,7 @@ ADIv5TI::ADIv5TI(std::shared_ptr<ADIv5> _adi) : adi(_adi)
 	if (_mem.size() > 0)
 	{
 		mem = _mem[0];
+		cache = std::make_shared<MemoryCache>(mem);
 	}
 }
 
@@ -188,16 +193,118 @@ errno_t ADIv5TI::testHaltAndRun()
 	return ret;
 }
 
+void ADIv5TI::setHalted(bool _halted)
+{
+	// 停止中以外はメモリもレジスタも変わりうるのでキャッシュしない
+	if (cache)
+		cache->setHalted(_halted);
+	if (!_halted)
+		invalidateRegisters();
+	halted = _halted;
+}
+
+void ADIv5TI::RegisterCacheStats::print() const
+{
+	uint64_t total = hits + misses;
+	_DBGPRT("  Register cache hit ratio %.1f%% (hit: %llu miss: %llu)\n",
+		total == 0 ? 0.0 : (double)hits * 100.0 / (double)total, (unsigned long long)hits, (unsigned long long)misses);
+	_DBGPRT("    snapshots: %llu invalidated: %llu\n",
+		(unsigned long long)bulkFills, (unsigned long long)invalidations);
+}
+
+void ADIv5TI::setRegisterCacheEnabled(bool enabled)
+{
+	registerCacheEnabled = enabled;
+	if (!enabled)
+		invalidateRegisters();
+}
+
+void ADIv5TI::invalidateRegisters()
+{
+	bool any = false;
+	for (size_t i = 0; i < REGISTER_CACHE_SIZE; i++)
+	{
+		any = any || registerValid[i];
+		registerValid[i] = false;
+	}
+	if (any)
+		registerStats.invalidations++;
+}
+
+bool ADIv5TI::isRegisterCacheable(ARMv6MSCS::REGSEL reg) const
+{
+	return registerCacheEnabled && halted && reg < REGISTER_CACHE_SIZE && reg != 19;
+}
+
+errno_t ADIv5TI::readReg(ARMv6MSCS::REGSEL reg, uint32_t* data)
+{
+	if (!isRegisterCacheable(reg))
+		return scs->readReg(reg, data);
+
+	if (registerValid[reg])
+	{
+		registerStats.hits++;
+		*data = registerValue[reg];
+		return OK;
+	}
+
+	registerStats.misses++;
+	errno_t ret = scs->readReg(reg, data);
+	if (ret == OK)
+	{
+		registerValue[reg] = *data;
+		registerValid[reg] = true;
+	}
+	return ret;
+}
+
+errno_t ADIv5TI::writeReg(ARMv6MSCS::REGSEL reg, uint32_t data)
+{
+	errno_t ret = scs->writeReg(reg, data);
+	if (!isRegisterCacheable(reg))
+		return ret;
+
+	// SP は MSP か PSP の別名で、どちらかは CONTROL.SPSEL で決まる
+	if (reg == ARMv6MSCS::SP || reg == ARMv6MSCS::MSP || reg == ARMv6MSCS::PSP || reg == ARMv6MSCS::CONTROL_PRIMASK)
+	{
+		registerValid[ARMv6MSCS::SP] = false;
+		registerValid[ARMv6MSCS::MSP] = false;
+		registerValid[ARMv6MSCS::PSP] = false;
+	}
+
+	// 書いた値がそのまま読めるのは R0-R12 と LR だけ. 他は読み直す
+	// 失敗したときは書けたかどうか分からない
+	bool writeThrough = reg <= ARMv6MSCS::R12 || reg == ARMv6MSCS::LR;
+	registerValue[reg] = data;
+	registerValid[reg] = writeThrough && ret == OK;
+	return ret;
+}
+
 int32_t ADIv5TI::attach()
 {
+	// 接続前にリセットされているかもしれない
+	setHalted(false);
 	if (scs)
-		return scs->halt();
+	{
+		int32_t ret = scs->halt();
+		setHalted(ret == OK);
+		return ret;
+	}
 
 	return ENODEV;
 }
 
 void ADIv5TI::detach()
 {
+	flush();
+	commitBreakPoints();
+	setHalted(false);
+	if (cache)
+		cache->getStats().print();
+	registerStats.print();
+	if (statsReporter)
+		statsReporter();
+
 	if (scs)
 		scs->run();
 }
@@ -213,13 +320,18 @@ void ADIv5TI::setCurrentPC(const uint64_t addr)
 	(void)addr;
 }
 
-void ADIv5TI::resume()
+int32_t ADIv5TI::resume()
 {
 	// continue command
-	if (scs)
-		scs->run();
+	flush();
+	int32_t ret = commitBreakPoints();
+	if (ret != OK)
+		return ret;	// 古いコンパレータのまま走らせない
 
-	// [TODO] return error code
+	setHalted(false);
+	if (scs)
+		return scs->run();
+	return OK;
 }
 
 int32_t ADIv5TI::step(uint8_t* signal)
@@ -228,12 +340,84 @@ int32_t ADIv5TI::step(uint8_t* signal)
 
 	*signal = 0x05;	// SIGTRAP
 
+	flush();
+	int32_t ret = commitBreakPoints();
+	if (ret != OK)
+		return ret;
+
+	setHalted(false);
 	if (scs)
-		return scs->step();
+	{
+		ret = scs->step();
+		if (ret != OK)
+		{
+			// ステップが終わらなかったので止めてから返す
+			setHalted(scs->halt() == OK);
+			return ret;
+		}
+		setHalted(true);
+		return OK;
+	}
 
 	return ENODEV;
 }
 
+int32_t ADIv5TI::rangeStep(uint64_t start, uint64_t end, uint8_t* signal)
+{
+	ASSERT_RELEASE(signal != nullptr);
+
+	*signal = SIGTRAP;
+
+	if (!scs)
+		return ENODEV;
+
+	flush();
+	int32_t ret = commitBreakPoints();
+	if (ret != OK)
+		return ret;
+
+	setHalted(false);
+
+	// 抜けないループでも止まるように回数を制限する. GDB は範囲内で止まれば続きを指示してくる
+	static const uint32_t MAX_RANGE_STEPS = 10000;
+
+	uint32_t pc = 0;
+	uint32_t steps = 0;
+	while (steps < MAX_RANGE_STEPS)
+	{
+		ARMv6MSCS::DFSR dfsr;
+		ret = scs->stepAndReadPC(&pc, &dfsr);
+		if (ret != OK)
+			break;
+		steps++;
+
+		if (dfsr.EXTERNAL || dfsr.VCATCH)
+		{
+			*signal = SIGINT;
+			break;
+		}
+		if (dfsr.BKPT || dfsr.DWTTRAP)
+			break;
+		if (pc < start || pc >= end)
+			break;
+	}
+
+	if (ret != OK)
+	{
+		// ステップが終わらなかったので止めてから返す
+		setHalted(scs->halt() == OK);
+		return ret;
+	}
+
+	setHalted(true);
+	if (isRegisterCacheable(ARMv6MSCS::DebugReturnAddress))
+	{
+		registerValue[ARMv6MSCS::DebugReturnAddress] = pc;
+		registerValid[ARMv6MSCS::DebugReturnAddress] = true;
+	}
+	return OK;
+}
+
 int32_t ADIv5TI::interrupt(uint8_t* signal)
 {
 	ASSERT_RELEASE(signal != nullptr);
@@ -241,7 +425,11 @@ int32_t ADIv5TI::interrupt(uint8_t* signal)
 	*signal = 0x05;	// SIGTRAP
 
 	if (scs)
-		return scs->halt();
+	{
+		int32_t ret = scs->halt();
+		setHalted(ret == OK);
+		return ret;
+	}
 
 	return ENODEV;
 }
@@ -261,6 +449,7 @@ errno_t ADIv5TI::isRunning(bool* running, uint8_t* signal)
 
 	if (!halt)
 	{
+		setHalted(false);
 		*running = true;
 		*signal = 0;
 		return OK;
@@ -291,6 +480,7 @@ errno_t ADIv5TI::isRunning(bool* running, uint8_t* signal)
 		else if (dfsr.HALTED)
 			*signal = SIGTRAP;
 
+		setHalted(true);
 		_DBGPRT("found stop\n");
 		dfsr.print();
 	}
@@ -299,26 +489,57 @@ errno_t ADIv5TI::isRunning(bool* running, uint8_t* signal)
 
 errno_t ADIv5TI::setBreakPoint(BreakPointType type, uint64_t addr, BreakPointKind kind)
 {
-	if (type == BreakPointType::HARDWARE)
-	{
-		if (bpu)
-			return bpu->addBreakPoint((uint32_t)addr);
-		else if (fpb)
-			return fpb->addBreakPoint((uint32_t)addr);
-	}
-	return ERSP_NOT_SUPPORTED;
+	if (type != BreakPointType::HARDWARE || (!bpu && !fpb))
+		return ERSP_NOT_SUPPORTED;
+
+	// Code: 0x00000000 - 0x20000000
+	if ((addr & 0x1) != 0 || (addr & 0xFFFFFFFFE0000000ULL) != 0)
+		return EINVAL;
+
+	if (breakPoints.count((uint32_t)addr) > 0)
+		return OK;	// already exist
+
+	// REMAP に使われているコンパレータは数えない
+	uint32_t count = bpu ? bpu->getFreeBreakPointCount() : fpb->getFreeBreakPointCount();
+	if (breakPoints.size() >= count)
+		return EFAULT;
+
+	// 停止のたびに外して入れ直されるので、ここではコンパレータに書かない
+	breakPoints.insert((uint32_t)addr);
+	breakPointsDirty = true;
+	return OK;
 }
 
 int32_t ADIv5TI::unsetBreakPoint(BreakPointType type, uint64_t addr, BreakPointKind kind)
 {
-	if (type == BreakPointType::HARDWARE)
+	if (type != BreakPointType::HARDWARE || (!bpu && !fpb))
+		return ERSP_NOT_SUPPORTED;
+
+	if (breakPoints.erase((uint32_t)addr) > 0)
+		breakPointsDirty = true;
+	return OK;
+}
+
+errno_t ADIv5TI::commitBreakPoints()
+{
+	if (!breakPointsDirty)
+		return OK;
+
+	// 差分だけがコンパレータに書かれる
+	std::vector<uint32_t> addrs(breakPoints.begin(), breakPoints.end());
+	errno_t ret = ERSP_NOT_SUPPORTED;
+	if (bpu)
+		ret = bpu->setBreakPoints(addrs);
+	else if (fpb)
+		ret = fpb->setBreakPoints(addrs);
+	if (ret != OK)
 	{
-		if (bpu)
-			return bpu->delBreakPoint((uint32_t)addr);
-		else if (fpb)
-			return fpb->delBreakPoint((uint32_t)addr);
+		_DBGPRT("Failed to set breakpoints (%d)\n", ret);
+		return ret;
 	}
-	return ERSP_NOT_SUPPORTED;
+
+	breakPointsDirty = false;
+	return OK;
 }
 
 int32_t ADIv5TI::setWatchPoint(WatchPointType type, uint64_t addr, uint32_t kind)
@@ -343,7 +564,7 @@ errno_t ADIv5TI::readRegister(const uint32_t n, uint32_t* out)
 
 	if (n == 19 || n == 20 || n == 21 || n == 22)
 	{
-		ret = scs->readReg(ARMv6MSCS::REGSEL::CONTROL_PRIMASK, out);
+		ret = readReg(ARMv6MSCS::REGSEL::CONTROL_PRIMASK, out);
 		if (ret == OK)
 		{
 			if (n == 19)		// PRIMASK
@@ -357,7 +578,7 @@ errno_t ADIv5TI::readRegister(const uint32_t n, uint32_t* out)
 		}
 		return ret;
 	}
-	return scs->readReg(regsel, out);
+	return readReg(regsel, out);
 }
 
 errno_t ADIv5TI::readRegister(const uint32_t n, uint64_t* out)
@@ -396,7 +617,7 @@ errno_t ADIv5TI::writeRegister(const uint32_t n, const uint32_t data)
 	if (n == 19 || n == 20 || n == 21 || n == 22)
 	{
 		uint32_t tmp;
-		ret = scs->readReg(ARMv6MSCS::REGSEL::CONTROL_PRIMASK, &tmp);
+		ret = readReg(ARMv6MSCS::REGSEL::CONTROL_PRIMASK, &tmp);
 		if (ret == OK)
 		{
 			if (n == 19)		// PRIMASK
@@ -407,11 +628,11 @@ errno_t ADIv5TI::writeRegister(const uint32_t n, const uint32_t data)
 				tmp = (tmp & 0xFF00FFFF) | ((data & 0xFF) << 16);
 			else if (n == 22)	// CONTROL
 				tmp = (tmp & 0x00FFFFFF) | ((data & 0xFF) << 24);
-			ret = scs->writeReg(ARMv6MSCS::REGSEL::CONTROL_PRIMASK, tmp);
+			ret = writeReg(ARMv6MSCS::REGSEL::CONTROL_PRIMASK, tmp);
 		}
 		return ret;
 	}
-	return scs->writeReg(regsel, data);
+	return writeReg(regsel, data);
 }
 
 errno_t ADIv5TI::writeRegister(const uint32_t n, const uint64_t data)
@@ -430,14 +651,93 @@ errno_t ADIv5TI::readGenericRegisters(std::vector<uint32_t>* array)
 {
 	ASSERT_RELEASE(array != nullptr);
 
+	if (!scs)
+		return ENODEV;
+
+	const auto& core = ARMv6MSCS::getCoreRegs();
+	if (!isRegisterCacheable(ARMv6MSCS::R0))
+	{
+		// R0-R15 を 1 回の転送で読む
+		std::vector<uint32_t> regs;
+		errno_t ret = scs->readRegs(std::vector<ARMv6MSCS::REGSEL>(core.begin(), core.begin() + 16), &regs);
+		if (ret != OK)
+			return ret;
+		array->insert(array->end(), regs.begin(), regs.end());
+		return OK;
+	}
+
+	uint32_t missing = 0;
 	for (int i = 0; i < 16; i++)
+		missing += registerValid[i] ? 0 : 1;
+
+	// 続く 'p' で読まれやすい xPSR なども一緒に読んでおく
+	if (missing > 0)
 	{
-		uint32_t value;
-		errno_t ret = readRegister(i, &value);
+		errno_t ret = fillRegisters(core);
 		if (ret != OK)
 			return ret;
-		array->push_back(value);
 	}
+	registerStats.misses += missing;
+	registerStats.hits += 16 - missing;
+
+	array->insert(array->end(), registerValue.begin(), registerValue.begin() + 16);
+	return OK;
+}
+
+errno_t ADIv5TI::fillRegisters(const std::vector<ARMv6MSCS::REGSEL>& regs)
+{
+	std::vector<ARMv6MSCS::REGSEL> missing;
+	for (auto reg : regs)
+	{
+		if (!registerValid[reg])
+			missing.push_back(reg);
+	}
+	if (missing.empty())
+		return OK;
+
+	std::vector<uint32_t> values;
+	errno_t ret = scs->readRegs(missing, &values);
+	if (ret != OK)
+		return ret;
+	for (size_t i = 0; i < missing.size(); i++)
+	{
+		registerValue[missing[i]] = values[i];
+		registerValid[missing[i]] = true;
+	}
+	registerStats.bulkFills++;
+	return OK;
+}
+
+errno_t ADIv5TI::readExpeditedRegisters(std::vector<std::pair<uint32_t, uint32_t>>* regs)
+{
+	ASSERT_RELEASE(regs != nullptr);
+
+	if (!scs)
+		return ENODEV;
+
+	// R7 は Thumb のフレームポインタ
+	static const std::vector<ARMv6MSCS::REGSEL> expedited = {
+		ARMv6MSCS::R7, ARMv6MSCS::SP, ARMv6MSCS::LR, ARMv6MSCS::DebugReturnAddress, ARMv6MSCS::xPSR
+	};
+
+	std::vector<uint32_t> values;
+	if (isRegisterCacheable(ARMv6MSCS::R0))
+	{
+		errno_t ret = fillRegisters(expedited);
+		if (ret != OK)
+			return ret;
+		for (auto reg : expedited)
+			values.push_back(registerValue[reg]);
+	}
+	else
+	{
+		errno_t ret = scs->readRegs(expedited, &values);
+		if (ret != OK)
+			return ret;
+	}
+
+	for (size_t i = 0; i < expedited.size(); i++)
+		regs->push_back({ expedited[i], values[i] });
 	return OK;
 }
 
@@ -455,6 +755,41 @@ errno_t ADIv5TI::writeGenericRegisters(const std::vector<uint32_t>& array)
 	return OK;
 }
 
+static const uint64_t ADDR_32BIT_LIMIT = 0x100000000ULL;
+
+/*
+ * ワード境界に満たない部分 (3 バイト以下) を 8/16 ビットのブロック転送 1 回で読み書きする
+ */
+static errno_t readPartial(ADIv5::MEM_AP& mem, uint32_t addr, uint8_t* data, uint32_t len)
+{
+	if ((addr & 1) == 0 && (len & 1) == 0)
+	{
+		uint16_t half[2];
+		errno_t ret = mem.readBlock(addr, half, len / 2);
+		if (ret != OK)
+			return ret;
+		for (uint32_t i = 0; i < len / 2; i++)
+		{
+			data[i * 2] = half[i] & 0xFF;
+			data[i * 2 + 1] = half[i] >> 8;
+		}
+		return OK;
+	}
+	return mem.readBlock(addr, data, len);
+}
+
+static errno_t writePartial(ADIv5::MEM_AP& mem, uint32_t addr, const uint8_t* data, uint32_t len)
+{
+	if ((addr & 1) == 0 && (len & 1) == 0)
+	{
+		uint16_t half[2];
+		for (uint32_t i = 0; i < len / 2; i++)
+			half[i] = (uint16_t)((data[i * 2 + 1] << 8) | data[i * 2]);
+		return mem.writeBlock(addr, half, len / 2);
+	}
+	return mem.writeBlock(addr, data, len);
+}
+
 errno_t ADIv5TI::readMemory(uint64_t addr, uint32_t len, std::vector<uint8_t>* array)
 {
 	ASSERT_RELEASE(array != nullptr);
@@ -462,33 +797,51 @@ errno_t ADIv5TI::readMemory(uint64_t addr, uint32_t len, std::vector<uint8_t>* a
 	if (!mem)
 		return ENODEV;
 
-	int32_t ret;
-	uint32_t i = 0;
-	for (; i < len / 4; i++)
+	flush();
+	if (cache && cache->isAvailable(addr, len))
 	{
-		uint32_t data;
-		ret = mem->read((uint32_t)addr, &data);
-		if (ret != OK)
-			return ret;
-		//_DBGPRT("readMemory 0x%08x 0x%08x\n", (uint32_t)addr, data);
-		array->push_back(data & 0xFF);
-		array->push_back((data >> 8) & 0xFF);
-		array->push_back((data >> 16) & 0xFF);
-		array->push_back((data >> 24) & 0xFF);
-		addr += 4;
+		size_t offset = array->size();
+		array->resize(offset + len);
+		if (cache->read(addr, len, array->data() + offset) == OK)
+			return OK;
+		array->resize(offset);	// ページの一部が読めない場合は直接読む
 	}
 
-	len -= i * 4;
-	if (len > 0)
+	// ワード境界までの先頭と末尾は 8/16 ビット、間はワードのブロック転送
+	uint32_t head = std::min<uint32_t>(len, (4 - (addr & 0x3)) & 0x3);
+	uint32_t words = (len - head) / 4;
+	uint32_t tail = len - head - words * 4;
+
+	// 4 GB を超える領域は TAR2 を使うワード転送のみ
+	if (addr + len > ADDR_32BIT_LIMIT && (head > 0 || tail > 0))
+		return EINVAL;
+
+	size_t offset = array->size();
+	array->resize(offset + len);
+	uint8_t* p = array->data() + offset;
+
+	int32_t ret = OK;
+	if (head > 0)
+		ret = readPartial(*mem, (uint32_t)addr, p, head);
+	if (ret == OK && words > 0)
 	{
-		uint32_t data;
-		ret = mem->read((uint32_t)addr, &data);
-		if (ret != OK)
-			return ret;
-		if (len > 0) { array->push_back((data >> 0) & 0xFF); len--; }
-		if (len > 0) { array->push_back((data >> 8) & 0xFF); len--; }
-		if (len > 0) { array->push_back((data >> 16) & 0xFF); len--; }
-		ASSERT_RELEASE(len == 0);
+		std::vector<uint32_t> data(words);
+		ret = mem->readBlock64(addr + head, data.data(), data.size());
+		for (uint32_t i = 0; ret == OK && i < words; i++)
+		{
+			p[head + i * 4] = data[i] & 0xFF;
+			p[head + i * 4 + 1] = (data[i] >> 8) & 0xFF;
+			p[head + i * 4 + 2] = (data[i] >> 16) & 0xFF;
+			p[head + i * 4 + 3] = (data[i] >> 24) & 0xFF;
+		}
+	}
+	if (ret == OK && tail > 0)
+		ret = readPartial(*mem, (uint32_t)addr + head + words * 4, p + head + words * 4, tail);
+
+	if (ret != OK)
+	{
+		array->resize(offset);
+		return ret;
 	}
 	return OK;
 }
@@ -503,74 +856,124 @@ errno_t ADIv5TI::readMemory(uint64_t addr, uint32_t len, std::vector<uint32_t>*
 	if ((addr & 0x3) != 0 || (len % 4) != 0)
 		return EINVAL;
 
-	int32_t ret;
-	uint32_t i = 0;
-	for (; i < len / 4; i++)
+	flush();
+	if (cache && cache->isAvailable(addr, len))
 	{
-		uint32_t data;
-		ret = mem->read((uint32_t)addr, &data);
-		if (ret != OK)
-			return ret;
-		array->push_back(data);
-		addr += 4;
+		std::vector<uint8_t> bytes(len);
+		if (cache->read(addr, len, bytes.data()) == OK)
+		{
+			for (uint32_t i = 0; i < len; i += 4)
+				array->push_back((bytes[i + 3] << 24) | (bytes[i + 2] << 16) | (bytes[i + 1] << 8) | bytes[i]);
+			return OK;
+		}
+	}
+
+	size_t offset = array->size();
+	array->resize(offset + len / 4);
+	int32_t ret = mem->readBlock64(addr, array->data() + offset, len / 4);
+	if (ret != OK)
+	{
+		array->resize(offset);
+		return ret;
 	}
 	return OK;
 }
 
+static std::future<int32_t> makeReadyFuture(int32_t ret)
+{
+	std::promise<int32_t> promise;
+	promise.set_value(ret);
+	return promise.get_future();
+}
+
+std::future<int32_t> ADIv5TI::readMemoryAsync(uint64_t addr, uint32_t len, uint32_t* data)
+{
+	ASSERT_RELEASE(data != nullptr);
+
+	if (!mem)
+		return makeReadyFuture(ENODEV);
+
+	if ((addr & 0x3) != 0 || (len % 4) != 0 || len == 0 || addr + len > ADDR_32BIT_LIMIT)
+		return makeReadyFuture(EINVAL);
+
+	// キャッシュにあればその場で返す. 待ち行列の書き込みより前の値を読まないように, 空のときだけ
+	if (adi->getQueuedCount() == 0 && cache && cache->isAvailable(addr, len))
+	{
+		std::vector<uint8_t> bytes(len);
+		if (cache->read(addr, len, bytes.data()) == OK)
+		{
+			for (uint32_t i = 0; i < len; i += 4)
+				data[i / 4] = (bytes[i + 3] << 24) | (bytes[i + 2] << 16) | (bytes[i + 1] << 8) | bytes[i];
+			return makeReadyFuture(OK);
+		}
+	}
+
+	return adi->readAsync(*mem, (uint32_t)addr, data, len / 4);
+}
+
+std::future<int32_t> ADIv5TI::writeMemoryAsync(uint64_t addr, uint32_t len, const uint32_t* data)
+{
+	ASSERT_RELEASE(data != nullptr);
+
+	if (!mem)
+		return makeReadyFuture(ENODEV);
+
+	if ((addr & 0x3) != 0 || (len % 4) != 0 || len == 0 || addr + len > ADDR_32BIT_LIMIT)
+		return makeReadyFuture(EINVAL);
+
+	if (cache)
+		cache->invalidate(addr, len);
+
+	return adi->writeAsync(*mem, (uint32_t)addr, data, len / 4);
+}
+
+int32_t ADIv5TI::flush()
+{
+	// DAP に直接積まれた転送も一緒に送る
+	int32_t ret = adi->getDAP()->flush();
+	int32_t ret2 = adi->flush();
+	return ret != OK ? ret : ret2;
+}
+
 errno_t ADIv5TI::writeMemory(uint64_t addr, uint32_t len, const std::vector<uint8_t>& array)
 {
 	if (!mem)
 		return ENODEV;
 
+	ASSERT_RELEASE(array.size() >= len);
+
+	flush();
+	if (cache)
+		cache->invalidate(addr, len);
+
+	uint32_t head = std::min<uint32_t>(len, (4 - (addr & 0x3)) & 0x3);
+	uint32_t words = (len - head) / 4;
+	uint32_t tail = len - head - words * 4;
+
+	if (addr + len > ADDR_32BIT_LIMIT && (head > 0 || tail > 0))
+		return EINVAL;
+
 	errno_t ret;
-	uint32_t i = 0;
-	for (; i < len / 4; i++)
+	if (head > 0)
 	{
-		uint32_t data = (array[i * 4 + 3] << 24) | (array[i * 4 + 2] << 16) | (array[i * 4 + 1] << 8) | array[i * 4];
-		ret = mem->write((uint32_t)addr, data);
+		ret = writePartial(*mem, (uint32_t)addr, array.data(), head);
 		if (ret != OK)
 			return ret;
-		addr += 4;
 	}
-
-	len -= i * 4;
-	if (len > 0)
+	if (words > 0)
 	{
-#if 0
-		_DBGPRT("[WARNING] Unalighned write may cause unexpected result. 0x%08x 0x%08x\n", (uint32_t)addr, len);
-
-		uint32_t data;
-		ret = mem->read((uint32_t)addr, &data);
+		std::vector<uint32_t> data;
+		for (uint32_t i = head; i < head + words * 4; i += 4)
+			data.push_back((array[i + 3] << 24) | (array[i + 2] << 16) | (array[i + 1] << 8) | array[i]);
+		ret = mem->writeBlock64(addr + head, data.data(), data.size());
 		if (ret != OK)
 			return ret;
-		if (len > 0) { data = (data & 0xFFFFFF00) | array[i * 4]; len--; }
-		if (len > 0) { data = (data & 0xFFFF00FF) | (array[i * 4 + 1] << 8); len--; }
-		if (len > 0) { data = (data & 0xFF00FFFF) | (array[i * 4 + 2] << 16); len--; }
-		ASSERT_RELEASE(len == 0);
-
-		ret = mem->write((uint32_t)addr, data);
+	}
+	if (tail > 0)
+	{
+		ret = writePartial(*mem, (uint32_t)addr + head + words * 4, array.data() + head + words * 4, tail);
 		if (ret != OK)
 			return ret;
-#else
-		uint32_t offset = 0;
-		if (len >= 2)
-		{
-			ret = mem->write((uint32_t)addr, (uint16_t)((array[i * 4 + 1] << 8) | array[i * 4]));
-			if (ret != OK)
-				return ret;
-			len -= 2;
-			offset += 2;
-			addr += 2;
-		}
-		if (len > 0)
-		{
-			ret = mem->write((uint32_t)addr, array[i * 4 + offset]);
-			if (ret != OK)
-				return ret;
-			len--;
-		}
-		ASSERT_RELEASE(len == 0);
-#endif
 	}
 	return OK;
 }
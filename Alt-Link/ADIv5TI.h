@@ -4,12 +4,17 @@
 #include <cstdint>
 #include <vector>
 #include <memory>
+#include <future>
+#include <array>
+#include <set>
+#include <functional>
 #include "ADIv5.h"
 #include "ARMv7ARDIF.h"
 #include "ARMv6MSCS.h"
 #include "ARMv6MDWT.h"
 #include "ARMv6MBPU.h"
 #include "ARMv7MFPB.h"
+#include "MemoryCache.h"
 #include "TargetInterface.h"
 
 class ADIv5TI : public TargetInterface
@@ -22,8 +27,30 @@ private:
 	std::shared_ptr<ARMv6MBPU> bpu;
 	std::shared_ptr<ARMv7MFPB> fpb;
 	std::shared_ptr<ADIv5::MEM_AP> mem;
+	std::shared_ptr<MemoryCache> cache;
+
+	// 停止中だけ有効なコアレジスタのキャッシュ (REGSEL 0-20)
+	static const size_t REGISTER_CACHE_SIZE = 21;
+	bool halted = false;
+	bool registerCacheEnabled = true;
+	std::array<bool, REGISTER_CACHE_SIZE> registerValid;
+	std::array<uint32_t, REGISTER_CACHE_SIZE> registerValue;
+
+	// GDB が要求しているブレークポイント. コンパレータへは再開時にまとめて反映する
+	std::set<uint32_t> breakPoints;
+	bool breakPointsDirty = false;
 
 public:
+	struct RegisterCacheStats
+	{
+		uint64_t hits = 0;			// registers
+		uint64_t misses = 0;		// registers
+		uint64_t bulkFills = 0;		// register file snapshots
+		uint64_t invalidations = 0;
+
+		void print() const;
+	};
+
 	ADIv5TI(std::shared_ptr<ADIv5> _adi);
 
 	virtual int32_t attach();
@@ -32,8 +59,9 @@ public:
 	virtual void setTargetThreadId();
 	virtual void setCurrentPC(const uint64_t addr);
 
-	virtual void resume();
+	virtual int32_t resume();
 	virtual int32_t step(uint8_t* signal);
+	virtual int32_t rangeStep(uint64_t start, uint64_t end, uint8_t* signal);
 	virtual int32_t interrupt(uint8_t* signal);
 	virtual errno_t isRunning(bool* running, uint8_t* signal);
 
@@ -51,6 +79,7 @@ public:
 	virtual errno_t writeRegister(const uint32_t n, const uint64_t data1, const uint64_t data2); // 128-bit
 	virtual errno_t readGenericRegisters(std::vector<uint32_t>* array);
 	virtual errno_t writeGenericRegisters(const std::vector<uint32_t>& array);
+	virtual errno_t readExpeditedRegisters(std::vector<std::pair<uint32_t, uint32_t>>* regs);
 
 	virtual errno_t readMemory(uint64_t addr, uint32_t len, std::vector<uint8_t>* array);
 	virtual errno_t readMemory(uint64_t addr, uint32_t len, std::vector<uint32_t>* array);
@@ -65,7 +94,33 @@ public:
 
 	std::shared_ptr<ARMv6MSCS> getARMv6MSCS() { return scs; }
 	std::vector<std::shared_ptr<ARMv7ARDIF>> getARMv7ARDIF() { return v7dif; }
+	std::shared_ptr<MemoryCache> getMemoryCache() { return cache; }
+
+	// Core registers read while halted are kept until the core runs again; writes go through
+	void setRegisterCacheEnabled(bool enabled);
+	const RegisterCacheStats& getRegisterCacheStats() const { return registerStats; }
+	void resetRegisterCacheStats() { registerStats = RegisterCacheStats(); }
+
+	// Called on detach after the cache statistics are printed, e.g. for the probe's own numbers
+	void setStatsReporter(std::function<void()> reporter) { statsReporter = reporter; }
+
+	// Word accesses queued on the ADIv5 and sent together on flush() or get() of any future.
+	// data must stay valid until then. The other accesses flush the queue first.
+	// flush() also sends the transfers queued directly on the DAP.
+	std::future<int32_t> readMemoryAsync(uint64_t addr, uint32_t len, uint32_t* data);
+	std::future<int32_t> writeMemoryAsync(uint64_t addr, uint32_t len, const uint32_t* data);
+	int32_t flush();
 
 private:
 	std::string createTargetXml();
+	void setHalted(bool halted);
+
+	RegisterCacheStats registerStats;
+	std::function<void()> statsReporter;
+	void invalidateRegisters();
+	bool isRegisterCacheable(ARMv6MSCS::REGSEL reg) const;
+	errno_t readReg(ARMv6MSCS::REGSEL reg, uint32_t* data);
+	errno_t writeReg(ARMv6MSCS::REGSEL reg, uint32_t data);
+	errno_t fillRegisters(const std::vector<ARMv6MSCS::REGSEL>& regs);
+	errno_t commitBreakPoints();
 };
\ No newline at end of file
@@ -15,13 +15,20 @@ errno_t ARMv6MBPU::init()
 	if (ret != OK)
 		return ret;
 
-	bpList = std::vector<BP_COMP>();
+	std::vector<uint32_t> addrs;
 	for (uint32_t i = 0; i < ctrl.num(); i++)
+		addrs.push_back(REG_BP_COMP0 + (i * 4));
+
+	std::vector<uint32_t> data;
+	ret = ap.read(addrs, &data);
+	if (ret != OK)
+		return ret;
+
+	bpList = std::vector<BP_COMP>();
+	for (auto raw : data)
 	{
 		BP_COMP comp;
-		ret = ap.read(REG_BP_COMP0 + (i * 4), &comp.raw);
-		if (ret != OK)
-			return ret;
+		comp.raw = raw;
 		bpList.push_back(comp);
 	}
 
@@ -138,6 +145,41 @@ errno_t ARMv6MBPU::setBreakPoint(bool enable, uint32_t index, uint32_t addr)
 	return ret;
 }
 
+errno_t ARMv6MBPU::setBreakPoints(const std::vector<uint32_t>& addrs)
+{
+	if (!initialized)
+		return EPERM;
+
+	std::vector<ADIv5::MEM_AP::Access> accesses;
+	BP_CTRL _ctrl = ctrl;
+	if (!addrs.empty() && !isEnabled())
+	{
+		// auto enable
+		_ctrl.ENABLE = 1;
+		_ctrl.KEY = 1;
+		accesses.push_back({ REG_BP_CTRL, false, _ctrl.raw, false, 0 });
+	}
+
+	std::vector<BP_COMP> comps;
+	errno_t ret = BreakPointComparators::plan(bpList, addrs, REG_BP_COMP0, &comps, &accesses);
+	if (ret != OK)
+		return ret;
+	if (accesses.empty())
+		return OK;
+
+	ret = ap.transfer(accesses);
+	if (ret != OK)
+	{
+		// どこまで書けたか分からないので読み直す
+		init();
+		return ret;
+	}
+
+	ctrl = _ctrl;
+	bpList = comps;
+	return OK;
+}
+
 void ARMv6MBPU::printCtrl()
 {
 	if (!initialized)
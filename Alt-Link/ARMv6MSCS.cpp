@@ -160,22 +160,28 @@ int32_t ARMv6MSCS::waitForRegReady()
 {
 	int ret;
 
+	DHCSR_R ready;
+	ready.raw = 0;
+	ready.C_HALT = 1;
+	ready.S_REGRDY = 1;
+
+	uint32_t counter = 0;
 	while (1)
 	{
+		// S_REGRDY はプローブ側でポーリングする
 		DHCSR_R d;
-		ret = ap.read(REG_DHCSR, &d.raw);
-		if (ret != OK)
+		ret = ap.waitFor(REG_DHCSR, ready.raw, ready.raw, &d.raw);
+		if (ret == OK)
+			break;
+		if (ret != CMSISDAP_ERR_VALUE_MISMATCH)
 			return ret;
 
 		if (d.C_HALT == 0)
 			return CMSISDAP_ERR_INVALID_STATUS;
 
-		if (d.S_REGRDY == 1)
-			break;
-
-		// [TODO] timeout
-
-		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		counter++;
+		if (counter >= ap.getMatchWaitRounds())
+			return ret;
 	}
 
 	return OK;
@@ -193,18 +199,30 @@ int32_t ARMv6MSCS::readReg(REGSEL reg, uint32_t* data)
 	dcrsr.raw = 0;
 	dcrsr.REGSEL = reg;
 
-	int ret = ap.write(REG_DCRSR, dcrsr.raw);
-	if (ret != OK)
-		return ret;
+	DHCSR_R ready;
+	ready.raw = 0;
+	ready.C_HALT = 1;
+	ready.S_REGRDY = 1;
 
-	waitForRegReady();
-	if (ret != OK)
-		return ret;
+	// DCRSR 書き込み、S_REGRDY 待ち、DCRDR 読み出しを一度に送る
+	std::vector<ADIv5::MEM_AP::Access> accesses = {
+		{ REG_DCRSR, false, dcrsr.raw, false, 0 },
+		{ REG_DHCSR, true, ready.raw, true, ready.raw },
+		{ REG_DCRDR, true, 0, false, 0 },
+	};
+	int ret = ap.transfer(accesses);
+	if (ret == CMSISDAP_ERR_VALUE_MISMATCH)
+	{
+		ret = waitForRegReady();
+		if (ret != OK)
+			return ret;
 
-	ret = ap.read(REG_DCRDR, data);
+		ret = ap.read(REG_DCRDR, &accesses[2].data);
+	}
 	if (ret != OK)
 		return ret;
 
+	*data = accesses[2].data;
 	//_DBGPRT("readReg %d 0x%08x\n", reg, *data);
 	return OK;
 }
@@ -214,66 +232,102 @@ int32_t ARMv6MSCS::writeReg(REGSEL reg, uint32_t data)
 	if (reg == 19 || reg > 20)
 		return CMSISDAP_ERR_INVALID_ARGUMENT;
 
-	int ret = ap.write(REG_DCRDR, data);
-	if (ret != OK)
-		return ret;
-
 	DCRSR dcrsr;
 	dcrsr.raw = 0;
 	dcrsr.REGSEL = reg;
 	dcrsr.REGWnR = 1;
 
-	ret = ap.write(REG_DCRSR, dcrsr.raw);
+	DHCSR_R ready;
+	ready.raw = 0;
+	ready.C_HALT = 1;
+	ready.S_REGRDY = 1;
+
+	std::vector<ADIv5::MEM_AP::Access> accesses = {
+		{ REG_DCRDR, false, data, false, 0 },
+		{ REG_DCRSR, false, dcrsr.raw, false, 0 },
+		{ REG_DHCSR, true, ready.raw, true, ready.raw },
+	};
+	int ret = ap.transfer(accesses);
+	if (ret == CMSISDAP_ERR_VALUE_MISMATCH)
+		ret = waitForRegReady();
 	if (ret != OK)
 		return ret;
 
-	ret = waitForRegReady();
+	return OK;
+}
+
+int32_t ARMv6MSCS::readRegs(const std::vector<REGSEL>& regs, std::vector<uint32_t>* data)
+{
+	if (data == nullptr)
+		return CMSISDAP_ERR_INVALID_ARGUMENT;
+
+	DHCSR_R ready;
+	ready.raw = 0;
+	ready.C_HALT = 1;
+	ready.S_REGRDY = 1;
+
+	std::vector<ADIv5::MEM_AP::Access> accesses;
+	for (auto reg : regs)
+	{
+		if (reg == 19 || reg > 20)
+			return CMSISDAP_ERR_INVALID_ARGUMENT;
+
+		DCRSR dcrsr;
+		dcrsr.raw = 0;
+		dcrsr.REGSEL = reg;
+		accesses.push_back({ REG_DCRSR, false, dcrsr.raw, false, 0 });
+		accesses.push_back({ REG_DHCSR, true, ready.raw, true, ready.raw });
+		accesses.push_back({ REG_DCRDR, true, 0, false, 0 });
+	}
+
+	int ret = ap.transfer(accesses);
+	if (ret == CMSISDAP_ERR_VALUE_MISMATCH)
+	{
+		// プローブのリトライ内に S_REGRDY が立たなかったので 1 本ずつ読む
+		data->resize(regs.size());
+		for (size_t i = 0; i < regs.size(); i++)
+		{
+			ret = readReg(regs[i], &(*data)[i]);
+			if (ret != OK)
+				return ret;
+		}
+		return OK;
+	}
 	if (ret != OK)
 		return ret;
 
+	data->resize(regs.size());
+	for (size_t i = 0; i < regs.size(); i++)
+		(*data)[i] = accesses[i * 3 + 2].data;
 	return OK;
 }
 
+const std::vector<ARMv6MSCS::REGSEL>& ARMv6MSCS::getCoreRegs()
+{
+	static const std::vector<REGSEL> regs = {
+		R0, R1, R2, R3, R4, R5, R6, R7, R8, R9, R10, R11, R12, SP, LR, DebugReturnAddress,
+		xPSR, MSP, PSP, CONTROL_PRIMASK
+	};
+	return regs;
+}
+
 void ARMv6MSCS::printRegs()
 {
-	uint32_t data[4];
+	std::vector<uint32_t> data;
+	if (readRegs(getCoreRegs(), &data) != OK)
+		return;
 
 	_DBGPRT("    Registers\n");
-
-	readReg(R0, &data[0]);
-	readReg(R1, &data[1]);
-	readReg(R2, &data[2]);
-	readReg(R3, &data[3]);
 	_DBGPRT("      R0-R3 : 0x%08x 0x%08x 0x%08x 0x%08x\n"
 		, data[0], data[1], data[2], data[3]);
-
-	readReg(R4, &data[0]);
-	readReg(R5, &data[1]);
-	readReg(R6, &data[2]);
-	readReg(R7, &data[3]);
 	_DBGPRT("      R4-R7 : 0x%08x 0x%08x 0x%08x 0x%08x\n"
-		, data[0], data[1], data[2], data[3]);
-
-	readReg(R8,  &data[0]);
-	readReg(R9,  &data[1]);
-	readReg(R10, &data[2]);
-	readReg(R11, &data[3]);
+		, data[4], data[5], data[6], data[7]);
 	_DBGPRT("      R8-R11: 0x%08x 0x%08x 0x%08x 0x%08x\n"
-		, data[0], data[1], data[2], data[3]);
-
-	readReg(R12, &data[0]);
-	readReg(SP,  &data[1]);
-	readReg(LR,  &data[2]);
-	readReg(DebugReturnAddress, &data[3]);
+		, data[8], data[9], data[10], data[11]);
 	_DBGPRT("      R12   : 0x%08x SP : 0x%08x LR : 0x%08x PC: 0x%08x\n"
-		, data[0], data[1] , data[2], data[3]);
-
-	readReg(xPSR, &data[0]);
-	readReg(MSP, &data[1]);
-	readReg(PSP, &data[2]);
-	readReg(CONTROL_PRIMASK, &data[3]);
+		, data[12], data[13] , data[14], data[15]);
 	_DBGPRT("      xPSR  : 0x%08x MSP: 0x%08x PSP: 0x%08x CPM: 0x%08x\n"
-		, data[0], data[1], data[2], data[3]);
+		, data[16], data[17], data[18], data[19]);
 }
 
 void ARMv6MSCS::printDHCSR()
@@ -405,10 +459,63 @@ int32_t ARMv6MSCS::step(bool maskIntr)
 	w.C_STEP = 1;
 	w.C_MASKINTS = maskIntr ? 1 : 0;
 
-	ret = ap.write(REG_DHCSR, w.raw);
+	DHCSR_R halted;
+	halted.raw = 0;
+	halted.S_HALT = 1;
+
+	// ステップを書き、止まるまでプローブ側で待つ. 止まる前のレジスタを読まないように
+	std::vector<ADIv5::MEM_AP::Access> accesses = {
+		{ REG_DHCSR, false, w.raw, false, 0 },
+		{ REG_DHCSR, true, halted.raw, true, halted.raw },
+	};
+	ret = ap.transfer(accesses);
 	if (ret != OK)
 		return ret;
 
 	_DBGPRT("step success\n");
 	return OK;
+}
+
+int32_t ARMv6MSCS::stepAndReadPC(uint32_t* pc, DFSR* dfsr, bool maskIntr)
+{
+	if (pc == nullptr || dfsr == nullptr)
+		return CMSISDAP_ERR_INVALID_ARGUMENT;
+
+	DHCSR_W w;
+	w.raw = 0;
+	w.DBGKEY = 0xA05F;
+	w.C_DEBUGEN = 1;
+	w.C_HALT = 0;
+	w.C_STEP = 1;
+	w.C_MASKINTS = maskIntr ? 1 : 0;
+
+	DHCSR_R halted;
+	halted.raw = 0;
+	halted.S_HALT = 1;
+
+	DHCSR_R ready;
+	ready.raw = 0;
+	ready.S_REGRDY = 1;
+
+	DCRSR dcrsr;
+	dcrsr.raw = 0;
+	dcrsr.REGSEL = DebugReturnAddress;
+
+	// DFSR のクリア、ステップ、停止待ち、DFSR と PC の読み出しを一度に送る
+	std::vector<ADIv5::MEM_AP::Access> accesses = {
+		{ REG_DFSR, false, 0x1F, false, 0 },
+		{ REG_DHCSR, false, w.raw, false, 0 },
+		{ REG_DHCSR, true, halted.raw, true, halted.raw },
+		{ REG_DFSR, true, 0, false, 0 },
+		{ REG_DCRSR, false, dcrsr.raw, false, 0 },
+		{ REG_DHCSR, true, ready.raw, true, ready.raw },
+		{ REG_DCRDR, true, 0, false, 0 },
+	};
+	int32_t ret = ap.transfer(accesses);
+	if (ret != OK)
+		return ret;
+
+	dfsr->raw = accesses[3].data;
+	*pc = accesses[6].data;
+	return OK;
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #pragma once
 
 #include <cstdint>
+#include <vector>
 #include "ADIv5.h"
 
 class ARMv6MSCS : public ADIv5::Memory
@@ -120,6 +121,10 @@ public:
 	errno_t writeDEMCR(DEMCR& demcr);
 	errno_t readReg(REGSEL reg, uint32_t* data);
 	errno_t writeReg(REGSEL reg, uint32_t data);
+	// Reads every register in one batch of DCRSR write, S_REGRDY match and DCRDR read
+	errno_t readRegs(const std::vector<REGSEL>& regs, std::vector<uint32_t>* data);
+	// R0-R15, xPSR, MSP, PSP and CONTROL/PRIMASK
+	static const std::vector<REGSEL>& getCoreRegs();
 	void printRegs();
 	void printDHCSR();
 
@@ -128,6 +133,9 @@ public:
 	int32_t halt(bool maskIntr = false);
 	int32_t run(bool maskIntr = false);
 	int32_t step(bool maskIntr = false);
+	// Steps the halted core and reads PC once it halts again, in one batch.
+	// DFSR is cleared before the step, so *dfsr tells a breakpoint or watchpoint hit from the step itself.
+	int32_t stepAndReadPC(uint32_t* pc, DFSR* dfsr, bool maskIntr = false);
 
 private:
 	int32_t waitForRegReady();
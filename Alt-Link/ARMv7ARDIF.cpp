@@ -398,6 +398,20 @@ errno_t ARMv7ARDIF::readDSCR(DBGDSCR* dscr)
 	return OK;
 }
 
+// DSCR はプローブ側でポーリングし、足りなければホストから繰り返す
+errno_t ARMv7ARDIF::waitForDSCR(uint32_t mask, uint32_t value, DBGDSCR* dscr)
+{
+	errno_t ret;
+	uint32_t rounds = ap.getMatchWaitRounds();
+	for (uint32_t counter = 0; counter < rounds; counter++)
+	{
+		ret = ap.waitFor(REG_DBGDSCR, mask, value, &dscr->raw);
+		if (ret != CMSISDAP_ERR_VALUE_MISMATCH)
+			break;
+	}
+	return ret;
+}
+
 errno_t ARMv7ARDIF::halt()
 {
 	DBGDSCR dscr;
@@ -414,34 +428,26 @@ errno_t ARMv7ARDIF::halt()
 	if (ret != OK)
 		return ret;
 
-	uint32_t counter = 0;
-	while (1)
+	DBGDSCR halted = { 0 };
+	halted.HALTED = 1;
+	ret = waitForDSCR(halted.raw, halted.raw, &dscr);
+	if (ret == CMSISDAP_ERR_VALUE_MISMATCH)
 	{
-		errno_t ret = ap.read(REG_DBGDSCR, &dscr.raw);
-		if (ret != OK)
-			return ret;
-
-		if (dscr.HALTED)
-		{
-			if (dscr.ITRen == 0)
-			{
-				dscr.ITRen = 1;
-				ret = ap.write(REG_DBGDSCR, dscr.raw);
-				if (ret != OK)
-				{
-					_DBGPRT("Failed to set ITRen.\n");
-					return ret;
-				}
-			}
-			break;
-		}
+		_DBGPRT("Failed to halt. (DSCR: 0x%08x)\n", dscr.raw);
+		dscr.printIfNotSame();
+		return EFAULT;
+	}
+	if (ret != OK)
+		return ret;
 
-		counter++;
-		if (counter >= 100)
+	if (dscr.ITRen == 0)
+	{
+		dscr.ITRen = 1;
+		ret = ap.write(REG_DBGDSCR, dscr.raw);
+		if (ret != OK)
 		{
-			_DBGPRT("Failed to halt. (DSCR: 0x%08x)\n", dscr.raw);
-			dscr.printIfNotSame();
-			return EFAULT;
+			_DBGPRT("Failed to set ITRen.\n");
+			return ret;
 		}
 	}
 	return OK;
@@ -472,25 +478,16 @@ errno_t ARMv7ARDIF::run()
 	if (ret != OK)
 		return ret;
 
-	uint32_t counter = 0;
-	while (1)
+	DBGDSCR halted = { 0 };
+	halted.HALTED = 1;
+	ret = waitForDSCR(halted.raw, 0, &dscr);
+	if (ret == CMSISDAP_ERR_VALUE_MISMATCH)
 	{
-		errno_t ret = ap.read(REG_DBGDSCR, &dscr.raw);
-		if (ret != OK)
-			return ret;
-
-		if (dscr.HALTED == 0)
-			break;
-
-		counter++;
-		if (counter >= 100)
-		{
-			_DBGPRT("Failed to restart. (DSCR: 0x%08x)\n", dscr.raw);
-			dscr.printIfNotSame();
-			return EFAULT;
-		}
+		_DBGPRT("Failed to restart. (DSCR: 0x%08x)\n", dscr.raw);
+		dscr.printIfNotSame();
+		return EFAULT;
 	}
-	return OK;
+	return ret;
 }
 
 errno_t ARMv7ARDIF::readDCC(uint32_t* val)
@@ -498,27 +495,20 @@ errno_t ARMv7ARDIF::readDCC(uint32_t* val)
 	if (val == nullptr)
 		return EINVAL;
 
-	uint32_t counter = 0;
-	while (1)
+	DBGDSCR dscr;
+	DBGDSCR full = { 0 };
+	full.TXfull = 1;
+	errno_t ret = waitForDSCR(full.raw, full.raw, &dscr);
+	if (ret == CMSISDAP_ERR_VALUE_MISMATCH)
 	{
-		DBGDSCR dscr;
-		errno_t ret = ap.read(REG_DBGDSCR, &dscr.raw);
-		if (ret != OK)
-			return ret;
-
-		if (dscr.TXfull)
-			break;
-
-		counter++;
-		if (counter >= 100)
-		{
-			_DBGPRT("DTR TX is not full. (DSCR: 0x%08x)\n", dscr.raw);
-			dscr.printIfNotSame();
-			return EFAULT;
-		}
+		_DBGPRT("DTR TX is not full. (DSCR: 0x%08x)\n", dscr.raw);
+		dscr.printIfNotSame();
+		return EFAULT;
 	}
+	if (ret != OK)
+		return ret;
 
-	errno_t ret = ap.read(REG_DBGDTRTX, val);
+	ret = ap.read(REG_DBGDTRTX, val);
 	if (ret != OK)
 		return ret;
 
@@ -527,27 +517,20 @@ errno_t ARMv7ARDIF::readDCC(uint32_t* val)
 
 errno_t ARMv7ARDIF::writeDCC(uint32_t val)
 {
-	uint32_t counter = 0;
-	while (1)
+	DBGDSCR dscr;
+	DBGDSCR full = { 0 };
+	full.RXfull = 1;
+	errno_t ret = waitForDSCR(full.raw, 0, &dscr);
+	if (ret == CMSISDAP_ERR_VALUE_MISMATCH)
 	{
-		DBGDSCR dscr;
-		errno_t ret = ap.read(REG_DBGDSCR, &dscr.raw);
-		if (ret != OK)
-			return ret;
-
-		if (dscr.RXfull == 0)
-			break;
-
-		counter++;
-		if (counter >= 100)
-		{
-			_DBGPRT("DTR RX is full. (DSCR: 0x%08x)\n", dscr.raw);
-			dscr.printIfNotSame();
-			return EFAULT;
-		}
+		_DBGPRT("DTR RX is full. (DSCR: 0x%08x)\n", dscr.raw);
+		dscr.printIfNotSame();
+		return EFAULT;
 	}
+	if (ret != OK)
+		return ret;
 
-	errno_t ret = ap.write(REG_DBGDTRRX, val);
+	ret = ap.write(REG_DBGDTRRX, val);
 	if (ret != OK)
 		return ret;
 
@@ -557,27 +540,20 @@ errno_t ARMv7ARDIF::writeDCC(uint32_t val)
 
 errno_t ARMv7ARDIF::writeITR(uint32_t val)
 {
-	uint32_t counter = 0;
-	while (1)
+	DBGDSCR dscr;
+	DBGDSCR complete = { 0 };
+	complete.InstrCompl_l = 1;
+	errno_t ret = waitForDSCR(complete.raw, complete.raw, &dscr);
+	if (ret == CMSISDAP_ERR_VALUE_MISMATCH)
 	{
-		DBGDSCR dscr;
-		errno_t ret = ap.read(REG_DBGDSCR, &dscr.raw);
-		if (ret != OK)
-			return ret;
-
-		if (dscr.InstrCompl_l)
-			break;
-
-		counter++;
-		if (counter >= 100)
-		{
-			_DBGPRT("InstrCompl_l is 0. (DSCR: 0x%08x)\n", dscr.raw);
-			dscr.printIfNotSame();
-			return EFAULT;
-		}
+		_DBGPRT("InstrCompl_l is 0. (DSCR: 0x%08x)\n", dscr.raw);
+		dscr.printIfNotSame();
+		return EFAULT;
 	}
+	if (ret != OK)
+		return ret;
 
-	errno_t ret = ap.write(REG_DBGITR, val);
+	ret = ap.write(REG_DBGITR, val);
 	if (ret != OK)
 		return ret;
 	return OK;
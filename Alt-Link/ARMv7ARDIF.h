@@ -130,4 +130,5 @@ private:
 	DBGDEVID1 devid1;
 
 	errno_t readDSCR(DBGDSCR* dscr);
+	errno_t waitForDSCR(uint32_t mask, uint32_t value, DBGDSCR* dscr);
 };
\ No newline at end of file
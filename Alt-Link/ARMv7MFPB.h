@@ -2,7 +2,9 @@
 #pragma once
 
 #include <cstdint>
+#include <vector>
 #include "ADIv5.h"
+#include "BreakPointComparators.h"
 
 class ARMv7MFPB : public ADIv5::Memory
 {
@@ -63,6 +65,13 @@ private:
 				return true;
 			return false;
 		}
+		bool isReserved() { return ENABLE && REPLACE == REMAP; }
+		void set(uint32_t addr) {
+			raw = 0;
+			REPLACE = (addr & 0x2) != 0 ? UPPER_HALF : LOWER_HALF;
+			ENABLE = 1;
+			COMP = (addr & 0x1FFFFFFC) >> 2;
+		}
 	};
 	static_assert(CONFIRM_UINT32(FP_COMP));
 
@@ -84,6 +93,11 @@ public:
 	errno_t addBreakPoint(uint32_t addr);
 	errno_t delBreakPoint(uint32_t addr);
 	errno_t setBreakPoint(bool enable, uint32_t index, uint32_t addr);
+	// Makes the comparators hold exactly these breakpoints. Comparators already matching are kept
+	// and only the changes are written, in one batch.
+	errno_t setBreakPoints(const std::vector<uint32_t>& addrs);
+	uint32_t getBreakPointCount() { return initialized ? ctrl.num() : 0; }
+	uint32_t getFreeBreakPointCount() { return initialized ? BreakPointComparators::countFree(bpList) : 0; }
 
 	void printCtrl();
 	void printRemap();
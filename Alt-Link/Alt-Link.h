@@ -1,6 +1,15 @@
 #pragma once
 
+#include <cstring>
+
 #include "CMSIS-DAP.h"
+#include "TcpTransport.h"
+#include "LoopbackTransport.h"
+#include "CMSISDAPSim.h"
+#include "TraceTransport.h"
+#include "ReplayTransport.h"
+#include "SpeedCache.h"
+#include "TopologyCache.h"
 #include "ADIv5.h"
 #include "ADIv5TI.h"
 
@@ -8,12 +17,16 @@ class AltLink {
 public:
 	class Device {
 		CMSISDAP::DeviceInfo info;
+		std::shared_ptr<DAPTransport> transport;	// nullptr: USB HID
+		std::string tracePath;
+		std::string topologyCachePath;
 		CMSISDAP::ConnectionType connectionType;
 		bool opened;
 		bool scanned;
 		std::shared_ptr<CMSISDAP> dap;
 		std::shared_ptr<ADIv5> adi;
 		std::shared_ptr<ADIv5TI> ti;
+		std::shared_ptr<CMSISDAPSim> simulator;
 
 		struct DeviceFlags
 		{
@@ -25,7 +38,16 @@ public:
 		} flags;
 
 	private:
-		errno_t scanAPs() {
+		std::shared_ptr<ADIv5TI> createTI() {
+			auto _ti = std::make_shared<ADIv5TI>(adi);
+			auto sim = simulator;
+			if (sim)
+				_ti->setStatsReporter([sim]() { sim->getStats().print(); });
+			return _ti;
+		}
+
+		// refresh: ignore a cached topology and store the result of a full scan
+		errno_t scanAPs(bool refresh = false) {
 			errno_t ret;
 
 			if (opened == false)
@@ -83,7 +105,7 @@ public:
 					return ret;
 			}
 
-			ret = adi->scanAPs();
+			ret = topologyCachePath.empty() ? adi->scanAPs() : scanAPsCached(refresh);
 			if (ret != OK)
 				return ret;
 
@@ -91,13 +113,93 @@ public:
 			return ret;
 		}
 
+		// 同じボードなら ROM Table を辿らずにキャッシュから復元する
+		errno_t scanAPsCached(bool refresh) {
+			TopologyCache cache(topologyCachePath);
+			(void)cache.load();
+
+			ADIv5::TopologyKey key;
+			errno_t ret = adi->readTopologyKey(&key);
+			if (ret != OK)
+				return adi->scanAPs();
+
+			ADIv5::Topology topology;
+			if (!refresh && cache.find(key, &topology))
+			{
+				ret = adi->setTopology(topology);
+				if (ret == OK)
+					return OK;
+				_DBGPRT("Topology cache is stale, rescanning.\n");
+			}
+
+			ret = adi->scanAPs();
+			if (ret != OK)
+				return ret;
+
+			adi->getTopology(&topology);
+			cache.store(key, topology);
+			(void)cache.save();
+			return OK;
+		}
+
+		static const size_t PATTERN_COUNT = 8;
+
+		// 既知のパターンを書いて読み戻す. 元の内容は呼び出し側が最も遅いクロックで退避・復元する
+		errno_t verifyMemory(ADIv5::MEM_AP& memAp, uint32_t addr) {
+			static const uint32_t patterns[PATTERN_COUNT] = {
+				0x00000000, 0xFFFFFFFF, 0x55555555, 0xAAAAAAAA,
+				0x12345678, 0xEDCBA987, 0x0F0F0F0F, 0xF0F0F0F0
+			};
+			uint32_t readBack[PATTERN_COUNT];
+
+			errno_t ret = memAp.writeBlock(addr, patterns, PATTERN_COUNT);
+			if (ret == OK)
+				ret = memAp.readBlock(addr, readBack, PATTERN_COUNT);
+			if (ret != OK)
+				return ret;
+
+			return (memcmp(patterns, readBack, sizeof(patterns)) == 0) ? OK : CMSISDAP_ERR_VERIFY;
+		}
+
+		// 高すぎるクロックで失敗した後にリンクを立て直す
+		errno_t recoverLink(ADIv5& link, uint32_t speed) {
+			errno_t ret = dap->setSpeed(speed);
+			if (ret != OK)
+				return ret;
+
+			ret = dap->setConnectionType(connectionType);
+			if (ret != OK)
+				return ret;
+
+			ADIv5::DP_IDCODE idcode;
+			ret = link.getIDCODE(&idcode);
+			if (ret != OK)
+				return ret;
+
+			return link.clearError();
+		}
+
 	public:
-		Device(CMSISDAP::DeviceInfo _info)
-			: info(_info), opened(false), scanned(false), adi(nullptr), dap(nullptr), ti(nullptr),
+		Device(CMSISDAP::DeviceInfo _info, std::shared_ptr<DAPTransport> _transport = nullptr)
+			: info(_info), transport(_transport), opened(false), scanned(false), adi(nullptr), dap(nullptr), ti(nullptr),
 			connectionType(CMSISDAP::SWJ_SWD) {}
 
+		// Records probe traffic to a file on open()
+		void setTrace(const std::string& path) { tracePath = path; }
+		// The simulator's round trips and virtual time are printed on detach
+		void setSimulator(std::shared_ptr<CMSISDAPSim> sim) { simulator = sim; }
+		void setTopologyCache(const std::string& path) { topologyCachePath = path; }
+
 		errno_t open() {
-			dap = CMSISDAP::open(info);
+			if (!tracePath.empty())
+			{
+				auto traced = TraceTransport::create(transport ? transport : HidTransport::open(info.vid, info.pid), tracePath);
+				dap = CMSISDAP::open(traced);
+			}
+			else
+			{
+				dap = transport ? CMSISDAP::open(transport) : CMSISDAP::open(info);
+			}
 			if (dap == nullptr)
 			{
 				_ERRPRT("Failed to open CMSIS-DAP device.\n");
@@ -132,6 +234,133 @@ public:
 			return ret;
 		}
 
+		/*
+		 * SWJ clock auto-tuning.
+		 * Raises the clock step by step while DP IDCODE (and, if ramAddress is given, a RAM pattern)
+		 * reads back correctly, then settles one step below the highest passing clock.
+		 * The result is stored in cachePath per probe serial and DP IDCODE; later sessions only
+		 * re-check IDCODE at the stored clock.
+		 * ramAddress: word aligned RAM used for the pattern test (contents are restored), -1: IDCODE only
+		 */
+		errno_t tuneSpeed(const std::string& cachePath, int64_t ramAddress = -1) {
+			static const uint32_t speeds[] = {
+				1000 * 1000, 2000 * 1000, 4000 * 1000, 6000 * 1000, 8000 * 1000, 10000 * 1000
+			};
+			const size_t numSpeeds = sizeof(speeds) / sizeof(speeds[0]);
+			const uint32_t repeat = 16;
+
+			if (opened == false)
+				return EFAULT;
+
+			auto link = adi ? adi : std::make_shared<ADIv5>(dap);
+
+			// 保存済みのクロックを探すだけなので今のクロックで読む
+			ADIv5::DP_IDCODE idcode;
+			errno_t ret = link->getIDCODE(&idcode);
+
+			std::string serial = info.serial;
+			if (serial.empty() && dap->getSerialNumber(&serial) != OK)
+				serial = "";
+
+			SpeedCache cache(cachePath);
+			(void)cache.load();
+
+			uint32_t speed;
+			if (ret == OK && cache.find({ serial, idcode.raw }, &speed))
+			{
+				ret = dap->setSpeed(speed);
+				if (ret == OK)
+					ret = link->checkIDCODE(idcode, repeat);
+				if (ret == OK)
+				{
+					_DBGPRT("SWJ clock: %u Hz (cached)\n", speed);
+					return OK;
+				}
+
+				_DBGPRT("Cached SWJ clock %u Hz is not reliable, tuning again.\n", speed);
+			}
+
+			// 基準の IDCODE は最も遅いクロックで取り直す
+			ret = recoverLink(*link, speeds[0]);
+			if (ret == OK)
+				ret = link->getIDCODE(&idcode);
+			if (ret != OK)
+			{
+				_ERRPRT("Could not read DP_IDCODE. (0x%08x)\n", ret);
+				return ret;
+			}
+
+			std::shared_ptr<ADIv5::MEM_AP> memAp;
+			uint32_t saved[PATTERN_COUNT];
+			if (ramAddress >= 0)
+			{
+				ret = scan();
+				if (ret != OK)
+					return ret;
+
+				link = adi;
+				auto sysmem = adi->findSysmem();
+				if (sysmem.empty())
+				{
+					_ERRPRT("No system memory AP for the RAM pattern test.\n");
+					return EFAULT;
+				}
+				memAp = sysmem[0];
+
+				// 試験で壊れてもよいように、確実に読める最も遅いクロックで退避しておく
+				ret = memAp->readBlock((uint32_t)ramAddress, saved, PATTERN_COUNT);
+				if (ret != OK)
+					return ret;
+			}
+
+			size_t passed = numSpeeds;
+			for (size_t i = 0; i < numSpeeds; i++)
+			{
+				ret = dap->setSpeed(speeds[i]);
+				if (ret == OK)
+					ret = link->checkIDCODE(idcode, repeat);
+				if (ret == OK && memAp != nullptr)
+					ret = verifyMemory(*memAp, (uint32_t)ramAddress);
+
+				if (ret != OK)
+				{
+					_DBGPRT("SWJ clock %u Hz failed. (0x%08x)\n", speeds[i], ret);
+					break;
+				}
+				passed = i;
+			}
+
+			// 失敗したクロックのままでは書き戻しも壊れるので、最も遅いクロックに戻してから書き戻す
+			if (memAp != nullptr)
+			{
+				errno_t restored = recoverLink(*link, speeds[0]);
+				if (restored == OK)
+					restored = memAp->writeBlock((uint32_t)ramAddress, saved, PATTERN_COUNT);
+				if (restored != OK)
+				{
+					_ERRPRT("Failed to restore RAM at 0x%08x. (0x%08x)\n", (uint32_t)ramAddress, restored);
+					return restored;
+				}
+			}
+
+			if (passed == numSpeeds)
+			{
+				(void)recoverLink(*link, speeds[0]);
+				_ERRPRT("SWJ clock tuning failed at %u Hz.\n", speeds[0]);
+				return ret;
+			}
+
+			// 余裕を持たせて一段下げる
+			speed = speeds[(passed > 0) ? passed - 1 : 0];
+			ret = recoverLink(*link, speed);
+			if (ret != OK)
+				return ret;
+
+			_DBGPRT("SWJ clock: %u Hz (highest passed %u Hz)\n", speed, speeds[passed]);
+			cache.store({ serial, idcode.raw }, speed);
+			return cache.save();
+		}
+
 		errno_t isDataWatchpointAndTraceBlockEnabled(bool* enabled) {
 			errno_t ret;
 			if (ti == nullptr || enabled == nullptr)
@@ -175,10 +404,13 @@ public:
 				if (ret != OK)
 					return ret;
 
-				// rescan
-				ret = scanAPs();
-				if (ret != OK)
-					return ret;
+				// rescan, unless the cached topology already lists the DWT
+				if (topologyCachePath.empty() || (adi->findARMv6MDWT().empty() && adi->findARMv7MDWT().empty()))
+				{
+					ret = scanAPs(true);
+					if (ret != OK)
+						return ret;
+				}
 			}
 			return OK;
 		}
@@ -195,7 +427,7 @@ public:
 				return EFAULT;
 
 			if (ti == nullptr)
-				ti = std::make_shared<ADIv5TI>(adi);
+				ti = createTI();
 
 			if (!flags.autoEnableDataWatchpointAndTraceBlock)
 				return OK;
@@ -207,7 +439,7 @@ public:
 				{
 					_DBGPRT("Enabling Data Watchpoint and Trace Block.\n");
 					if (enableDataWatchpointAndTraceBlock() == OK)
-						ti = std::make_shared<ADIv5TI>(adi);
+						ti = createTI();
 				}
 			}
 
@@ -220,7 +452,7 @@ public:
 
 
 			if (ti == nullptr && adi != nullptr)
-				ti = std::make_shared<ADIv5TI>(adi);
+				ti = createTI();
 
 			return ti;
 		}
@@ -252,5 +484,56 @@ public:
 		return ret;
 	}
 
+	// Adds a probe shared by ProbeServer on another host
+	errno_t connect(const std::string& host, uint16_t port) {
+		auto transport = TcpTransport::connect(host, port);
+		if (transport == nullptr)
+		{
+			_ERRPRT("Failed to connect to remote probe. (%s:%u)\n", host.c_str(), port);
+			return CMSISDAP_ERR_TRANSPORT_CONNECT;
+		}
+
+		CMSISDAP::DeviceInfo info;
+		info.path = host + ":" + std::to_string(port);
+		info.productString = "Remote CMSIS-DAP";
+		info.vid = 0;
+		info.pid = 0;
+		devices.push_back(std::make_shared<Device>(info, transport));
+		return OK;
+	}
+
+	// Adds a probe that replays a recorded trace
+	errno_t replay(const std::string& path) {
+		auto transport = ReplayTransport::open(path);
+		if (transport == nullptr)
+		{
+			_ERRPRT("Failed to open trace. (%s)\n", path.c_str());
+			return EINVAL;
+		}
+
+		CMSISDAP::DeviceInfo info;
+		info.path = path;
+		info.productString = "Replayed CMSIS-DAP";
+		info.vid = 0;
+		info.pid = 0;
+		devices.push_back(std::make_shared<Device>(info, transport));
+		return OK;
+	}
+
+	// Adds a simulated probe and Cortex-M target, for running without hardware
+	std::shared_ptr<CMSISDAPSim> simulate(const CMSISDAPSim::Config& config = CMSISDAPSim::Config()) {
+		auto sim = std::make_shared<CMSISDAPSim>(std::make_shared<CortexMSim>(), config);
+
+		CMSISDAP::DeviceInfo info;
+		info.path = "sim";
+		info.productString = config.name;
+		info.vid = 0;
+		info.pid = 0;
+		auto device = std::make_shared<Device>(info, std::make_shared<LoopbackTransport>(sim));
+		device->setSimulator(sim);
+		devices.push_back(device);
+		return sim;
+	}
+
 	std::vector<std::shared_ptr<Device>>& getDevices() { return devices; }
 };
\ No newline at end of file
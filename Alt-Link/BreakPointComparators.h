@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "ADIv5.h"
+
+/*
+ * Comparator allocation shared by the v6-M BPU and the v7-M FPB. Only the encoding differs,
+ * COMP provides:
+ *   bool match(uint32_t addr)	breakpoint on addr
+ *   bool isReserved()			enabled but not a breakpoint (FPB REMAP), left alone
+ *   void set(uint32_t addr)		breakpoint encoding for addr
+ */
+namespace BreakPointComparators
+{
+	// Comparators that can hold a breakpoint
+	template <class COMP>
+	uint32_t countFree(const std::vector<COMP>& comps)
+	{
+		uint32_t count = 0;
+		for (auto comp : comps)
+		{
+			if (!comp.isReserved())
+				count++;
+		}
+		return count;
+	}
+
+	// Makes comps hold exactly these breakpoints. Comparators already matching are kept,
+	// and a write for every comparator that changed is appended to accesses.
+	template <class COMP>
+	errno_t plan(const std::vector<COMP>& current, const std::vector<uint32_t>& addrs, uint32_t comp0,
+		std::vector<COMP>* comps, std::vector<ADIv5::MEM_AP::Access>* accesses)
+	{
+		// Code: 0x00000000 - 0x20000000
+		for (auto addr : addrs)
+		{
+			if ((addr & 0x1) != 0 || (addr & 0xE0000000) != 0)
+				return EINVAL;
+		}
+
+		// 既に同じアドレスを持つコンパレータはそのまま使う
+		*comps = current;
+		std::vector<bool> used(comps->size(), false);
+		std::vector<uint32_t> added;
+		for (auto addr : addrs)
+		{
+			size_t i = 0;
+			while (i < comps->size() && (used[i] || !(*comps)[i].ENABLE || !(*comps)[i].match(addr)))
+				i++;
+			if (i < comps->size())
+				used[i] = true;
+			else
+				added.push_back(addr);
+		}
+
+		// 要らなくなったブレークポイントを外し、空いたところに新しいものを入れる
+		for (size_t i = 0; i < comps->size(); i++)
+		{
+			if (!used[i] && (*comps)[i].ENABLE && !(*comps)[i].isReserved())
+				(*comps)[i].raw = 0;
+		}
+		for (auto addr : added)
+		{
+			size_t i = 0;
+			while (i < comps->size() && (used[i] || (*comps)[i].ENABLE))
+				i++;
+			if (i >= comps->size())
+				return EFAULT;
+
+			used[i] = true;
+			(*comps)[i].set(addr);
+		}
+
+		for (size_t i = 0; i < comps->size(); i++)
+		{
+			if ((*comps)[i].raw != current[i].raw)
+				accesses->push_back({ comp0 + (uint32_t)(i * 4), false, (*comps)[i].raw, false, 0 });
+		}
+		return OK;
+	}
+}
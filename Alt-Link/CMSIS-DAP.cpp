@@ -3,6 +3,9 @@
 
 #include <locale>
 #include <codecvt>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 
 #include "CMSIS-DAP.h"
 #include "ADIv5.h"
@@ -24,7 +27,6 @@
 
 #define _CMSISDAP_DEFAULT_PACKET_SIZE (64 + 1) /* 64 bytes + 1 byte(hid report id) */
 #define _CMSISDAP_MAX_CLOCK (10 * 1000 * 1000) /* Hz */
-#define _CMSISDAP_USB_TIMEOUT 1000             /* ms */
 
 static inline uint32_t buf2LE32(const uint8_t *buf)
 {
@@ -49,7 +51,11 @@ static inline uint32_t buf2LE32(const uint8_t *buf)
 #define _TX_RES_OK 0x1
 #define _TX_RES_WAIT 0x2
 #define _TX_RES_SWD_ERROR 0x4
-#define _TX_RES_VALUE_MISMATCH 0x8
+#define _TX_RES_PROTOCOL_ERROR 0x8
+#define _TX_RES_VALUE_MISMATCH 0x10
+
+/* DAP_Transfer value match retries, 1000 reads take ~10ms at 5MHz */
+#define _DAP_MATCH_RETRY 1000
 
 #define AP_ABORT_DAPABORT 0x01     /* generate a DAP abort */
 #define AP_ABORT_STK_CMP_CLR 0x02  /* clear STICKYCMP sticky compare flag */
@@ -134,25 +140,30 @@ int32_t CMSISDAP::enumerate(std::vector<DeviceInfo>* devices)
 
 std::shared_ptr<CMSISDAP> CMSISDAP::open(DeviceInfo& info)
 {
-	if (hid_init() != 0)
+	auto transport = HidTransport::open(info.vid, info.pid);
+	if (transport == nullptr)
 	{
 		return std::shared_ptr<CMSISDAP>();
 	}
 
-	hid_device* handle = hid_open(info.vid, info.pid, NULL);
-	if (handle == NULL)
+	return std::shared_ptr<CMSISDAP>(new CMSISDAP(transport, info.vid, info.pid));
+}
+
+std::shared_ptr<CMSISDAP> CMSISDAP::open(std::shared_ptr<DAPTransport> transport)
+{
+	if (transport == nullptr)
 	{
-		_DBGPRT("hid_open failed.\n");
 		return std::shared_ptr<CMSISDAP>();
 	}
 
-	return std::shared_ptr<CMSISDAP>(new CMSISDAP(handle, info.vid, info.pid)); 
+	return std::shared_ptr<CMSISDAP>(new CMSISDAP(transport, 0, 0));
 }
 
-CMSISDAP::CMSISDAP(hid_device* handle, uint16_t _vid, uint16_t _pid)
-	: hidHandle(handle), vid(_vid), pid(_pid)
+CMSISDAP::CMSISDAP(std::shared_ptr<DAPTransport> _transport, uint16_t _vid, uint16_t _pid)
+	: transport(_transport), vid(_vid), pid(_pid), matchRetry(0), matchMask(0), matchMaskValid(false), executeCommandsSupported(false)
 {
 	dapInfo.packetMaxSize = _CMSISDAP_DEFAULT_PACKET_SIZE;
+	dapInfo.packetMaxCount = 1;
 }
 
 CMSISDAP::~CMSISDAP()
@@ -178,20 +189,11 @@ CMSISDAP::~CMSISDAP()
 		return;
 	}
 
-	hid_close(hidHandle);
-	if (hid_exit() != 0)
-	{
-		return;
-	}
 }
 
 int32_t CMSISDAP::usbTx(const TxPacket& packet)
 {
-	int ret = hid_write(hidHandle, packet.data(), packet.length());
-	if (ret == -1)
-		return CMSISDAP_ERR_USBHID_WRITE;
-
-	return OK;
+	return transport->write(packet.data(), packet.length());
 }
 
 int32_t CMSISDAP::usbRx(RxPacket* rx)
@@ -199,16 +201,24 @@ int32_t CMSISDAP::usbRx(RxPacket* rx)
 	if (rx == nullptr)
 		return CMSISDAP_ERR_INVALID_ARGUMENT;
 
-	int ret = hid_read_timeout(hidHandle, rx->data(), rx->length(), _CMSISDAP_USB_TIMEOUT);
-	if (ret == -1 || ret == 0)
-		return CMSISDAP_ERR_USBHID_TIMEOUT;
+	uint32_t length;
+	int ret = transport->read(rx->data(), rx->capacity(), &length);
+	if (ret != OK)
+		return ret;
 
-	rx->length(ret);
+	rx->length(length);
 	return OK;
 }
 
 int32_t CMSISDAP::usbTxRx(const TxPacket& tx, RxPacket* rx)
 {
+	// パイプライン中の応答を取り切らずに戻った呼び出し元がいる
+	if (!pendingCommands.empty())
+	{
+		usbDrain(false);
+		return CMSISDAP_ERR_INVALID_STATUS;
+	}
+
 	int ret;
 	ret = usbTx(tx);
 	if (ret != OK)
@@ -217,9 +227,62 @@ int32_t CMSISDAP::usbTxRx(const TxPacket& tx, RxPacket* rx)
 	return usbRx(rx);
 }
 
+int32_t CMSISDAP::usbSubmit(const TxPacket& tx)
+{
+	if (pendingCommands.size() >= maxOutstanding())
+		return CMSISDAP_ERR_INVALID_STATUS;
+
+	int ret = usbTx(tx);
+	if (ret != OK)
+		return ret;
+
+	pendingCommands.push_back(tx.data()[1]);
+	return OK;
+}
+
+uint32_t CMSISDAP::maxOutstanding() const
+{
+	return transport->maxOutstanding(std::max<uint16_t>(dapInfo.packetMaxCount, 1));
+}
+
+int32_t CMSISDAP::usbComplete(RxPacket* rx)
+{
+	if (pendingCommands.empty())
+		return CMSISDAP_ERR_INVALID_STATUS;
+
+	uint8_t cmd = pendingCommands.front();
+	pendingCommands.pop_front();
+
+	int ret = usbRx(rx);
+	if (ret == OK && rx->data()[0] != cmd)
+		ret = CMSISDAP_ERR_DAP_RES;
+	if (ret != OK)
+	{
+		// 応答の対応が取れなくなるので、届く応答をすべて読み捨てて揃え直す
+		usbDrain(true);
+		return ret;
+	}
+	return OK;
+}
+
+void CMSISDAP::usbDrain(bool resync)
+{
+	while (!pendingCommands.empty() || resync)
+	{
+		if (!pendingCommands.empty())
+			pendingCommands.pop_front();
+
+		// 読めなくなるまで読めば、遅れて届いた応答も残らない
+		RxPacket rx(dapInfo.packetMaxSize);
+		if (usbRx(&rx) != OK)
+			break;
+	}
+	pendingCommands.clear();
+}
+
 int32_t CMSISDAP::TxPacket::write(uint8_t value)
 {
-	if (sizeof(_data) <= written)
+	if (_capacity <= written)
 		return CMSISDAP_ERR_NO_MEMORY;
 
 	_data[written++] = value;
@@ -257,13 +320,13 @@ int32_t CMSISDAP::TxPacket::write32(uint32_t value)
 
 int32_t CMSISDAP::cmdLed(LED led, bool on)
 {
-	TxPacket tx;
+	TxPacket tx(dapInfo.packetMaxSize);
 	tx.write(_USB_HID_REPORT_NUM);
 	tx.write(CMD_LED);
 	tx.write(led);
 	tx.write(on ? 1 : 0);
 
-	RxPacket rx;
+	RxPacket rx(dapInfo.packetMaxSize);
 	int ret = usbTxRx(tx, &rx);
 	if (ret != OK) {
 		_DBGPRT("err ret=%08x %s %s %d\n", ret, __FUNCTION__, __FILE__, __LINE__);
@@ -279,12 +342,12 @@ int32_t CMSISDAP::cmdLed(LED led, bool on)
 
 int32_t CMSISDAP::cmdConnect(uint8_t mode)
 {
-	TxPacket tx;
+	TxPacket tx(dapInfo.packetMaxSize);
 	tx.write(_USB_HID_REPORT_NUM);
 	tx.write(CMD_CONNECT);
 	tx.write(mode);
 
-	RxPacket rx;
+	RxPacket rx(dapInfo.packetMaxSize);
 	int ret = usbTxRx(tx, &rx);
 	if (ret != OK) {
 		_DBGPRT("err ret=%08x %s %s %d\n", ret, __FUNCTION__, __FILE__, __LINE__);
@@ -300,11 +363,11 @@ int32_t CMSISDAP::cmdConnect(uint8_t mode)
 
 int32_t CMSISDAP::cmdDisconnect(void)
 {
-	TxPacket tx;
+	TxPacket tx(dapInfo.packetMaxSize);
 	tx.write(_USB_HID_REPORT_NUM);
 	tx.write(CMD_DISCONNECT);
 
-	RxPacket rx;
+	RxPacket rx(dapInfo.packetMaxSize);
 	int ret = usbTxRx(tx, &rx);
 	if (ret != OK)
 	{
@@ -323,12 +386,12 @@ int32_t CMSISDAP::cmdDisconnect(void)
 
 int32_t CMSISDAP::cmdWriteAbort(uint32_t abort)
 {
-	TxPacket tx;
+	TxPacket tx(dapInfo.packetMaxSize);
 	tx.write(_USB_HID_REPORT_NUM);
 	tx.write(CMD_WRITE_ABORT);
 	tx.write32(abort);
 
-	RxPacket rx;
+	RxPacket rx(dapInfo.packetMaxSize);
 	int ret = usbTxRx(tx, &rx);
 	if (ret != OK)
 	{
@@ -347,14 +410,14 @@ int32_t CMSISDAP::cmdWriteAbort(uint32_t abort)
 
 int32_t CMSISDAP::cmdTxConf(uint8_t idle, uint16_t delay, uint16_t retry)
 {
-	TxPacket tx;
+	TxPacket tx(dapInfo.packetMaxSize);
 	tx.write(_USB_HID_REPORT_NUM);
 	tx.write(CMD_TX_CONF);
 	tx.write(idle);
 	tx.write16(delay);
 	tx.write16(retry);
 
-	RxPacket rx;
+	RxPacket rx(dapInfo.packetMaxSize);
 	int ret = usbTxRx(tx, &rx);
 	if (ret != OK)
 	{
@@ -374,7 +437,7 @@ int32_t CMSISDAP::cmdTxConf(uint8_t idle, uint16_t delay, uint16_t retry)
 int32_t CMSISDAP::getInfo(uint32_t type, RxPacket* rx)
 {
 	int ret;
-	TxPacket packet;
+	TxPacket packet(dapInfo.packetMaxSize);
 
 	if (rx == nullptr)
 		return CMSISDAP_ERR_INVALID_ARGUMENT;
@@ -392,269 +455,421 @@ int32_t CMSISDAP::getInfo(uint32_t type, RxPacket* rx)
 	return OK;
 }
 
+int32_t CMSISDAP::parseInfo(uint8_t type, const uint8_t* data)
+{
+	int32_t ret;
+	std::string* str = nullptr;
+
+	switch (type)
+	{
+	case INFO_ID_CAPABILITIES:
+		if (data[1] != 1)
+			return CMSISDAP_ERR_DAP_RES;
+		dapInfo.capabilities.raw = data[2];
+		return OK;
+
+	case INFO_ID_PKT_SZ:
+	{
+		if (data[1] != 2) {
+			ret = CMSISDAP_ERR_DAP_RES;
+			_DBGPRT("err ret=%08x %s %s %d\n", ret, __FUNCTION__, __FILE__, __LINE__);
+			return ret;
+		}
+		uint16_t size = data[2] + (data[3] << 8);
+
+		if (size + 1 > _CMSISDAP_MAX_PACKET_SIZE)
+		{
+			_DBGPRT("Packet size %u is larger than supported, limited to %u\n", size, _CMSISDAP_MAX_PACKET_SIZE - 1);
+			size = _CMSISDAP_MAX_PACKET_SIZE - 1;
+		}
+		dapInfo.packetMaxSize = size + 1;
+		return OK;
+	}
+
+	case INFO_ID_PKT_CNT:
+		if (data[1] != 1) { /* resは1byte */
+			ret = CMSISDAP_ERR_DAP_RES;
+			_DBGPRT("err ret=%08x %s %s %d\n", ret, __FUNCTION__, __FILE__, __LINE__);
+			return ret;
+		}
+		dapInfo.packetMaxCount = data[2];
+		return OK;
+
+	case INFO_ID_FW_VER:
+		str = &dapInfo.firmwareVersion;
+		break;
+	case INFO_ID_VID:
+		str = &dapInfo.vendor;
+		break;
+	case INFO_ID_PID:
+		str = &dapInfo.name;
+		break;
+	case INFO_ID_SERNUM:
+		str = &dapInfo.serialNumber;
+		break;
+	default:
+		return CMSISDAP_ERR_INVALID_ARGUMENT;
+	}
+
+	if (data[1] > 0)
+		*str = std::string((const char *)&(data[2]), strnlen((const char *)&(data[2]), data[1]));
+	else
+		*str = "";
+
+	return OK;
+}
+
 int32_t CMSISDAP::cmdInfoCapabilities(void)
 {
-	RxPacket packet;
+	RxPacket packet(dapInfo.packetMaxSize);
 	int ret = getInfo(INFO_ID_CAPABILITIES, &packet);
 	if (ret != OK)
 		return ret;
 
-	uint8_t* data = packet.data();
-	if (data[1] != 1)
-		return CMSISDAP_ERR_DAP_RES;
-
-	dapInfo.capabilities.raw = data[2];
-	return OK;
+	return parseInfo(INFO_ID_CAPABILITIES, packet.data());
 }
 
 int32_t CMSISDAP::cmdInfoFwVer(void)
 {
-	RxPacket packet;
+	RxPacket packet(dapInfo.packetMaxSize);
 	int ret = getInfo(INFO_ID_FW_VER, &packet);
 	if (ret != OK)
 		return ret;
 
-	uint8_t* data = packet.data();
-	if (data[1] > 0)
-		dapInfo.firmwareVersion = std::string((const char *)&(data[2]));
-	else
-		dapInfo.firmwareVersion = "";
-
-	return OK;
+	return parseInfo(INFO_ID_FW_VER, packet.data());
 }
 
 int32_t CMSISDAP::cmdInfoVendor(void)
 {
-	RxPacket packet;
+	RxPacket packet(dapInfo.packetMaxSize);
 	int ret = getInfo(INFO_ID_VID, &packet);
 	if (ret != OK)
 		return ret;
 
-	uint8_t* data = packet.data();
-	if (data[1] > 0)
-		dapInfo.vendor = std::string((const char *)&(data[2]));
-	else
-		dapInfo.vendor = "";
-
-	return OK;
+	return parseInfo(INFO_ID_VID, packet.data());
 }
 
 int32_t CMSISDAP::cmdInfoName(void)
 {
-	RxPacket packet;
+	RxPacket packet(dapInfo.packetMaxSize);
 	int ret = getInfo(INFO_ID_PID, &packet);
 	if (ret != OK)
 		return ret;
 
-	uint8_t* data = packet.data();
-	if (data[1] > 0)
-		dapInfo.name = std::string((const char *)&(data[2]));
-	else
-		dapInfo.name = "";
+	return parseInfo(INFO_ID_PID, packet.data());
+}
 
-	return OK;
+int32_t CMSISDAP::cmdInfoSerialNumber(void)
+{
+	RxPacket packet(dapInfo.packetMaxSize);
+	int ret = getInfo(INFO_ID_SERNUM, &packet);
+	if (ret != OK)
+		return ret;
+
+	return parseInfo(INFO_ID_SERNUM, packet.data());
 }
 
 int32_t CMSISDAP::cmdInfoPacketSize(void)
 {
-	RxPacket packet;
+	RxPacket packet(dapInfo.packetMaxSize);
 	int ret = getInfo(INFO_ID_PKT_SZ, &packet);
 	if (ret != OK)
 		return ret;
 
-	uint8_t* data = packet.data();
-	if (data[1] != 2) {
-		ret = CMSISDAP_ERR_DAP_RES;
-		_DBGPRT("err ret=%08x %s %s %d\n", ret, __FUNCTION__, __FILE__, __LINE__);
-		return ret;
-	}
-	uint16_t size = data[2] + (data[3] << 8);
-
-	// [TODO] packetMaxSize に対応
-	if (dapInfo.packetMaxSize != size + 1)
-		dapInfo.packetMaxSize = size + 1;
-
-	return OK;
+	return parseInfo(INFO_ID_PKT_SZ, packet.data());
 }
 
 int32_t CMSISDAP::cmdInfoPacketCount(void)
 {
-	RxPacket packet;
+	RxPacket packet(dapInfo.packetMaxSize);
 	int ret = getInfo(INFO_ID_PKT_CNT, &packet);
 	if (ret != OK)
 		return ret;
 
-	uint8_t* data = packet.data();
-	if (data[1] != 1) { /* resは1byte */
-		ret = CMSISDAP_ERR_DAP_RES;
-		_DBGPRT("err ret=%08x %s %s %d\n", ret, __FUNCTION__, __FILE__, __LINE__);
-		return ret;
-	}
-	// [TODO] packetMaxCount に対応
-	dapInfo.packetMaxCount = data[2];
-	return OK;
+	return parseInfo(INFO_ID_PKT_CNT, packet.data());
 }
 
-void CMSISDAP::PIN::print()
+/*
+ * 応答長が要求だけで決まらないコマンド (文字列の INFO など) は 0 を返し、単独で送る
+ */
+uint32_t CMSISDAP::responseLength(const std::vector<uint8_t>& request)
 {
-	_DBGPRT("SWCLK/TCK:%d SWDIO/TMS:%d TDI:%d TDO:%d !TRST:%d !RESET:%d\n",
-		SWCLK_TCK ? 1 : 0,
-		SWDIO_TMS ? 1 : 0,
-		TDI ? 1 : 0,
-		TDO ? 1 : 0,
-		nTRST ? 1 : 0,
-		nRESET ? 1 : 0);
+	switch (request[0])
+	{
+	case CMD_INFO:
+		if (request.size() < 2)
+			return 0;
+		switch (request[1])
+		{
+		case INFO_ID_CAPABILITIES:
+		case INFO_ID_PKT_CNT:
+			return 3;
+		case INFO_ID_PKT_SZ:
+			return 4;
+		default:
+			return 0;
+		}
+
+	case CMD_JTAG_SEQ:
+	{
+		// TDO をキャプチャするシーケンスの分だけ応答が伸びる
+		if (request.size() < 2)
+			return 0;
+		uint32_t length = 2;
+		size_t pos = 2;
+		for (uint32_t i = 0; i < request[1]; i++)
+		{
+			if (pos >= request.size())
+				return 0;
+			SequenceInfo info = { 0 };
+			info.raw[0] = request[pos++];
+			uint32_t bytes = (info.cycles == 0) ? 8 : (((info.cycles - 1) >> 3) + 1);
+			if (info.TDO)
+				length += bytes;
+			pos += bytes;
+		}
+		return length;
+	}
+
+	case CMD_RESET_TARGET:
+		return 3;
+
+	case CMD_LED:
+	case CMD_CONNECT:
+	case CMD_DISCONNECT:
+	case CMD_TX_CONF:
+	case CMD_WRITE_ABORT:
+	case CMD_DELAY:
+	case CMD_SWJ_PINS:
+	case CMD_SWJ_CLOCK:
+	case CMD_SWJ_SEQ:
+	case CMD_SWD_CONF:
+	case CMD_JTAG_CONFIGURE:
+		return 2;
+
+	default:
+		return 0;
+	}
 }
 
-int32_t CMSISDAP::getPinStatus(PIN* pin)
+int32_t CMSISDAP::executeCommand(Command& command)
 {
-	if (pin == nullptr)
-		return EINVAL;
+	TxPacket tx(dapInfo.packetMaxSize);
+	int ret = tx.write(_USB_HID_REPORT_NUM);
+	for (size_t i = 0; i < command.request.size() && ret == OK; i++)
+		ret = tx.write(command.request[i]);
+	if (ret != OK)
+		return CMSISDAP_ERR_INVALID_ARGUMENT;
 
-	errno_t ret = cmdSwjPins(0, 0, 0, pin);
-	if (ret != OK) {
+	RxPacket rx(dapInfo.packetMaxSize);
+	ret = usbTxRx(tx, &rx);
+	if (ret != OK)
+	{
 		_DBGPRT("err ret=%08x %s %s %d\n", ret, __FUNCTION__, __FILE__, __LINE__);
 		return ret;
 	}
+
+	uint32_t length = responseLength(command.request);
+	if (length == 0 || length > rx.length())
+		length = rx.length();
+	command.response.assign(rx.data(), rx.data() + length);
 	return OK;
 }
 
-int32_t CMSISDAP::jtagToSwd(void)
+int32_t CMSISDAP::executeBundle(std::vector<Command>& commands, size_t offset, size_t count)
 {
-	TxPacket tx;
+	TxPacket tx(dapInfo.packetMaxSize);
 	tx.write(_USB_HID_REPORT_NUM);
-	tx.write(CMD_SWJ_SEQ);
-	tx.write(7 * 8);
-	tx.write32(0xFFFFFFFF);
-	tx.write16(0xFFFF);
-	tx.write(0xFF);
+	tx.write(CMD_EXECUTE_COMMANDS);
+	tx.write((uint8_t)count);
+	for (size_t i = 0; i < count; i++)
+	{
+		for (auto value : commands[offset + i].request)
+			tx.write(value);
+	}
 
-	RxPacket rx;
+	RxPacket rx(dapInfo.packetMaxSize);
 	int ret = usbTxRx(tx, &rx);
-	if (ret != OK) {
+	if (ret != OK)
+	{
 		_DBGPRT("err ret=%08x %s %s %d\n", ret, __FUNCTION__, __FILE__, __LINE__);
 		return ret;
 	}
-	if (rx.data()[1] != _DAP_RES_OK)
-		return CMSISDAP_ERR_DAP_RES;
-
-
-	tx.clear();
-	tx.write(_USB_HID_REPORT_NUM);
-	tx.write(CMD_SWJ_SEQ);
-	tx.write(2 * 8);
-	tx.write(0x9E);
-	tx.write(0xE7);
 
-	ret = usbTxRx(tx, &rx);
-	if (ret != OK) {
+	uint8_t* data = rx.data();
+	if (data[0] == CMD_INVALID)
+	{
+		// バージョン表記だけでは判断できないアダプタもあるので、以降は 1 コマンドずつ送る
+		_DBGPRT("DAP_ExecuteCommands is not supported, falling back to single commands.\n");
+		executeCommandsSupported = false;
+		for (size_t i = 0; i < count; i++)
+		{
+			ret = executeCommand(commands[offset + i]);
+			if (ret != OK)
+				return ret;
+		}
+		return OK;
+	}
+	if (data[0] != CMD_EXECUTE_COMMANDS || data[1] != count)
+	{
+		ret = CMSISDAP_ERR_DAP_RES;
 		_DBGPRT("err ret=%08x %s %s %d\n", ret, __FUNCTION__, __FILE__, __LINE__);
 		return ret;
 	}
-	if (rx.data()[1] != _DAP_RES_OK)
-		return CMSISDAP_ERR_DAP_RES;
 
+	uint32_t pos = 2;
+	for (size_t i = 0; i < count; i++)
+	{
+		Command& command = commands[offset + i];
+		uint32_t length = responseLength(command.request);
+		if (pos + length > rx.length() || data[pos] != command.request[0])
+		{
+			ret = CMSISDAP_ERR_DAP_RES;
+			_DBGPRT("err ret=%08x %s %s %d\n", ret, __FUNCTION__, __FILE__, __LINE__);
+			return ret;
+		}
+		command.response.assign(&data[pos], &data[pos + length]);
+		pos += length;
+	}
 
-	tx.clear();
-	tx.write(_USB_HID_REPORT_NUM);
-	tx.write(CMD_SWJ_SEQ);
-	tx.write(7 * 8);
-	tx.write32(0xFFFFFFFF);
-	tx.write16(0xFFFF);
-	tx.write(0xFF);
+	return OK;
+}
 
-	ret = usbTxRx(tx, &rx);
-	if (ret != OK) {
-		_DBGPRT("err ret=%08x %s %s %d\n", ret, __FUNCTION__, __FILE__, __LINE__);
-		return ret;
-	}
-	if (rx.data()[1] != _DAP_RES_OK)
-		return CMSISDAP_ERR_DAP_RES;
+int32_t CMSISDAP::executeCommands(std::vector<Command>& commands)
+{
+	size_t offset = 0;
+	while (offset < commands.size())
+	{
+		// 要求と応答の両方が 1 パケットに収まる分だけまとめる
+		size_t count = 0;
+		uint32_t txLength = 3;	// report ID, command ID, number of commands
+		uint32_t rxLength = 2;
+		while (executeCommandsSupported && offset + count < commands.size() && count < 255)
+		{
+			const Command& command = commands[offset + count];
+			uint32_t length = responseLength(command.request);
+			if (length == 0
+				|| txLength + command.request.size() > dapInfo.packetMaxSize
+				|| rxLength + length > dapInfo.packetMaxSize - 1u)
+				break;
 
+			txLength += (uint32_t)command.request.size();
+			rxLength += length;
+			count++;
+		}
 
-	/* 8 cycle idle period */
-	tx.clear();
-	tx.write(_USB_HID_REPORT_NUM);
-	tx.write(CMD_SWJ_SEQ);
-	tx.write(8);
-	tx.write(0);
+		int32_t ret;
+		if (count >= 2)
+		{
+			ret = executeBundle(commands, offset, count);
+		}
+		else
+		{
+			count = 1;
+			ret = executeCommand(commands[offset]);
+		}
+		if (ret != OK)
+			return ret;
 
-	ret = usbTxRx(tx, &rx);
-	if (ret != OK) {
-		_DBGPRT("err ret=%08x %s %s %d\n", ret, __FUNCTION__, __FILE__, __LINE__);
-		return ret;
+		offset += count;
 	}
-	if (rx.data()[1] != _DAP_RES_OK)
-		return CMSISDAP_ERR_DAP_RES;
 
 	return OK;
 }
 
-int32_t CMSISDAP::swdToJtag(void)
+static bool isVersionAtLeast(const std::string& version, uint32_t major, uint32_t minor)
 {
-	TxPacket tx;
-	tx.write(_USB_HID_REPORT_NUM);
-	tx.write(CMD_SWJ_SEQ);
-	tx.write(7 * 8);
-	tx.write32(0xFFFFFFFF);
-	tx.write16(0xFFFF);
-	tx.write(0xFF);
+	char* end;
+	uint32_t vmajor = strtoul(version.c_str(), &end, 10);
+	if (end == version.c_str())
+		return false;
+	uint32_t vminor = (*end == '.') ? strtoul(end + 1, nullptr, 10) : 0;
 
-	RxPacket rx;
-	int ret = usbTxRx(tx, &rx);
-	if (ret != OK) {
-		_DBGPRT("err ret=%08x %s %s %d\n", ret, __FUNCTION__, __FILE__, __LINE__);
-		return ret;
-	}
-	if (rx.data()[1] != _DAP_RES_OK)
-		return CMSISDAP_ERR_DAP_RES;
+	return (vmajor > major) || (vmajor == major && vminor >= minor);
+}
 
+void CMSISDAP::PIN::print()
+{
+	_DBGPRT("SWCLK/TCK:%d SWDIO/TMS:%d TDI:%d TDO:%d !TRST:%d !RESET:%d\n",
+		SWCLK_TCK ? 1 : 0,
+		SWDIO_TMS ? 1 : 0,
+		TDI ? 1 : 0,
+		TDO ? 1 : 0,
+		nTRST ? 1 : 0,
+		nRESET ? 1 : 0);
+}
 
-	tx.clear();
-	tx.write(_USB_HID_REPORT_NUM);
-	tx.write(CMD_SWJ_SEQ);
-	tx.write(2 * 8);
-	tx.write(0x3C);
-	tx.write(0xE7);
+int32_t CMSISDAP::getPinStatus(PIN* pin)
+{
+	if (pin == nullptr)
+		return EINVAL;
 
-	ret = usbTxRx(tx, &rx);
+	errno_t ret = cmdSwjPins(0, 0, 0, pin);
 	if (ret != OK) {
 		_DBGPRT("err ret=%08x %s %s %d\n", ret, __FUNCTION__, __FILE__, __LINE__);
 		return ret;
 	}
-	if (rx.data()[1] != _DAP_RES_OK)
-		return CMSISDAP_ERR_DAP_RES;
+	return OK;
+}
 
+int32_t CMSISDAP::getSerialNumber(std::string* serial)
+{
+	if (serial == nullptr)
+		return CMSISDAP_ERR_INVALID_ARGUMENT;
 
-	tx.clear();
-	tx.write(_USB_HID_REPORT_NUM);
-	tx.write(CMD_SWJ_SEQ);
-	tx.write(1 * 8);
-	tx.write(0xFF);
+	if (dapInfo.serialNumber.empty())
+	{
+		int32_t ret = cmdInfoSerialNumber();
+		if (ret != OK)
+			return ret;
+	}
 
-	ret = usbTxRx(tx, &rx);
+	*serial = dapInfo.serialNumber;
+	return OK;
+}
+
+int32_t CMSISDAP::jtagToSwd(void)
+{
+	std::vector<Command> commands;
+	commands.push_back(Command(CMD_SWJ_SEQ).write(7 * 8).write32(0xFFFFFFFF).write16(0xFFFF).write(0xFF));
+	commands.push_back(Command(CMD_SWJ_SEQ).write(2 * 8).write(0x9E).write(0xE7));
+	commands.push_back(Command(CMD_SWJ_SEQ).write(7 * 8).write32(0xFFFFFFFF).write16(0xFFFF).write(0xFF));
+	/* 8 cycle idle period */
+	commands.push_back(Command(CMD_SWJ_SEQ).write(8).write(0));
+
+	int ret = executeCommands(commands);
 	if (ret != OK) {
 		_DBGPRT("err ret=%08x %s %s %d\n", ret, __FUNCTION__, __FILE__, __LINE__);
 		return ret;
 	}
-	if (rx.data()[1] != _DAP_RES_OK)
-		return CMSISDAP_ERR_DAP_RES;
+	for (auto& command : commands)
+	{
+		if (!command.isOK())
+			return CMSISDAP_ERR_DAP_RES;
+	}
 
+	return OK;
+}
 
+int32_t CMSISDAP::swdToJtag(void)
+{
+	std::vector<Command> commands;
+	commands.push_back(Command(CMD_SWJ_SEQ).write(7 * 8).write32(0xFFFFFFFF).write16(0xFFFF).write(0xFF));
+	commands.push_back(Command(CMD_SWJ_SEQ).write(2 * 8).write(0x3C).write(0xE7));
+	commands.push_back(Command(CMD_SWJ_SEQ).write(1 * 8).write(0xFF));
 	/* 8 cycle idle period */
-	tx.clear();
-	tx.write(_USB_HID_REPORT_NUM);
-	tx.write(CMD_SWJ_SEQ);
-	tx.write(8);
-	tx.write(0);
+	commands.push_back(Command(CMD_SWJ_SEQ).write(8).write(0));
 
-	ret = usbTxRx(tx, &rx);
+	int ret = executeCommands(commands);
 	if (ret != OK) {
 		_DBGPRT("err ret=%08x %s %s %d\n", ret, __FUNCTION__, __FILE__, __LINE__);
 		return ret;
 	}
-	if (rx.data()[1] != _DAP_RES_OK)
-		return CMSISDAP_ERR_DAP_RES;
+	for (auto& command : commands)
+	{
+		if (!command.isOK())
+			return CMSISDAP_ERR_DAP_RES;
+	}
 
 	return OK;
 }
@@ -673,7 +888,7 @@ int32_t CMSISDAP::resetLink(void)
 	_DBGPRT("Target Reset Res: Status:%02x Execute:%s\n", packetBuf[1], packetBuf[2] == 0x1 ? "OK" : "no impl");
 #endif
 
-	TxPacket tx;
+	TxPacket tx(dapInfo.packetMaxSize);
 	tx.write(_USB_HID_REPORT_NUM);
 	tx.write(CMD_WRITE_ABORT);
 	tx.write(0x00); /* DAP Index, ignored in the swd. */
@@ -682,7 +897,7 @@ int32_t CMSISDAP::resetLink(void)
 	tx.write(0x00); /* SBZ */
 	tx.write(0x00); /* SBZ */
 
-	RxPacket rx;
+	RxPacket rx(dapInfo.packetMaxSize);
 	int ret = usbTxRx(tx, &rx);
 	if (ret != OK) {
 		_DBGPRT("err ret=%08x %s %s %d\n", ret, __FUNCTION__, __FILE__, __LINE__);
@@ -698,14 +913,14 @@ int32_t CMSISDAP::resetLink(void)
 
 int32_t CMSISDAP::cmdSwjPins(uint8_t value, uint8_t pin, uint32_t delay, PIN* input)
 {
-	TxPacket tx;
+	TxPacket tx(dapInfo.packetMaxSize);
 	tx.write(_USB_HID_REPORT_NUM);
 	tx.write(CMD_SWJ_PINS);
 	tx.write(value);
 	tx.write(pin);
 	tx.write32(delay);
 
-	RxPacket rx;
+	RxPacket rx(dapInfo.packetMaxSize);
 	int ret = usbTxRx(tx, &rx);
 	if (ret != OK)
 	{
@@ -722,12 +937,12 @@ int32_t CMSISDAP::cmdSwjPins(uint8_t value, uint8_t pin, uint32_t delay, PIN* in
 
 int32_t CMSISDAP::cmdSwjClock(uint32_t clock)
 {
-	TxPacket tx;
+	TxPacket tx(dapInfo.packetMaxSize);
 	tx.write(_USB_HID_REPORT_NUM);
 	tx.write(CMD_SWJ_CLOCK);
 	tx.write32(clock);
 
-	RxPacket rx;
+	RxPacket rx(dapInfo.packetMaxSize);
 	int ret = usbTxRx(tx, &rx);
 	if (ret != OK)
 	{
@@ -745,12 +960,12 @@ int32_t CMSISDAP::cmdSwjClock(uint32_t clock)
 
 int32_t CMSISDAP::cmdSwdConf(uint8_t cfg)
 {
-	TxPacket tx;
+	TxPacket tx(dapInfo.packetMaxSize);
 	tx.write(_USB_HID_REPORT_NUM);
 	tx.write(CMD_SWD_CONF);
 	tx.write32(cfg);
 
-	RxPacket rx;
+	RxPacket rx(dapInfo.packetMaxSize);
 	int ret = usbTxRx(tx, &rx);
 	if (ret != OK)
 	{
@@ -768,21 +983,33 @@ int32_t CMSISDAP::cmdSwdConf(uint8_t cfg)
 
 int32_t CMSISDAP::resetJtagTap()
 {
-	// go to test logic reset state
-	int32_t ret = sendTms(5, 1);
-	if (ret != OK)
-		return ret;
+	static const uint8_t tdi[8] = { 0 };
+
+	SequenceInfo reset = { 0 };
+	reset.cycles = 5;
+	reset.TMS = 1;
 
+	SequenceInfo idle = { 0 };
+	idle.cycles = 1;
+
+	std::vector<Command> commands;
+	// go to test logic reset state
+	commands.push_back(jtagSequence(reset, tdi));
 	// toggle nTRST
-	ret = cmdSwjPins(0, _PIN_nTRST, 0, nullptr);
-	if (ret != OK)
-		return ret;
-	
-	PIN pin;
-	ret = cmdSwjPins(_PIN_nTRST, _PIN_nTRST, 0, &pin);
+	commands.push_back(Command(CMD_SWJ_PINS).write(0).write(_PIN_nTRST).write32(0));
+	commands.push_back(Command(CMD_SWJ_PINS).write(_PIN_nTRST).write(_PIN_nTRST).write32(0));
+	// go to run-test idle
+	commands.push_back(jtagSequence(idle, tdi));
+
+	int32_t ret = executeCommands(commands);
 	if (ret != OK)
 		return ret;
 
+	if (!commands[0].isOK() || !commands[3].isOK())
+		return CMSISDAP_ERR_DAP_RES;
+
+	PIN pin;
+	pin.raw = commands[2].response.size() >= 2 ? commands[2].response[1] : 0;
 	if (pin.nTRST == 0)
 	{
 		static bool isFirst = true;
@@ -793,11 +1020,6 @@ int32_t CMSISDAP::resetJtagTap()
 		}
 	}
 
-	// go to run-test idle
-	ret = sendTms(1, 0);
-	if (ret != OK)
-		return ret;
-
 	return OK;
 }
 
@@ -1048,7 +1270,7 @@ int32_t CMSISDAP::cmdJtagConfigure(const std::vector<uint8_t>& irLength)
 	if (irLength.size() < 1 || irLength.size() > 60)
 		return CMSISDAP_ERR_INVALID_ARGUMENT;
 
-	TxPacket tx;
+	TxPacket tx(dapInfo.packetMaxSize);
 	tx.write(_USB_HID_REPORT_NUM);
 	tx.write(CMD_JTAG_CONFIGURE);
 	tx.write((uint8_t)irLength.size());
@@ -1057,7 +1279,7 @@ int32_t CMSISDAP::cmdJtagConfigure(const std::vector<uint8_t>& irLength)
 		tx.write(len);
 	}
 
-	RxPacket rx;
+	RxPacket rx(dapInfo.packetMaxSize);
 	int ret = usbTxRx(tx, &rx);
 	if (ret != OK)
 	{
@@ -1074,12 +1296,25 @@ int32_t CMSISDAP::cmdJtagConfigure(const std::vector<uint8_t>& irLength)
 	return ret;
 }
 
+CMSISDAP::Command CMSISDAP::jtagSequence(SequenceInfo info, const uint8_t* in)
+{
+	Command command(CMD_JTAG_SEQ);
+	command.write(1);
+	command.write(info.raw[0]);
+
+	uint32_t bytes = (info.cycles == 0) ? 8 : (((info.cycles - 1) >> 3) + 1);
+	for (uint32_t i = 0; i < bytes; i++)
+		command.write(in[i]);
+
+	return command;
+}
+
 int32_t CMSISDAP::cmdJtagSequence(SequenceInfo info, uint8_t* in, uint8_t* out)
 {
 	if (in == nullptr)
 		return CMSISDAP_ERR_INVALID_ARGUMENT;
 
-	TxPacket tx;
+	TxPacket tx(dapInfo.packetMaxSize);
 	tx.write(_USB_HID_REPORT_NUM);
 	tx.write(CMD_JTAG_SEQ);
 	tx.write(1);
@@ -1092,7 +1327,7 @@ int32_t CMSISDAP::cmdJtagSequence(SequenceInfo info, uint8_t* in, uint8_t* out)
 		in++;
 	}
 
-	RxPacket rx;
+	RxPacket rx(dapInfo.packetMaxSize);
 	int ret = usbTxRx(tx, &rx);
 	if (ret != OK)
 	{
@@ -1120,36 +1355,51 @@ int32_t CMSISDAP::cmdJtagSequence(SequenceInfo info, uint8_t* in, uint8_t* out)
 int32_t CMSISDAP::initialize(void)
 {
 	int32_t ret;
-	ret = cmdInfoCapabilities();
-	if (ret != OK)
-	{
-		return ret;
-	}
 
-	ret = cmdLed(RUNNING, false);
+	// DAP_ExecuteCommands が使えるかはバージョンで判断するので、最初に単独で取得する
+	ret = cmdInfoFwVer();
 	if (ret != OK)
 	{
 		return ret;
 	}
+	executeCommandsSupported = isVersionAtLeast(dapInfo.firmwareVersion, 1, 2);
 
-	ret = cmdLed(CONNECT, false);
-	if (ret != OK)
-	{
-		return ret;
-	}
+	std::vector<Command> commands;
+	commands.push_back(Command(CMD_INFO).write(INFO_ID_CAPABILITIES));
+	commands.push_back(Command(CMD_LED).write(RUNNING).write(0));
+	commands.push_back(Command(CMD_LED).write(CONNECT).write(0));
+	commands.push_back(Command(CMD_LED).write(CONNECT).write(1));
+	commands.push_back(Command(CMD_INFO).write(INFO_ID_PKT_SZ));
+	commands.push_back(Command(CMD_INFO).write(INFO_ID_PKT_CNT));
+	commands.push_back(Command(CMD_SWJ_CLOCK).write32(5000 * 1000)); /* 5000kHz */
+	commands.push_back(Command(CMD_TX_CONF).write(0).write16(64).write16(_DAP_MATCH_RETRY));
+	commands.push_back(Command(CMD_LED).write(RUNNING).write(1));
 
-	ret = cmdLed(CONNECT, true);
+	ret = executeCommands(commands);
 	if (ret != OK)
 	{
 		return ret;
 	}
 
-	ret = cmdInfoFwVer();
-	if (ret != OK)
+	for (auto& command : commands)
 	{
-		return ret;
+		if (command.response.size() < 2)
+			return CMSISDAP_ERR_DAP_RES;
+
+		if (command.request[0] == CMD_INFO)
+			ret = parseInfo(command.request[1], command.response.data());
+		else if (!command.isOK())
+			ret = CMSISDAP_ERR_DAP_RES;
+
+		if (ret != OK)
+		{
+			_DBGPRT("err ret=%08x %s %s %d\n", ret, __FUNCTION__, __FILE__, __LINE__);
+			return ret;
+		}
 	}
+	matchRetry = _DAP_MATCH_RETRY;
 
+	// 文字列は応答長が決まらないので個別に取得する
 	ret = cmdInfoVendor();
 	if (ret != OK)
 	{
@@ -1162,31 +1412,6 @@ int32_t CMSISDAP::initialize(void)
 		return ret;
 	}
 
-	ret = cmdInfoPacketSize();
-	if (ret != OK) {
-		return ret;
-	}
-
-	ret = cmdInfoPacketCount();
-	if (ret != OK) {
-		return ret;
-	}
-
-	ret = cmdSwjClock(5000 * 1000); /* 5000kHz */
-	if (ret != OK) {
-		return ret;
-	}
-
-	ret = cmdTxConf(0, 64, 0);
-	if (ret != OK) {
-		return ret;
-	}
-
-	ret = cmdLed(RUNNING, true);
-	if (ret != OK) {
-		return ret;
-	}
-
 	_DBGPRT("Init OK.\n");
 	dapInfo.print();
 	_DBGPRT("  USB PID     : 0x%04x\n", pid);
@@ -1211,7 +1436,10 @@ void CMSISDAP::DapInfo::print()
 int32_t CMSISDAP::setConnectionType(ConnectionType type)
 {
 	int32_t ret;
-	
+
+	// 接続し直すとターゲット側のレジスタ状態は保証されない
+	linkEpoch++;
+
 	if (type == JTAG)
 	{
 		ret = cmdConnect(DAP_MODE_JTAG);
@@ -1291,77 +1519,315 @@ int32_t CMSISDAP::apWrite(uint32_t reg, uint32_t val)
 
 int32_t CMSISDAP::dpapRead(bool dp, uint32_t reg, uint32_t *data)
 {
-	TransferRequest req = { 0 };
+	std::vector<Transfer> transfers = { dp ? Transfer::dpRead(reg) : Transfer::apRead(reg) };
 
-	req.setRead();
-	if (dp)
-		req.setDP();
-	else
-		req.setAP();
-	req.setRegister(reg);
+	int ret = transfer(transfers);
+	if (ret != OK)
+		return ret;
+
+	if (data != NULL)
+		*data = transfers[0].data;
+
+	return OK;
+}
+
+int32_t CMSISDAP::dpapWrite(bool dp, uint32_t reg, uint32_t data)
+{
+	std::vector<Transfer> transfers = { dp ? Transfer::dpWrite(reg, data) : Transfer::apWrite(reg, data) };
+
+	return transfer(transfers);
+}
+
+int32_t CMSISDAP::transfer(std::vector<Transfer>& transfers, size_t* failed)
+{
+	size_t offset = 0;
+	while (offset < transfers.size())
+	{
+		size_t done = 0;
+		int32_t ret = transferPacket(transfers, offset, &done);
+		offset += done;
+		if (ret != OK)
+		{
+			if (failed != nullptr)
+				*failed = offset;
+			return ret;
+		}
+	}
+	return OK;
+}
+
+/*
+ * Packs as many transfers as fit into a single DAP_Transfer command.
+ * *done is set to the number of transfers executed by the probe.
+ */
+int32_t CMSISDAP::transferPacket(std::vector<Transfer>& transfers, size_t offset, size_t* done)
+{
+	TxPacket tx(dapInfo.packetMaxSize);
+	RxPacket rx(dapInfo.packetMaxSize);
+
+	*done = 0;
+
+	uint32_t txLimit = tx.capacity();
+	uint32_t rxLimit = rx.capacity();
+
+	uint32_t txBytes = 4;	/* report number, command, DAP index, transfer count */
+	uint32_t rxBytes = 3;	/* command, transfer count, transfer response */
+	uint32_t count = 0;
+	uint32_t probeCount = 0;	/* including match mask writes */
+	uint32_t mask = matchMask;
+	bool maskValid = matchMaskValid;
+	while (offset + count < transfers.size())
+	{
+		const Transfer& t = transfers[offset + count];
+		bool match = t.read && t.match;
+		bool setMask = match && (!maskValid || mask != t.mask);
+		uint32_t txNext = txBytes + 1 + (t.read && !match ? 0 : 4) + (setMask ? 5 : 0);
+		uint32_t rxNext = rxBytes + (t.read && !match ? 4 : 0);
+		uint32_t probeNext = probeCount + (setMask ? 2 : 1);
+		if (txNext > txLimit || rxNext > rxLimit || probeNext > 255)
+			break;
+
+		if (setMask)
+		{
+			mask = t.mask;
+			maskValid = true;
+		}
+		txBytes = txNext;
+		rxBytes = rxNext;
+		probeCount = probeNext;
+		count++;
+	}
 
-	TxPacket tx;
 	tx.write(_USB_HID_REPORT_NUM);
 	tx.write(CMD_TX);
 	tx.write(dapIndex);	/* DAP Index, ignored in the swd. */
-	tx.write(0x01);	/* Tx count */
-	tx.write(req.raw[0]);
-	tx.write32(0);
+	tx.write(probeCount);	/* Tx count */
+
+	// 応答の各転送がどの Transfer に対応するか
+	std::vector<size_t> origin;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const Transfer& t = transfers[offset + i];
+		bool match = t.read && t.match;
+
+		if (match && (!matchMaskValid || matchMask != t.mask))
+		{
+			TransferRequest maskReq = { 0 };
+			maskReq.setWrite();
+			maskReq.MatchMask = 1;
+			tx.write(maskReq.raw[0]);
+			tx.write32(t.mask);
+			origin.push_back(offset + i);
+			matchMask = t.mask;
+			matchMaskValid = true;
+		}
+
+		TransferRequest req = { 0 };
+		if (t.read)
+			req.setRead();
+		else
+			req.setWrite();
+		if (t.ap)
+			req.setAP();
+		else
+			req.setDP();
+		req.setRegister(t.reg);
+		if (match)
+			req.ValueMatch = 1;
+
+		tx.write(req.raw[0]);
+		if (!t.read || match)
+			tx.write32(t.data);
+		origin.push_back(offset + i);
+	}
 
-	RxPacket rx;
 	int ret = usbTxRx(tx, &rx);
 	if (ret != OK)
+	{
+		matchMaskValid = false;
 		return ret;
+	}
 
 	uint8_t* rxdata = rx.data();
+	uint32_t executed = std::min<uint32_t>(rxdata[1], probeCount);
 
-	if (rxdata[1] == 0)
-		return CMSISDAP_ERR_ACKFAULT;
+	// マスク書き込みだけが完了した Transfer は未完了として扱う
+	size_t completed = 0;
+	const uint8_t* value = &rxdata[3];
+	for (uint32_t i = 0; i < executed; i++)
+	{
+		if (i + 1 < probeCount && origin[i + 1] == origin[i])
+			continue;
+
+		Transfer& t = transfers[origin[i]];
+		if (t.read && !t.match)
+		{
+			t.data = buf2LE32(value);
+			value += 4;
+		}
+		completed++;
+	}
+	*done = completed;
+
+	if (executed != probeCount)
+		matchMaskValid = false;
+
+	if (rxdata[2] & _TX_RES_PROTOCOL_ERROR)
+		return CMSISDAP_ERR_PROTOCOL;
+	if (rxdata[2] & _TX_RES_VALUE_MISMATCH)
+		return CMSISDAP_ERR_VALUE_MISMATCH;
 
 	switch (rxdata[2] & TX_ACK_MASK)
 	{
+	case TX_ACK_OK:
+		break;
 	case TX_ACK_NO_ACK:
 		return CMSISDAP_ERR_NO_ACK;
 	case TX_ACK_FAULT:
 		return CMSISDAP_ERR_ACKFAULT;
 	case TX_ACK_WAIT:
 		return CMSISDAP_ERR_ACKWAIT;
+	default:
+		return CMSISDAP_ERR_DAP_RES;
 	}
 
-	if (data != NULL)
-		*data = buf2LE32(&rxdata[3]);
+	if (executed != probeCount)
+		return CMSISDAP_ERR_DAP_RES;
 
 	return OK;
 }
 
-int32_t CMSISDAP::dpapWrite(bool dp, uint32_t reg, uint32_t data)
+int32_t CMSISDAP::apReadBlock(uint32_t reg, uint32_t* data, size_t count, size_t* done)
 {
-	TransferRequest req = { 0 };
+	return transferBlock(reg, data, nullptr, count, done);
+}
 
-	req.setWrite();
-	if (dp)
-		req.setDP();
+int32_t CMSISDAP::apWriteBlock(uint32_t reg, const uint32_t* data, size_t count, size_t* done)
+{
+	return transferBlock(reg, nullptr, data, count, done);
+}
+
+/*
+ * Splits a block transfer into DAP_TransferBlock commands and keeps up to
+ * packetMaxCount of them in flight. Reads into rdata when it is given, otherwise writes wdata.
+ * *done is set to the number of words transferred before the first failure.
+ */
+int32_t CMSISDAP::transferBlock(uint32_t reg, uint32_t* rdata, const uint32_t* wdata, size_t count, size_t* done)
+{
+	struct InFlight
+	{
+		size_t offset;
+		uint32_t count;
+	};
+	std::deque<InFlight> inFlight;
+
+	bool read = (rdata != nullptr);
+	size_t depth = maxOutstanding();
+	size_t submitted = 0;
+	size_t completed = 0;
+	int32_t ret = OK;
+
+	while ((ret == OK && submitted < count) || !inFlight.empty())
+	{
+		if (ret == OK && submitted < count && inFlight.size() < depth)
+		{
+			TxPacket tx(dapInfo.packetMaxSize);
+			uint32_t n = buildTransferBlock(&tx, reg, read, read ? nullptr : &wdata[submitted], count - submitted);
+			ret = usbSubmit(tx);
+			if (ret != OK)
+				continue;
+			inFlight.push_back({ submitted, n });
+			submitted += n;
+			continue;
+		}
+
+		InFlight packet = inFlight.front();
+		inFlight.pop_front();
+
+		RxPacket rx(dapInfo.packetMaxSize);
+		size_t n = 0;
+		int32_t ret2 = usbComplete(&rx);
+		if (ret2 == OK)
+			ret2 = parseTransferBlock(rx, read ? &rdata[packet.offset] : nullptr, packet.count, &n);
+
+		// 失敗以降に完了したパケットは数えない
+		if (ret == OK)
+		{
+			completed += n;
+			ret = ret2;
+		}
+	}
+
+	if (done != nullptr)
+		*done = completed;
+	return ret;
+}
+
+/*
+ * Builds one DAP_TransferBlock command carrying as many words as fit in a packet.
+ * Returns the number of words in the command.
+ */
+uint32_t CMSISDAP::buildTransferBlock(TxPacket* tx, uint32_t reg, bool read, const uint32_t* wdata, size_t count)
+{
+	uint32_t txLimit = tx->capacity();
+	uint32_t rxLimit = RxPacket(dapInfo.packetMaxSize).capacity();
+
+	/* report number, command, DAP index, transfer count(2), transfer request */
+	/* command, transfer count(2), transfer response */
+	uint32_t words = read ? (rxLimit - 4) / 4 : (txLimit - 6) / 4;
+	uint32_t n = (uint32_t)std::min<size_t>(count, words);
+
+	TransferRequest req = { 0 };
+	if (read)
+		req.setRead();
 	else
-		req.setAP();
+		req.setWrite();
+	req.setAP();
 	req.setRegister(reg);
 
-	TxPacket tx;
-	tx.write(_USB_HID_REPORT_NUM);
-	tx.write(CMD_TX);
-	tx.write(dapIndex);	/* DAP Index, ignored in the swd. */
-	tx.write(0x01);	/* Tx count */
-	tx.write(req.raw[0]);
-	tx.write32(data);
-
-	RxPacket rx;
-	int ret = usbTxRx(tx, &rx);
-	if (ret != OK)
-		return ret;
+	tx->write(_USB_HID_REPORT_NUM);
+	tx->write(CMD_TX_BLOCK);
+	tx->write(dapIndex);	/* DAP Index, ignored in the swd. */
+	tx->write16(n);
+	tx->write(req.raw[0]);
+	if (!read)
+	{
+		for (uint32_t i = 0; i < n; i++)
+			tx->write32(wdata[i]);
+	}
+	return n;
+}
 
+int32_t CMSISDAP::parseTransferBlock(RxPacket& rx, uint32_t* rdata, uint32_t count, size_t* done)
+{
 	uint8_t* rxdata = rx.data();
-	if (rxdata[1] != 0x01) {
-		return rxdata[2];
+	uint32_t executed = std::min<uint32_t>(rxdata[1] | (rxdata[2] << 8), count);
+	if (rdata != nullptr)
+	{
+		for (uint32_t i = 0; i < executed; i++)
+			rdata[i] = buf2LE32(&rxdata[4 + i * 4]);
 	}
+	*done = executed;
+
+	if (rxdata[3] & _TX_RES_PROTOCOL_ERROR)
+		return CMSISDAP_ERR_PROTOCOL;
+
+	switch (rxdata[3] & TX_ACK_MASK)
+	{
+	case TX_ACK_OK:
+		break;
+	case TX_ACK_NO_ACK:
+		return CMSISDAP_ERR_NO_ACK;
+	case TX_ACK_FAULT:
+		return CMSISDAP_ERR_ACKFAULT;
+	case TX_ACK_WAIT:
+		return CMSISDAP_ERR_ACKWAIT;
+	default:
+		return CMSISDAP_ERR_DAP_RES;
+	}
+
+	if (executed != count)
+		return CMSISDAP_ERR_DAP_RES;
+
 	return OK;
 }
-
@@ -1,20 +1,14 @@
 
 #pragma once
 
-#if defined(_WIN32)
-#pragma comment(lib, "setupapi.lib")
-#if defined(_DEBUG)
-#pragma comment(lib, "hidapid.lib")
-#else
-#pragma comment(lib, "hidapi.lib")
-#endif
-#endif
-#include <hidapi.h>
 #include <string>
 #include <vector>
 #include <memory>
+#include <deque>
+#include <algorithm>
 
 #include "DAP.h"
+#include "HidTransport.h"
 
 class CMSISDAP : public DAP
 {
@@ -37,6 +31,7 @@ public:
 	};
 	static int32_t enumerate(std::vector<DeviceInfo>* devices);
 	static std::shared_ptr<CMSISDAP> open(DeviceInfo& info);
+	static std::shared_ptr<CMSISDAP> open(std::shared_ptr<DAPTransport> transport);
 	virtual ~CMSISDAP();
 
 	int32_t initialize(void);
@@ -49,7 +44,11 @@ public:
 	virtual int32_t dpWrite(uint32_t reg, uint32_t val);
 	virtual int32_t apRead(uint32_t reg, uint32_t *data);
 	virtual int32_t apWrite(uint32_t reg, uint32_t val);
+	virtual int32_t transfer(std::vector<Transfer>& transfers, size_t* failed = nullptr);
+	virtual int32_t apReadBlock(uint32_t reg, uint32_t* data, size_t count, size_t* done = nullptr);
+	virtual int32_t apWriteBlock(uint32_t reg, const uint32_t* data, size_t count, size_t* done = nullptr);
 	virtual int32_t setConnectionType(ConnectionType type);
+	virtual uint32_t getMatchRetry() const { return matchRetry != 0 ? matchRetry : 1; }
 
 public:
 	enum LED {
@@ -106,6 +105,7 @@ public:
 		std::string firmwareVersion;
 		std::string name;
 		std::string vendor;
+		std::string serialNumber;
 		uint16_t packetMaxSize;
 		uint16_t packetMaxCount;
 		Capabilities capabilities;
@@ -113,13 +113,14 @@ public:
 		template <class Archive>
 		void serialize(Archive & archive)
 		{
-			archive(CEREAL_NVP(firmwareVersion), CEREAL_NVP(name), CEREAL_NVP(vendor),
+			archive(CEREAL_NVP(firmwareVersion), CEREAL_NVP(name), CEREAL_NVP(vendor), CEREAL_NVP(serialNumber),
 				CEREAL_NVP(packetMaxSize), CEREAL_NVP(packetMaxCount), CEREAL_NVP(capabilities));
 		}
 		void print();
 	};
 
 	int32_t getPinStatus(PIN* pin);
+	int32_t getSerialNumber(std::string* serial);
 	int32_t cmdSwjClock(uint32_t clock);
 	int32_t cmdLed(LED led, bool on);
 	int32_t resetLink(void);
@@ -127,7 +128,7 @@ public:
 
 private:
 	CMSISDAP();
-	CMSISDAP(hid_device* handle, uint16_t _vid, uint16_t _pid);
+	CMSISDAP(std::shared_ptr<DAPTransport> _transport, uint16_t _vid, uint16_t _pid);
 
 	enum CMD {
 		CMD_INFO = 0x00,
@@ -148,6 +149,8 @@ private:
 		CMD_JTAG_SEQ = 0x14,
 		CMD_JTAG_CONFIGURE = 0x15,
 		CMD_JTAG_IDCODE = 0x16,
+		CMD_EXECUTE_COMMANDS = 0x7F,
+		CMD_INVALID = 0xFF,
 	};
 
 	enum INFO_ID {
@@ -191,7 +194,7 @@ private:
 	};
 	static_assert(CONFIRM_UINT32(JTAG_IDCODE));
 
-	hid_device *hidHandle;
+	std::shared_ptr<DAPTransport> transport;
 	DapInfo dapInfo;
 	uint32_t ap_bank_value;
 	uint16_t pid;
@@ -199,18 +202,28 @@ private:
 
 	uint8_t dapIndex;
 
+	// Value match: retries on the probe, and the mask last sent to the probe
+	uint16_t matchRetry;
+	uint32_t matchMask;
+	bool matchMaskValid;
+
 	// JTAG
 	std::vector<JTAG_IDCODE> jtagIDCODEs;
 	std::vector<uint8_t> jtagIrLength;
 
+	/*
+	 * Packets are sized from the negotiated packet size (including the HID report ID),
+	 * backed by a fixed buffer large enough for high-speed probes.
+	 */
 	class TxPacket
 	{
 	private:
-		uint8_t _data[64 + 1];
+		uint8_t _data[_CMSISDAP_MAX_PACKET_SIZE];
 		uint32_t written;
+		uint32_t _capacity;
 
 	public:
-		TxPacket() : written(0) {}
+		TxPacket(uint32_t packetSize) : written(0), _capacity(std::min<uint32_t>(packetSize, sizeof(_data))) {}
 
 		int32_t write(uint8_t data);
 		int32_t write16(uint16_t data);
@@ -218,25 +231,38 @@ private:
 		void clear() { written = 0; }
 		const uint8_t* data() const { return _data; }
 		uint32_t length() const { return written; }
+		uint32_t capacity() const { return _capacity; }
 	};
 
 	class RxPacket
 	{
 	private:
-		uint8_t _data[64];
+		uint8_t _data[_CMSISDAP_MAX_PACKET_SIZE - 1];
 		uint32_t _length;
+		uint32_t _capacity;
 
 	public:
-		RxPacket() : _length(sizeof(_data)) {}
+		RxPacket(uint32_t packetSize) : _capacity(std::min<uint32_t>(packetSize - 1, sizeof(_data))) { _length = _capacity; }
 
 		uint8_t* data() { return _data; }
 		uint32_t length() const { return _length; }
 		void length(uint32_t len) { _length = len; }
+		uint32_t capacity() const { return _capacity; }
 	};
 
 	int32_t usbTx(const TxPacket& packet);
 	int32_t usbRx(RxPacket* rx);
 	int32_t usbTxRx(const TxPacket& tx, RxPacket* rx);
+
+	// Pipelined transport: up to packetMaxCount commands can be outstanding,
+	// and usbComplete() returns their responses in submission order.
+	std::deque<uint8_t> pendingCommands;
+	int32_t usbSubmit(const TxPacket& tx);
+	int32_t usbComplete(RxPacket* rx);
+	// Reads and discards the responses of every outstanding command.
+	// resync: also whatever else arrives until the transport times out, after a lost or mismatched response.
+	void usbDrain(bool resync);
+	uint32_t maxOutstanding() const;
 	int32_t cmdInfoCapabilities();
 	int32_t cmdConnect(uint8_t mode);
 	int32_t cmdDisconnect();
@@ -245,12 +271,37 @@ private:
 	int32_t cmdInfoFwVer();
 	int32_t cmdInfoVendor();
 	int32_t cmdInfoName();
+	int32_t cmdInfoSerialNumber();
 	int32_t cmdInfoPacketSize();
 	int32_t cmdInfoPacketCount();
 	int32_t cmdSwjPins(uint8_t value, uint8_t pin, uint32_t delay, PIN* input);
 	int32_t dpapRead(bool dp, uint32_t reg, uint32_t *data);
 	int32_t dpapWrite(bool dp, uint32_t reg, uint32_t val);
+	int32_t transferPacket(std::vector<Transfer>& transfers, size_t offset, size_t* done);
+	int32_t transferBlock(uint32_t reg, uint32_t* rdata, const uint32_t* wdata, size_t count, size_t* done);
+	uint32_t buildTransferBlock(TxPacket* tx, uint32_t reg, bool read, const uint32_t* wdata, size_t count);
+	int32_t parseTransferBlock(RxPacket& rx, uint32_t* rdata, uint32_t count, size_t* done);
 	int32_t getInfo(uint32_t type, RxPacket* rx);
+	int32_t parseInfo(uint8_t type, const uint8_t* data);
+
+	// DAP_ExecuteCommands (CMSIS-DAP 1.2+): several commands in one packet.
+	// Probes without it get one round trip per command.
+	struct Command
+	{
+		std::vector<uint8_t> request;	// without the HID report ID
+		std::vector<uint8_t> response;
+
+		Command(uint8_t cmd) { request.push_back(cmd); }
+		Command& write(uint8_t value) { request.push_back(value); return *this; }
+		Command& write16(uint16_t value) { write(value & 0xFF); return write(value >> 8); }
+		Command& write32(uint32_t value) { write16(value & 0xFFFF); return write16(value >> 16); }
+		bool isOK() const { return response.size() >= 2 && response[1] == 0x00; }
+	};
+	bool executeCommandsSupported;
+	int32_t executeCommands(std::vector<Command>& commands);
+	int32_t executeBundle(std::vector<Command>& commands, size_t offset, size_t count);
+	int32_t executeCommand(Command& command);
+	static uint32_t responseLength(const std::vector<uint8_t>& request);
 
 	// SWD
 	int32_t cmdSwdConf(uint8_t cfg);
@@ -260,6 +311,7 @@ private:
 	int32_t findJtagDevices(uint32_t* num);
 	int32_t cmdJtagConfigure(const std::vector<uint8_t>& irLength);
 	int32_t cmdJtagSequence(SequenceInfo info, uint8_t* in, uint8_t* out);
+	static Command jtagSequence(SequenceInfo info, const uint8_t* in);
 	int32_t resetJtagTap();
 	int32_t sendTms(uint8_t cycles, uint8_t tms, uint8_t tdi = 0, uint8_t* tdo = nullptr);
 
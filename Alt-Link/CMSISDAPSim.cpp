@@ -0,0 +1,468 @@
+#include "stdafx.h"
+#include "CMSISDAPSim.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#define ID_DAP_INFO				0x00
+#define ID_DAP_LED				0x01
+#define ID_DAP_CONNECT			0x02
+#define ID_DAP_DISCONNECT		0x03
+#define ID_DAP_TRANSFER_CONFIGURE	0x04
+#define ID_DAP_TRANSFER			0x05
+#define ID_DAP_TRANSFER_BLOCK	0x06
+#define ID_DAP_TRANSFER_ABORT	0x07
+#define ID_DAP_WRITE_ABORT		0x08
+#define ID_DAP_DELAY			0x09
+#define ID_DAP_RESET_TARGET		0x0A
+#define ID_DAP_SWJ_PINS			0x10
+#define ID_DAP_SWJ_CLOCK		0x11
+#define ID_DAP_SWJ_SEQUENCE		0x12
+#define ID_DAP_SWD_CONFIGURE	0x13
+#define ID_DAP_EXECUTE_COMMANDS	0x7F
+#define ID_DAP_INVALID			0xFF
+
+#define DAP_OK					0x00
+#define DAP_ERROR				0xFF
+
+#define DAP_PORT_DISABLED		0x0
+#define DAP_PORT_SWD			0x1
+
+#define DAP_TRANSFER_APnDP		(1 << 0)
+#define DAP_TRANSFER_RnW		(1 << 1)
+#define DAP_TRANSFER_A32		(3 << 2)
+#define DAP_TRANSFER_MATCH_VALUE	(1 << 4)
+#define DAP_TRANSFER_MATCH_MASK	(1 << 5)
+#define DAP_TRANSFER_MISMATCH	(1 << 4)
+
+#define SWJ_PIN_nRESET			(1 << 7)
+
+/* 8bit request + turnaround + 3bit ack + turnaround + 32bit data + parity */
+#define SWD_TRANSFER_CLOCKS		46
+
+static uint16_t get16(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put32(uint8_t* p, uint32_t value)
+{
+	p[0] = value & 0xFF;
+	p[1] = (value >> 8) & 0xFF;
+	p[2] = (value >> 16) & 0xFF;
+	p[3] = (value >> 24) & 0xFF;
+}
+
+void CMSISDAPSim::Stats::print() const
+{
+	_DBGPRT("  Simulated probe: %llu round trips, %llu transfers, %.3f ms virtual time\n",
+		(unsigned long long)packets, (unsigned long long)transfers, (double)elapsed / 1000000.0);
+}
+
+CMSISDAPSim::CMSISDAPSim(std::shared_ptr<CortexMSim> _target, const Config& _config)
+	: target(_target), config(_config), port(DAP_PORT_DISABLED), clock(1000000), matchRetry(0), matchMask(0), pins(SWJ_PIN_nRESET)
+{
+	config.packetSize = std::min<uint16_t>(config.packetSize, _CMSISDAP_MAX_PACKET_SIZE - 1);
+}
+
+void CMSISDAPSim::account(uint32_t transfers)
+{
+	stats.transfers += transfers;
+	stats.elapsed += (uint64_t)transfers * SWD_TRANSFER_CLOCKS * 1000000000ULL / clock;
+}
+
+uint32_t CMSISDAPSim::execute(const uint8_t* request, uint32_t length, uint8_t* response, uint32_t capacity)
+{
+	capacity = std::min<uint32_t>(capacity, config.packetSize);
+	if (length < 1 || capacity < 3)
+		return 0;
+
+	stats.packets++;
+	stats.elapsed += (uint64_t)config.latency * 1000;
+	if (config.realTime)
+		std::this_thread::sleep_for(std::chrono::microseconds(config.latency));
+
+	return command(request, length, response, capacity);
+}
+
+uint32_t CMSISDAPSim::command(const uint8_t* request, uint32_t length, uint8_t* response, uint32_t capacity)
+{
+	response[0] = request[0];
+	response[1] = DAP_OK;
+
+	switch (request[0])
+	{
+	case ID_DAP_EXECUTE_COMMANDS:
+		return cmdExecuteCommands(request, length, response, capacity);
+
+	case ID_DAP_INFO:
+		return cmdInfo(request, length, response, capacity);
+
+	case ID_DAP_TRANSFER:
+		return cmdTransfer(request, length, response, capacity);
+
+	case ID_DAP_TRANSFER_BLOCK:
+		return cmdTransferBlock(request, length, response, capacity);
+
+	case ID_DAP_SWJ_PINS:
+		return cmdSwjPins(request, length, response);
+
+	case ID_DAP_CONNECT:
+		// JTAG は未対応
+		port = (length < 2 || request[1] <= DAP_PORT_SWD) ? DAP_PORT_SWD : DAP_PORT_DISABLED;
+		response[1] = port;
+		return 2;
+
+	case ID_DAP_DISCONNECT:
+		port = DAP_PORT_DISABLED;
+		return 2;
+
+	case ID_DAP_TRANSFER_CONFIGURE:
+		if (length < 6)
+		{
+			response[1] = DAP_ERROR;
+			return 2;
+		}
+		matchRetry = get16(&request[4]);
+		return 2;
+
+	case ID_DAP_WRITE_ABORT:
+		if (length < 6)
+		{
+			response[1] = DAP_ERROR;
+			return 2;
+		}
+		target->dpWrite(0x0, get32(&request[2]));
+		account(1);
+		return 2;
+
+	case ID_DAP_SWJ_CLOCK:
+		if (length < 5 || get32(&request[1]) == 0)
+		{
+			response[1] = DAP_ERROR;
+			return 2;
+		}
+		clock = get32(&request[1]);
+		return 2;
+
+	case ID_DAP_RESET_TARGET:
+		response[2] = 0;	/* no device specific reset sequence */
+		return 3;
+
+	case ID_DAP_LED:
+	case ID_DAP_TRANSFER_ABORT:
+	case ID_DAP_DELAY:
+	case ID_DAP_SWJ_SEQUENCE:
+	case ID_DAP_SWD_CONFIGURE:
+		return 2;
+
+	default:
+		response[0] = ID_DAP_INVALID;
+		return 1;
+	}
+}
+
+uint32_t CMSISDAPSim::requestLength(const uint8_t* request, uint32_t length)
+{
+	if (length < 1)
+		return 0;
+
+	switch (request[0])
+	{
+	case ID_DAP_DISCONNECT:
+	case ID_DAP_TRANSFER_ABORT:
+	case ID_DAP_RESET_TARGET:
+		return 1;
+	case ID_DAP_INFO:
+	case ID_DAP_CONNECT:
+	case ID_DAP_SWD_CONFIGURE:
+		return 2;
+	case ID_DAP_LED:
+	case ID_DAP_DELAY:
+		return 3;
+	case ID_DAP_SWJ_CLOCK:
+		return 5;
+	case ID_DAP_TRANSFER_CONFIGURE:
+	case ID_DAP_WRITE_ABORT:
+		return 6;
+	case ID_DAP_SWJ_PINS:
+		return 7;
+
+	case ID_DAP_SWJ_SEQUENCE:
+	{
+		if (length < 2)
+			return 0;
+		uint32_t bits = (request[1] == 0) ? 256 : request[1];
+		return 2 + (bits + 7) / 8;
+	}
+
+	case ID_DAP_TRANSFER:
+	{
+		if (length < 3)
+			return 0;
+		uint32_t pos = 3;
+		for (uint32_t i = 0; i < request[2]; i++)
+		{
+			if (pos >= length)
+				return 0;
+			uint8_t req = request[pos++];
+			if (!(req & DAP_TRANSFER_RnW) || (req & DAP_TRANSFER_MATCH_VALUE))
+				pos += 4;
+		}
+		return pos;
+	}
+
+	case ID_DAP_TRANSFER_BLOCK:
+		if (length < 5)
+			return 0;
+		return 5 + ((request[4] & DAP_TRANSFER_RnW) ? 0 : 4 * get16(&request[2]));
+
+	default:
+		// DAP_ExecuteCommands は入れ子にできない
+		return 0;
+	}
+}
+
+uint32_t CMSISDAPSim::cmdExecuteCommands(const uint8_t* request, uint32_t length, uint8_t* response, uint32_t capacity)
+{
+	uint32_t count = (length >= 2) ? request[1] : 0;
+	uint32_t pos = 2;
+	uint32_t out = 2;
+	uint32_t executed = 0;
+
+	for (; executed < count; executed++)
+	{
+		uint32_t size = requestLength(&request[pos], length - pos);
+		if (size == 0 || pos + size > length || out + 3 > capacity)
+			break;
+
+		out += command(&request[pos], size, &response[out], capacity - out);
+		pos += size;
+	}
+
+	response[1] = executed;
+	return out;
+}
+
+uint32_t CMSISDAPSim::cmdInfo(const uint8_t* request, uint32_t length, uint8_t* response, uint32_t capacity)
+{
+	if (length < 2)
+	{
+		response[1] = 0;
+		return 2;
+	}
+
+	auto writeString = [&](const std::string& s) -> uint32_t {
+		uint32_t size = std::min<uint32_t>((uint32_t)s.size() + 1, capacity - 2);
+		std::copy(s.begin(), s.begin() + (size - 1), &response[2]);
+		response[2 + size - 1] = '\0';
+		response[1] = size;
+		return 2 + size;
+	};
+
+	switch (request[1])
+	{
+	case 0x01: return writeString(config.vendor);
+	case 0x02: return writeString(config.name);
+	case 0x03: return writeString("SIM00001");
+	case 0x04: return writeString(config.firmwareVersion);
+	case 0xF0:
+		response[1] = 1;
+		response[2] = 0x01;	/* SWD */
+		return 3;
+	case 0xFE:
+		response[1] = 1;
+		response[2] = config.packetCount;
+		return 3;
+	case 0xFF:
+		if (capacity < 4)
+			break;
+		response[1] = 2;
+		response[2] = config.packetSize & 0xFF;
+		response[3] = (config.packetSize >> 8) & 0xFF;
+		return 4;
+	default:
+		break;
+	}
+
+	response[1] = 0;
+	return 2;
+}
+
+uint32_t CMSISDAPSim::transfer(uint8_t req, uint32_t* data)
+{
+	uint32_t reg = req & DAP_TRANSFER_A32;
+	bool ap = (req & DAP_TRANSFER_APnDP) != 0;
+
+	account(1);
+	uint32_t ack;
+	if (!(req & DAP_TRANSFER_RnW))
+	{
+		ack = ap ? target->apWrite(reg, *data) : target->dpWrite(reg, *data);
+	}
+	else
+	{
+		ack = ap ? target->apRead(reg, data) : target->dpRead(reg, data);
+
+		// 配線の限界を超えたクロックでは読み出しが化ける
+		if (config.maxClock != 0 && clock > config.maxClock)
+			*data ^= 0x1;
+	}
+
+	// JTAG-DP の ACK は OK と FAULT を区別できない
+	if (config.faultAsOk && ack == CortexMSim::ACK_FAULT)
+		ack = CortexMSim::ACK_OK;
+	return ack;
+}
+
+uint32_t CMSISDAPSim::cmdTransfer(const uint8_t* request, uint32_t length, uint8_t* response, uint32_t capacity)
+{
+	uint32_t count = (length >= 3) ? request[2] : 0;
+	uint32_t pos = 3;
+	uint32_t out = 3;
+	uint32_t executed = 0;
+	uint32_t ack = 0;
+
+	for (; executed < count; executed++)
+	{
+		if (pos >= length || port != DAP_PORT_SWD)
+			break;
+
+		uint8_t req = request[pos++];
+		bool read = (req & DAP_TRANSFER_RnW) != 0;
+		bool hasData = !read || (req & DAP_TRANSFER_MATCH_VALUE);
+		if (hasData && pos + 4 > length)
+			break;
+
+		uint32_t data = hasData ? get32(&request[pos]) : 0;
+		if (hasData)
+			pos += 4;
+
+		if (read && (req & DAP_TRANSFER_MATCH_VALUE))
+		{
+			uint32_t match = data;
+			uint32_t retry = matchRetry;
+			while (1)
+			{
+				ack = transfer(req, &data);
+				if (ack != CortexMSim::ACK_OK || (data & matchMask) == match || retry-- == 0)
+					break;
+			}
+			if (ack == CortexMSim::ACK_OK && (data & matchMask) != match)
+				ack |= DAP_TRANSFER_MISMATCH;
+		}
+		else if (!read && (req & DAP_TRANSFER_MATCH_MASK))
+		{
+			matchMask = data;
+			ack = CortexMSim::ACK_OK;
+		}
+		else if (read)
+		{
+			if (out + 4 > capacity)
+				break;
+			ack = transfer(req, &data);
+			if (ack == CortexMSim::ACK_OK)
+			{
+				put32(&response[out], data);
+				out += 4;
+			}
+		}
+		else
+		{
+			ack = transfer(req, &data);
+			// AP 書き込みの失敗は最後の RDBUFF の確認で分かるので、実機と同じく転送数に含める
+			if (ack != CortexMSim::ACK_OK && (req & DAP_TRANSFER_APnDP))
+			{
+				executed++;
+				break;
+			}
+		}
+
+		if (ack != CortexMSim::ACK_OK)
+			break;
+	}
+
+	response[1] = executed;
+	response[2] = ack;
+	return out;
+}
+
+uint32_t CMSISDAPSim::cmdTransferBlock(const uint8_t* request, uint32_t length, uint8_t* response, uint32_t capacity)
+{
+	if (length < 5 || capacity < 4)
+	{
+		response[1] = 0;
+		response[2] = 0;
+		response[3] = 0;
+		return std::min<uint32_t>(capacity, 4);
+	}
+
+	uint32_t count = get16(&request[2]);
+	uint8_t req = request[4];
+	bool read = (req & DAP_TRANSFER_RnW) != 0;
+	uint32_t pos = 5;
+	uint32_t out = 4;
+	uint32_t done = 0;
+	uint32_t ack = 0;
+
+	for (; done < count; done++)
+	{
+		if (port != DAP_PORT_SWD)
+			break;
+
+		uint32_t data = 0;
+		if (read)
+		{
+			if (out + 4 > capacity)
+				break;
+			ack = transfer(req, &data);
+			if (ack != CortexMSim::ACK_OK)
+				break;
+			put32(&response[out], data);
+			out += 4;
+		}
+		else
+		{
+			if (pos + 4 > length)
+				break;
+			data = get32(&request[pos]);
+			pos += 4;
+			ack = transfer(req, &data);
+			if (ack != CortexMSim::ACK_OK)
+			{
+				if (req & DAP_TRANSFER_APnDP)
+					done++;
+				break;
+			}
+		}
+	}
+
+	response[1] = done & 0xFF;
+	response[2] = (done >> 8) & 0xFF;
+	response[3] = ack;
+	return out;
+}
+
+uint32_t CMSISDAPSim::cmdSwjPins(const uint8_t* request, uint32_t length, uint8_t* response)
+{
+	if (length >= 3)
+	{
+		uint8_t value = request[1];
+		uint8_t select = request[2];
+
+		// nRESET のアサートでターゲットをリセットする
+		if ((select & SWJ_PIN_nRESET) && !(value & SWJ_PIN_nRESET) && (pins & SWJ_PIN_nRESET))
+			target->reset();
+
+		pins = (pins & ~select) | (value & select);
+	}
+
+	response[1] = pins;
+	return 2;
+}
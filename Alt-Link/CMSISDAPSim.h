@@ -0,0 +1,76 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "DAPTransport.h"
+#include "CortexMSim.h"
+
+/*
+ * Simulated CMSIS-DAP (SWD only) probe driving a CortexMSim target.
+ * Use with LoopbackTransport to run the whole stack without hardware.
+ *
+ * Time is accounted virtually: every packet costs `latency` and every transfer
+ * costs one SWD transaction at the configured SWJ clock, so benchmarks are deterministic.
+ * Set realTime to additionally sleep for the packet latency.
+ */
+class CMSISDAPSim : public DAPCommandHandler
+{
+public:
+	struct Config
+	{
+		uint16_t packetSize;
+		uint8_t packetCount;
+		uint32_t latency;	// per packet [us]
+		uint32_t maxClock;	// reads are corrupted above this SWJ clock [Hz], 0: no limit
+		bool faultAsOk;		// report FAULT as OK like a JTAG-DP, errors only show in CTRL/STAT
+		bool realTime;
+		std::string vendor;
+		std::string name;
+		std::string firmwareVersion;
+
+		Config() :
+			packetSize(64), packetCount(4), latency(1000), maxClock(0), faultAsOk(false), realTime(false),
+			vendor("Alt-Link"), name("Simulated CMSIS-DAP"), firmwareVersion("1.10") {}
+	};
+
+	struct Stats
+	{
+		uint64_t packets;
+		uint64_t transfers;
+		uint64_t elapsed;	// virtual time [ns]
+
+		Stats() : packets(0), transfers(0), elapsed(0) {}
+		void print() const;
+	};
+
+	CMSISDAPSim(std::shared_ptr<CortexMSim> _target, const Config& _config = Config());
+
+	virtual uint32_t execute(const uint8_t* request, uint32_t length, uint8_t* response, uint32_t capacity);
+
+	std::shared_ptr<CortexMSim> getTarget() { return target; }
+	const Stats& getStats() const { return stats; }
+	void resetStats() { stats = Stats(); }
+
+private:
+	std::shared_ptr<CortexMSim> target;
+	Config config;
+	Stats stats;
+
+	uint8_t port;
+	uint32_t clock;
+	uint16_t matchRetry;
+	uint32_t matchMask;
+	uint8_t pins;
+
+	uint32_t command(const uint8_t* request, uint32_t length, uint8_t* response, uint32_t capacity);
+	uint32_t cmdExecuteCommands(const uint8_t* request, uint32_t length, uint8_t* response, uint32_t capacity);
+	uint32_t cmdInfo(const uint8_t* request, uint32_t length, uint8_t* response, uint32_t capacity);
+	uint32_t cmdTransfer(const uint8_t* request, uint32_t length, uint8_t* response, uint32_t capacity);
+	uint32_t cmdTransferBlock(const uint8_t* request, uint32_t length, uint8_t* response, uint32_t capacity);
+	uint32_t cmdSwjPins(const uint8_t* request, uint32_t length, uint8_t* response);
+
+	static uint32_t requestLength(const uint8_t* request, uint32_t length);
+	uint32_t transfer(uint8_t req, uint32_t* data);
+	void account(uint32_t transfers);
+};
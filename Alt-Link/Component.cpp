@@ -5,71 +5,6 @@
 
 #define _DBGPRT printf
 
-int32_t ADIv5::Component::readCid()
-{
-	int ret;
-	uint32_t data;
-	
-	cid.raw = 0;
-
-	ret = ap.read(base + 0xFF0, &data);
-	if (ret != OK)
-		return ret;
-	cid.uint8[0] = data;
-
-	ret = ap.read(base + 0xFF4, &data);
-	if (ret != OK)
-		return ret;
-	cid.uint8[1] = data;
-
-	ret = ap.read(base + 0xFF8, &data);
-	if (ret != OK)
-		return ret;
-	cid.uint8[2] = data;
-
-	ret = ap.read(base + 0xFFC, &data);
-	if (ret != OK)
-		return ret;
-	cid.uint8[3] = data;
-
-	return OK;
-}
-
-int32_t ADIv5::Component::readPid()
-{
-	int ret;
-	uint32_t data;
-	
-	pid.raw = 0;
-
-	ret = ap.read(base + 0xFE0, &data);
-	if (ret != OK)
-		return ret;
-	pid.uint8[0] = data;
-
-	ret = ap.read(base + 0xFE4, &data);
-	if (ret != OK)
-		return ret;
-	pid.uint8[1] = data;
-
-	ret = ap.read(base + 0xFE8, &data);
-	if (ret != OK)
-		return ret;
-	pid.uint8[2] = data;
-
-	ret = ap.read(base + 0xFEC, &data);
-	if (ret != OK)
-		return ret;
-	pid.uint8[3] = data;
-
-	ret = ap.read(base + 0xFD0, &data);
-	if (ret != OK)
-		return ret;
-	pid.uint8[4] = data;
-
-	return OK;
-}
-
 const char* ADIv5::Component::getName() const
 {
 	if (cid.ComponentClass == CID::ROM_TABLE)
@@ -220,18 +155,38 @@ bool ADIv5::Component::isRomTable()
 int32_t ADIv5::Component::readPidCid()
 {
 	int ret;
+	std::vector<uint32_t> addrs;
+	std::vector<uint32_t> data;
 
-	ret = readPid();
-	if (ret != OK)
-		return ret;
+	pid.raw = 0;
+	cid.raw = 0;
 
-	ret = readCid();
+	// PID0-3, PID4, CID0-3 を 1 回の転送でまとめて読む
+	appendPidCidAddrs(&addrs);
+	ret = ap.read(addrs, &data);
 	if (ret != OK)
 		return ret;
 
+	parsePidCid(data.data());
 	return OK;
 }
 
+void ADIv5::Component::appendPidCidAddrs(std::vector<uint32_t>* addrs) const
+{
+	for (uint32_t offset : { 0xFE0, 0xFE4, 0xFE8, 0xFEC, 0xFD0, 0xFF0, 0xFF4, 0xFF8, 0xFFC })
+		addrs->push_back(base + offset);
+}
+
+void ADIv5::Component::parsePidCid(const uint32_t* data)
+{
+	pid.raw = 0;
+	cid.raw = 0;
+	for (int i = 0; i < 5; i++)
+		pid.uint8[i] = data[i];
+	for (int i = 0; i < 4; i++)
+		cid.uint8[i] = data[5 + i];
+}
+
 void ADIv5::Component::print()
 {
 	getPid().print();
@@ -0,0 +1,654 @@
+#include "stdafx.h"
+#include "CortexMSim.h"
+
+#include <algorithm>
+
+/* DP registers (A[3:2]) */
+#define DP_IDCODE		0x0
+#define DP_ABORT		0x0
+#define DP_CTRL_STAT	0x4
+#define DP_SELECT		0x8
+#define DP_RDBUFF		0xC
+
+#define CTRL_STAT_STICKYORUN	(1UL << 1)
+#define CTRL_STAT_STICKYCMP		(1UL << 4)
+#define CTRL_STAT_STICKYERR		(1UL << 5)
+#define CTRL_STAT_WDATAERR		(1UL << 7)
+#define CTRL_STAT_REQ_MASK		((1UL << 26) | (1UL << 28) | (1UL << 30))
+#define CTRL_STAT_RW_MASK		(0x00FFFF0DUL | CTRL_STAT_REQ_MASK)
+
+/* MEM-AP registers */
+#define AP_CSW		0x00
+#define AP_TAR		0x04
+#define AP_DRW		0x0C
+#define AP_BD0		0x10
+#define AP_BD3		0x1C
+#define AP_CFG		0xF4
+#define AP_BASE		0xF8
+#define AP_IDR		0xFC
+
+#define AHB_AP_IDR		0x24770011
+#define AHB_AP_CSW		0x22000042	/* MasterType, Hprot1, DeviceEn, 32bit */
+#define CSW_DEVICE_EN	(1UL << 6)
+#define CSW_TR_IN_PROG	(1UL << 7)
+
+/* Memory map */
+#define ADDR_DWT		0xE0001000
+#define ADDR_FPB		0xE0002000
+#define ADDR_SCS		0xE000E000
+#define ADDR_ROM_TABLE	0xE00FF000
+#define ADDR_PPB		0xE0000000
+#define SIZE_PPB		0x00100000
+#define SIZE_COMPONENT	0x1000
+
+/* SCS */
+#define SCS_CPUID	0xD00
+#define SCS_AIRCR	0xD0C
+#define SCS_DFSR	0xD30
+#define SCS_DHCSR	0xDF0
+#define SCS_DCRSR	0xDF4
+#define SCS_DCRDR	0xDF8
+#define SCS_DEMCR	0xDFC
+
+#define CPUID_CORTEX_M3		0x412FC231
+#define DHCSR_C_DEBUGEN		(1UL << 0)
+#define DHCSR_C_HALT		(1UL << 1)
+#define DHCSR_C_STEP		(1UL << 2)
+#define DHCSR_S_REGRDY		(1UL << 16)
+#define DHCSR_S_HALT		(1UL << 17)
+#define DHCSR_S_RESET_ST	(1UL << 25)
+#define DHCSR_DBGKEY		0xA05F
+#define DCRSR_REGWnR		(1UL << 16)
+#define DEMCR_VC_CORERESET	(1UL << 0)
+#define AIRCR_VECTKEY		0x05FA
+#define AIRCR_VECTRESET		(1UL << 0)
+#define AIRCR_SYSRESETREQ	(1UL << 2)
+
+#define DFSR_HALTED		(1UL << 0)
+#define DFSR_BKPT		(1UL << 1)
+#define DFSR_VCATCH		(1UL << 3)
+
+#define REG_SP		13
+#define REG_PC		15
+#define REG_XPSR	16
+#define REG_MSP		17
+
+/* FPB: 6 code comparators, 2 literal comparators */
+#define FP_CTRL_NUM		0x260
+#define FP_CTRL_ENABLE	(1UL << 0)
+#define FP_CTRL_KEY		(1UL << 1)
+#define FP_COMP_ENABLE	(1UL << 0)
+#define FP_NUM_CODE		6
+
+/* DWT: 4 comparators */
+#define DWT_CTRL_NUMCOMP	0x40000000
+
+/* CoreSight part numbers */
+#define PART_SCS_M3			0x000
+#define PART_DWT_M3			0x002
+#define PART_FPB_M3			0x003
+#define PART_ROM_TABLE_M3	0x4C3
+#define CLASS_ROM_TABLE		0x1
+#define CLASS_GENERIC_IP	0xE
+
+CortexMSim::CortexMSim(const Config& _config) : config(_config)
+{
+	flash.resize(config.flashSize);
+	ram.resize(config.ramSize);
+
+	ctrlStat = 0;
+	select = 0;
+	csw = AHB_AP_CSW;
+	tar = 0;
+	dhcsr = 0;
+	dcrdr = 0;
+	demcr = 0;
+	dfsr = 0;
+
+	reset();
+}
+
+void CortexMSim::reset()
+{
+	std::fill(std::begin(regs), std::end(regs), 0);
+
+	uint32_t sp = 0, pc = 0;
+	readWord(config.flashBase + 0, &sp);
+	readWord(config.flashBase + 4, &pc);
+	regs[REG_SP] = sp;
+	regs[REG_MSP] = sp;
+	regs[REG_PC] = pc & ~1UL;
+	regs[REG_XPSR] = 0x01000000;	/* Thumb */
+
+	fpCtrl = 0;
+	fpRemap = 0;
+	std::fill(std::begin(fpComp), std::end(fpComp), 0);
+
+	dwtCtrl = 0;
+	dwtCyccnt = 0;
+	for (auto& comp : dwtComp)
+		std::fill(std::begin(comp), std::end(comp), 0);
+
+	halted = false;
+	dhcsr &= ~DHCSR_C_HALT;
+	resetSticky = true;
+
+	if ((dhcsr & DHCSR_C_DEBUGEN) && (demcr & DEMCR_VC_CORERESET))
+		haltCore(DFSR_VCATCH);
+}
+
+uint32_t CortexMSim::dpRead(uint32_t reg, uint32_t* data)
+{
+	switch (reg & 0xC)
+	{
+	case DP_IDCODE:
+		*data = config.idcode;
+		break;
+	case DP_CTRL_STAT:
+		*data = (select & 0xF) == 0 ? ctrlStat : 0;
+		break;
+	default:
+		*data = 0;
+		break;
+	}
+	return ACK_OK;
+}
+
+uint32_t CortexMSim::dpWrite(uint32_t reg, uint32_t data)
+{
+	switch (reg & 0xC)
+	{
+	case DP_ABORT:
+		if (data & (1UL << 1))
+			ctrlStat &= ~CTRL_STAT_STICKYCMP;
+		if (data & (1UL << 2))
+			ctrlStat &= ~CTRL_STAT_STICKYERR;
+		if (data & (1UL << 3))
+			ctrlStat &= ~CTRL_STAT_WDATAERR;
+		if (data & (1UL << 4))
+			ctrlStat &= ~CTRL_STAT_STICKYORUN;
+		break;
+	case DP_CTRL_STAT:
+		if ((select & 0xF) != 0)
+			break;
+		ctrlStat = (ctrlStat & ~CTRL_STAT_RW_MASK) | (data & CTRL_STAT_RW_MASK);
+		// power up requests are acknowledged immediately
+		ctrlStat = (ctrlStat & ~(CTRL_STAT_REQ_MASK << 1)) | ((ctrlStat & CTRL_STAT_REQ_MASK) << 1);
+		break;
+	case DP_SELECT:
+		select = data;
+		break;
+	default:
+		break;
+	}
+	return ACK_OK;
+}
+
+uint32_t CortexMSim::apRead(uint32_t reg, uint32_t* data)
+{
+	return apAccess(reg, true, data);
+}
+
+uint32_t CortexMSim::apWrite(uint32_t reg, uint32_t data)
+{
+	return apAccess(reg, false, &data);
+}
+
+uint32_t CortexMSim::apAccess(uint32_t reg, bool read, uint32_t* data)
+{
+	if (ctrlStat & CTRL_STAT_STICKYERR)
+		return ACK_FAULT;
+
+	uint32_t apsel = select >> 24;
+	uint32_t addr = (select & 0xF0) | (reg & 0xC);
+
+	// AP 以外は存在しない
+	if (apsel != 0)
+	{
+		if (read)
+			*data = 0;
+		return ACK_OK;
+	}
+
+	switch (addr)
+	{
+	case AP_CSW:
+		if (read)
+			*data = csw;
+		else
+			csw = (*data & ~CSW_TR_IN_PROG) | CSW_DEVICE_EN;
+		break;
+	case AP_TAR:
+		if (read)
+			*data = tar;
+		else
+			tar = *data;
+		break;
+	case AP_DRW:
+		if (!drwAccess(tar, read, data))
+		{
+			ctrlStat |= CTRL_STAT_STICKYERR;
+			return ACK_FAULT;
+		}
+		break;
+	case AP_CFG:
+		if (read)
+			*data = 0;
+		break;
+	case AP_BASE:
+		if (read)
+			*data = ADDR_ROM_TABLE | 0x3;
+		break;
+	case AP_IDR:
+		if (read)
+			*data = AHB_AP_IDR;
+		break;
+	default:
+		if (addr >= AP_BD0 && addr <= AP_BD3)
+		{
+			uint32_t saved = tar;
+			uint32_t addrInc = (csw >> 4) & 0x3;
+			csw &= ~(0x3UL << 4);
+			bool ok = drwAccess((tar & ~0xFUL) | (addr & 0xC), read, data);
+			csw |= addrInc << 4;
+			tar = saved;
+			if (!ok)
+			{
+				ctrlStat |= CTRL_STAT_STICKYERR;
+				return ACK_FAULT;
+			}
+		}
+		else if (read)
+		{
+			*data = 0;
+		}
+		break;
+	}
+	return ACK_OK;
+}
+
+bool CortexMSim::drwAccess(uint32_t addr, bool read, uint32_t* data)
+{
+	uint32_t size = csw & 0x7;
+	uint32_t addrInc = (csw >> 4) & 0x3;
+	if (size > 2)
+		return false;
+
+	uint32_t bytes = 1 << size;
+	uint32_t count = (addrInc == 2) ? 4 / bytes : 1;	/* packed */
+	uint32_t value = 0;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t a = (addrInc == 0) ? addr : tar;
+		uint32_t lane = (a & 0x3) & ~(bytes - 1);
+		uint32_t mask = (bytes == 4) ? 0xFFFFFFFF : ((1UL << (bytes * 8)) - 1) << (lane * 8);
+
+		if (read)
+		{
+			uint32_t word;
+			if (!readWord(a & ~0x3UL, &word))
+				return false;
+			value |= word & mask;
+		}
+		else
+		{
+			uint32_t strobe = ((1UL << bytes) - 1) << lane;
+			if (!writeWord(a & ~0x3UL, *data & mask, strobe))
+				return false;
+		}
+
+		if (addrInc != 0)
+			incrementTAR(bytes);
+	}
+
+	if (read)
+		*data = value;
+	return true;
+}
+
+void CortexMSim::incrementTAR(uint32_t bytes)
+{
+	// 自動インクリメントは 1KB 境界でラップする
+	tar = (tar & ~0x3FFUL) | ((tar + bytes) & 0x3FF);
+}
+
+bool CortexMSim::busRead(uint32_t addr, uint32_t size, uint32_t* data)
+{
+	uint32_t word;
+	if (!readWord(addr & ~0x3UL, &word))
+		return false;
+
+	uint32_t shift = (addr & 0x3) * 8;
+	*data = (size == 4) ? word : (word >> shift) & ((1UL << (size * 8)) - 1);
+	return true;
+}
+
+bool CortexMSim::busWrite(uint32_t addr, uint32_t size, uint32_t data)
+{
+	uint32_t lane = addr & 0x3;
+	uint32_t strobe = (size == 4) ? 0xF : ((1UL << size) - 1) << lane;
+	return writeWord(addr & ~0x3UL, (size == 4) ? data : data << (lane * 8), strobe);
+}
+
+uint8_t* CortexMSim::memory(uint32_t addr)
+{
+	if (addr - config.flashBase < config.flashSize)
+		return &flash[addr - config.flashBase];
+	if (addr - config.ramBase < config.ramSize)
+		return &ram[addr - config.ramBase];
+	return nullptr;
+}
+
+bool CortexMSim::readWord(uint32_t addr, uint32_t* data)
+{
+	uint8_t* p = memory(addr);
+	if (p != nullptr)
+	{
+		*data = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+		return true;
+	}
+
+	uint32_t offset = addr & (SIZE_COMPONENT - 1);
+	switch (addr & ~(SIZE_COMPONENT - 1))
+	{
+	case ADDR_SCS:
+		*data = readScs(offset);
+		return true;
+	case ADDR_DWT:
+		*data = readDwt(offset);
+		return true;
+	case ADDR_FPB:
+		*data = readFpb(offset);
+		return true;
+	case ADDR_ROM_TABLE:
+		*data = readRomTable(offset);
+		return true;
+	default:
+		break;
+	}
+
+	// PPB の未実装領域は RAZ/WI
+	if (addr - ADDR_PPB < SIZE_PPB)
+	{
+		*data = 0;
+		return true;
+	}
+	return false;
+}
+
+bool CortexMSim::writeWord(uint32_t addr, uint32_t data, uint32_t strobe)
+{
+	uint8_t* p = memory(addr);
+	if (p != nullptr)
+	{
+		for (uint32_t i = 0; i < 4; i++)
+		{
+			if (strobe & (1 << i))
+				p[i] = (data >> (i * 8)) & 0xFF;
+		}
+		return true;
+	}
+
+	if (strobe != 0xF)
+	{
+		uint32_t mask = 0;
+		for (uint32_t i = 0; i < 4; i++)
+		{
+			if (strobe & (1 << i))
+				mask |= 0xFFUL << (i * 8);
+		}
+
+		uint32_t current;
+		if (!readWord(addr, &current))
+			return false;
+		data = (current & ~mask) | (data & mask);
+	}
+
+	uint32_t offset = addr & (SIZE_COMPONENT - 1);
+	switch (addr & ~(SIZE_COMPONENT - 1))
+	{
+	case ADDR_SCS:
+		writeScs(offset, data);
+		return true;
+	case ADDR_DWT:
+		writeDwt(offset, data);
+		return true;
+	case ADDR_FPB:
+		writeFpb(offset, data);
+		return true;
+	case ADDR_ROM_TABLE:
+		return true;
+	default:
+		break;
+	}
+
+	if (addr - ADDR_PPB < SIZE_PPB)
+		return true;
+	return false;
+}
+
+uint32_t CortexMSim::readId(uint32_t offset, uint32_t part, uint32_t cls)
+{
+	switch (offset)
+	{
+	case 0xFD0: return 0x04;						/* PID4: JEP106 continuation */
+	case 0xFE0: return part & 0xFF;					/* PID0 */
+	case 0xFE4: return ((part >> 8) & 0xF) | 0xB0;	/* PID1: JEP106 ID[3:0] */
+	case 0xFE8: return 0x0B;						/* PID2: JEDEC, JEP106 ID[6:4] */
+	case 0xFEC: return 0x00;						/* PID3 */
+	case 0xFF0: return 0x0D;						/* CID0 */
+	case 0xFF4: return cls << 4;					/* CID1 */
+	case 0xFF8: return 0x05;						/* CID2 */
+	case 0xFFC: return 0xB1;						/* CID3 */
+	default: return 0;
+	}
+}
+
+uint32_t CortexMSim::readRomTable(uint32_t offset)
+{
+	switch (offset)
+	{
+	case 0x000: return (ADDR_SCS - ADDR_ROM_TABLE) | 0x3;
+	case 0x004: return (ADDR_DWT - ADDR_ROM_TABLE) | 0x3;
+	case 0x008: return (ADDR_FPB - ADDR_ROM_TABLE) | 0x3;
+	case 0xFCC: return 0x1;	/* MEMTYPE: SYSMEM */
+	default: return readId(offset, PART_ROM_TABLE_M3, CLASS_ROM_TABLE);
+	}
+}
+
+uint32_t CortexMSim::readScs(uint32_t offset)
+{
+	switch (offset)
+	{
+	case SCS_CPUID:
+		return CPUID_CORTEX_M3;
+	case SCS_AIRCR:
+		return 0xFA050000;
+	case SCS_DFSR:
+		return dfsr;
+	case SCS_DHCSR:
+	{
+		uint32_t value = (dhcsr & 0xF) | (halted ? DHCSR_S_REGRDY | DHCSR_S_HALT : 0);
+		if (resetSticky)
+			value |= DHCSR_S_RESET_ST;
+		resetSticky = false;
+		return value;
+	}
+	case SCS_DCRDR:
+		return dcrdr;
+	case SCS_DEMCR:
+		return demcr;
+	default:
+		return readId(offset, PART_SCS_M3, CLASS_GENERIC_IP);
+	}
+}
+
+void CortexMSim::writeScs(uint32_t offset, uint32_t data)
+{
+	switch (offset)
+	{
+	case SCS_AIRCR:
+		if ((data >> 16) == AIRCR_VECTKEY && (data & (AIRCR_SYSRESETREQ | AIRCR_VECTRESET)))
+			reset();
+		break;
+	case SCS_DFSR:
+		dfsr &= ~data;
+		break;
+	case SCS_DHCSR:
+		writeDHCSR(data);
+		break;
+	case SCS_DCRSR:
+	{
+		if (!halted)
+			break;
+		uint32_t sel = data & 0x7F;
+		bool valid = sel <= 20 && sel != 19;
+		if (data & DCRSR_REGWnR)
+		{
+			if (valid)
+				regs[sel] = dcrdr;
+		}
+		else
+		{
+			dcrdr = valid ? regs[sel] : 0;
+		}
+		break;
+	}
+	case SCS_DCRDR:
+		dcrdr = data;
+		break;
+	case SCS_DEMCR:
+		demcr = data;
+		break;
+	default:
+		break;
+	}
+}
+
+void CortexMSim::writeDHCSR(uint32_t data)
+{
+	if ((data >> 16) != DHCSR_DBGKEY)
+		return;
+
+	dhcsr = data & 0xF;
+	if (!(dhcsr & DHCSR_C_DEBUGEN))
+	{
+		if (halted)
+			resume();
+		return;
+	}
+
+	if (dhcsr & DHCSR_C_HALT)
+	{
+		if (!halted)
+			haltCore(DFSR_HALTED);
+	}
+	else if (halted)
+	{
+		if (dhcsr & DHCSR_C_STEP)
+		{
+			// 命令は実行せず PC だけ進め、再び停止する
+			regs[REG_PC] += 2;
+			haltCore(DFSR_HALTED);
+		}
+		else
+		{
+			resume();
+		}
+	}
+}
+
+void CortexMSim::resume()
+{
+	halted = false;
+	if (!(fpCtrl & FP_CTRL_ENABLE) || !(dhcsr & DHCSR_C_DEBUGEN))
+		return;
+
+	// 次のブレークポイントで停止したものとする
+	uint32_t pc = regs[REG_PC];
+	bool found = false;
+	uint32_t next = 0;
+	for (uint32_t i = 0; i < FP_NUM_CODE; i++)
+	{
+		if (!(fpComp[i] & FP_COMP_ENABLE))
+			continue;
+
+		uint32_t addr = (fpComp[i] & 0x1FFFFFFC) | ((fpComp[i] >> 30) == 2 ? 2 : 0);
+		// pc より後ろを優先し、なければ最小のアドレス
+		uint32_t distance = addr - pc - 1;
+		if (!found || distance < next - pc - 1)
+		{
+			next = addr;
+			found = true;
+		}
+	}
+
+	if (found)
+	{
+		regs[REG_PC] = next;
+		haltCore(DFSR_BKPT);
+	}
+}
+
+void CortexMSim::haltCore(uint32_t reason)
+{
+	halted = true;
+	dhcsr |= DHCSR_C_HALT;
+	dfsr |= reason;
+}
+
+uint32_t CortexMSim::readFpb(uint32_t offset)
+{
+	if (offset == 0x000)
+		return FP_CTRL_NUM | (fpCtrl & FP_CTRL_ENABLE);
+	if (offset == 0x004)
+		return fpRemap;
+	if (offset >= 0x008 && offset < 0x028)
+		return fpComp[(offset - 0x008) / 4];
+	return readId(offset, PART_FPB_M3, CLASS_GENERIC_IP);
+}
+
+void CortexMSim::writeFpb(uint32_t offset, uint32_t data)
+{
+	if (offset == 0x000)
+	{
+		if (data & FP_CTRL_KEY)
+			fpCtrl = data & FP_CTRL_ENABLE;
+	}
+	else if (offset == 0x004)
+	{
+		fpRemap = data;
+	}
+	else if (offset >= 0x008 && offset < 0x028)
+	{
+		fpComp[(offset - 0x008) / 4] = data;
+	}
+}
+
+uint32_t CortexMSim::readDwt(uint32_t offset)
+{
+	if (offset == 0x000)
+		return DWT_CTRL_NUMCOMP | (dwtCtrl & 0x0FFFFFFF);
+	if (offset == 0x004)
+	{
+		if (!halted && (dwtCtrl & 0x1))
+			dwtCyccnt += 1000;
+		return dwtCyccnt;
+	}
+	if (offset == 0x01C)
+		return halted ? 0xFFFFFFFF : regs[REG_PC];
+	if (offset >= 0x020 && offset < 0x060)
+		return dwtComp[(offset - 0x020) / 16][((offset - 0x020) % 16) / 4];
+	return readId(offset, PART_DWT_M3, CLASS_GENERIC_IP);
+}
+
+void CortexMSim::writeDwt(uint32_t offset, uint32_t data)
+{
+	if (offset == 0x000)
+		dwtCtrl = data;
+	else if (offset == 0x004)
+		dwtCyccnt = data;
+	else if (offset >= 0x020 && offset < 0x060 && ((offset - 0x020) % 16) < 12)
+		dwtComp[(offset - 0x020) / 16][((offset - 0x020) % 16) / 4] = data;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+/*
+ * Software model of a Cortex-M3 class target as seen through an SW-DP:
+ * DP, one AHB-AP with a ROM table, SCS/DWT/FPB and flat flash/RAM.
+ * Accesses are modelled at the DAP_Transfer level (no posted reads).
+ */
+class CortexMSim
+{
+public:
+	struct Config
+	{
+		uint32_t idcode;
+		uint32_t flashBase;
+		uint32_t flashSize;
+		uint32_t ramBase;
+		uint32_t ramSize;
+
+		Config() :
+			idcode(0x2BA01477),
+			flashBase(0x00000000), flashSize(256 * 1024),
+			ramBase(0x20000000), ramSize(64 * 1024) {}
+	};
+
+	enum Ack
+	{
+		ACK_OK		= 0x1,
+		ACK_WAIT	= 0x2,
+		ACK_FAULT	= 0x4
+	};
+
+	CortexMSim(const Config& _config = Config());
+
+	// returns Ack
+	uint32_t dpRead(uint32_t reg, uint32_t* data);
+	uint32_t dpWrite(uint32_t reg, uint32_t data);
+	uint32_t apRead(uint32_t reg, uint32_t* data);
+	uint32_t apWrite(uint32_t reg, uint32_t data);
+
+	void reset();
+	bool isHalted() const { return halted; }
+
+	// Direct bus access for preloading images or checking results
+	bool busRead(uint32_t addr, uint32_t size, uint32_t* data);
+	bool busWrite(uint32_t addr, uint32_t size, uint32_t data);
+
+private:
+	Config config;
+	std::vector<uint8_t> flash;
+	std::vector<uint8_t> ram;
+
+	// DP
+	uint32_t ctrlStat;
+	uint32_t select;
+
+	// AHB-AP
+	uint32_t csw;
+	uint32_t tar;
+
+	// core
+	uint32_t regs[21];
+	bool halted;
+	uint32_t dhcsr;
+	uint32_t dcrdr;
+	uint32_t demcr;
+	uint32_t dfsr;
+	bool resetSticky;
+
+	// FPB
+	uint32_t fpCtrl;
+	uint32_t fpRemap;
+	uint32_t fpComp[8];
+
+	// DWT
+	uint32_t dwtCtrl;
+	uint32_t dwtCyccnt;
+	uint32_t dwtComp[4][3];
+
+	uint32_t apAccess(uint32_t reg, bool read, uint32_t* data);
+	bool drwAccess(uint32_t addr, bool read, uint32_t* data);
+	void incrementTAR(uint32_t bytes);
+
+	bool readWord(uint32_t addr, uint32_t* data);
+	bool writeWord(uint32_t addr, uint32_t data, uint32_t strobe);
+	uint8_t* memory(uint32_t addr);
+
+	uint32_t readScs(uint32_t offset);
+	void writeScs(uint32_t offset, uint32_t data);
+	uint32_t readFpb(uint32_t offset);
+	void writeFpb(uint32_t offset, uint32_t data);
+	uint32_t readDwt(uint32_t offset);
+	void writeDwt(uint32_t offset, uint32_t data);
+	uint32_t readRomTable(uint32_t offset);
+	static uint32_t readId(uint32_t offset, uint32_t part, uint32_t cls);
+
+	void writeDHCSR(uint32_t data);
+	void resume();
+	void haltCore(uint32_t reason);
+};
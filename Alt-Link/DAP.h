@@ -1,5 +1,9 @@
 #pragma once
 
+#include <vector>
+#include <memory>
+#include <future>
+
 class DAP
 {
 public:
@@ -8,6 +12,143 @@ public:
 	virtual int32_t apRead(uint32_t reg, uint32_t *data)	= 0;
 	virtual int32_t apWrite(uint32_t reg, uint32_t val)		= 0;
 
+	struct Transfer
+	{
+		bool ap;		// false: DP, true: AP
+		bool read;
+		uint32_t reg;
+		uint32_t data;	// write: value to write, read: value read, match: value to match
+		bool match;		// read until (value & mask) == data, fails with CMSISDAP_ERR_VALUE_MISMATCH
+		uint32_t mask;
+
+		static Transfer dpRead(uint32_t reg) { return { false, true, reg, 0, false, 0 }; }
+		static Transfer dpWrite(uint32_t reg, uint32_t val) { return { false, false, reg, val, false, 0 }; }
+		static Transfer apRead(uint32_t reg) { return { true, true, reg, 0, false, 0 }; }
+		static Transfer apWrite(uint32_t reg, uint32_t val) { return { true, false, reg, val, false, 0 }; }
+		static Transfer dpReadMatch(uint32_t reg, uint32_t mask, uint32_t val) { return { false, true, reg, val, true, mask }; }
+		static Transfer apReadMatch(uint32_t reg, uint32_t mask, uint32_t val) { return { true, true, reg, val, true, mask }; }
+	};
+
+	// Executes the transfers in order and stores read values back into them.
+	// On failure, *failed is set to the index of the first transfer that was not completed.
+	virtual int32_t transfer(std::vector<Transfer>& transfers, size_t* failed = nullptr)
+	{
+		for (size_t i = 0; i < transfers.size(); i++)
+		{
+			Transfer& t = transfers[i];
+			int32_t ret;
+			if (t.read && t.match)
+			{
+				// 照合はホスト側で一回だけ行う
+				uint32_t value;
+				ret = t.ap ? apRead(t.reg, &value) : dpRead(t.reg, &value);
+				if (ret == OK && (value & t.mask) != t.data)
+					ret = CMSISDAP_ERR_VALUE_MISMATCH;
+			}
+			else if (t.read)
+				ret = t.ap ? apRead(t.reg, &t.data) : dpRead(t.reg, &t.data);
+			else
+				ret = t.ap ? apWrite(t.reg, t.data) : dpWrite(t.reg, t.data);
+
+			if (ret != OK)
+			{
+				if (failed != nullptr)
+					*failed = i;
+				return ret;
+			}
+		}
+		return OK;
+	}
+
+	// Repeated accesses to one AP register, e.g. DRW with TAR auto-increment.
+	// *done is set to the number of words transferred.
+	virtual int32_t apReadBlock(uint32_t reg, uint32_t* data, size_t count, size_t* done = nullptr)
+	{
+		size_t i = 0;
+		int32_t ret = OK;
+		for (; i < count; i++)
+		{
+			ret = apRead(reg, &data[i]);
+			if (ret != OK)
+				break;
+		}
+		if (done != nullptr)
+			*done = i;
+		return ret;
+	}
+
+	virtual int32_t apWriteBlock(uint32_t reg, const uint32_t* data, size_t count, size_t* done = nullptr)
+	{
+		size_t i = 0;
+		int32_t ret = OK;
+		for (; i < count; i++)
+		{
+			ret = apWrite(reg, data[i]);
+			if (ret != OK)
+				break;
+		}
+		if (done != nullptr)
+			*done = i;
+		return ret;
+	}
+
+	struct AsyncResult
+	{
+		bool done = false;
+		int32_t ret = OK;
+	};
+
+	// Queues the transfers to go out with every other queued list on flush(), so that independent
+	// requesters share packets. The list must stay alive until the future is ready; get() on the
+	// future flushes the queue if needed. A batch with any AP access or DP SELECT write, or one that fails,
+	// bumps the link epoch, so that the ADIv5 drops its SELECT/CSW/TAR shadows.
+	std::future<int32_t> transferAsync(std::vector<Transfer>& transfers)
+	{
+		auto result = std::make_shared<AsyncResult>();
+		queued.push_back({ &transfers, result });
+		return std::async(std::launch::deferred, [this, result]() {
+			if (!result->done)
+				flush();
+			return result->ret;
+		});
+	}
+
+	int32_t flush()
+	{
+		std::vector<Queued> lists;
+		lists.swap(queued);
+		if (lists.empty())
+			return OK;
+
+		std::vector<Transfer> all;
+		bool stale = false;
+		for (auto& q : lists)
+		{
+			all.insert(all.end(), q.transfers->begin(), q.transfers->end());
+			for (auto& t : *q.transfers)
+				stale = stale || t.ap || (!t.read && (t.reg & 0xC) == DP_SELECT);
+		}
+
+		size_t failed = all.size();
+		int32_t ret = transfer(all, &failed);
+		if (ret == OK)
+			failed = all.size();
+
+		// ADIv5 の知らない SELECT/CSW/TAR や sticky エラーが残っているかもしれない
+		if (stale || ret != OK)
+			linkEpoch++;
+
+		size_t offset = 0;
+		for (auto& q : lists)
+		{
+			std::copy(all.begin() + offset, all.begin() + offset + q.transfers->size(), q.transfers->begin());
+			offset += q.transfers->size();
+			q.result->ret = (offset <= failed) ? OK : ret;
+			q.result->done = true;
+		}
+		return ret;
+	}
+
 	enum ConnectionType
 	{
 		JTAG,
@@ -17,6 +158,24 @@ public:
 	virtual int32_t setConnectionType(ConnectionType type) = 0;
 	ConnectionType getConnectionType() { return connectionType; }
 
+	// Incremented whenever the link is (re)established or the AP state was changed behind the ADIv5's back.
+	// Register shadows taken before are stale.
+	uint32_t getLinkEpoch() const { return linkEpoch; }
+
+	// Reads one value match transfer makes before it fails. 1 for the host-side compare above.
+	virtual uint32_t getMatchRetry() const { return 1; }
+
 protected:
 	ConnectionType connectionType;
+	uint32_t linkEpoch = 0;
+
+private:
+	static const uint32_t DP_SELECT = 0x8;
+
+	struct Queued
+	{
+		std::vector<Transfer>* transfers;
+		std::shared_ptr<AsyncResult> result;
+	};
+	std::vector<Queued> queued;
 };
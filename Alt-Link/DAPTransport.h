@@ -0,0 +1,31 @@
+#pragma once
+
+#define _CMSISDAP_MAX_PACKET_SIZE (1024 + 1) /* 1024 bytes + 1 byte(hid report id) */
+
+/*
+ * Byte transport for CMSIS-DAP command packets.
+ * As with hidapi, write() takes a packet starting with the report ID
+ * and read() returns the response without it.
+ */
+class DAPTransport
+{
+public:
+	virtual ~DAPTransport() {}
+
+	virtual int32_t write(const uint8_t* data, uint32_t length) = 0;
+	virtual int32_t read(uint8_t* data, uint32_t capacity, uint32_t* length) = 0;
+
+	// Number of commands that may be outstanding, given the probe's packet count
+	virtual uint32_t maxOutstanding(uint32_t packetCount) const { return packetCount; }
+};
+
+/*
+ * Executes one CMSIS-DAP command (without the report ID) and returns the response length.
+ */
+class DAPCommandHandler
+{
+public:
+	virtual ~DAPCommandHandler() {}
+
+	virtual uint32_t execute(const uint8_t* request, uint32_t length, uint8_t* response, uint32_t capacity) = 0;
+};
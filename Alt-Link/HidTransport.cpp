@@ -0,0 +1,46 @@
+#include "stdafx.h"
+#include "HidTransport.h"
+
+#define _HID_TIMEOUT 1000 /* ms */
+
+std::shared_ptr<HidTransport> HidTransport::open(uint16_t vid, uint16_t pid)
+{
+	if (hid_init() != 0)
+	{
+		return std::shared_ptr<HidTransport>();
+	}
+
+	hid_device* handle = hid_open(vid, pid, NULL);
+	if (handle == NULL)
+	{
+		_DBGPRT("hid_open failed.\n");
+		return std::shared_ptr<HidTransport>();
+	}
+
+	return std::shared_ptr<HidTransport>(new HidTransport(handle));
+}
+
+HidTransport::~HidTransport()
+{
+	hid_close(hidHandle);
+	hid_exit();
+}
+
+int32_t HidTransport::write(const uint8_t* data, uint32_t length)
+{
+	int ret = hid_write(hidHandle, data, length);
+	if (ret == -1)
+		return CMSISDAP_ERR_USBHID_WRITE;
+
+	return OK;
+}
+
+int32_t HidTransport::read(uint8_t* data, uint32_t capacity, uint32_t* length)
+{
+	int ret = hid_read_timeout(hidHandle, data, capacity, _HID_TIMEOUT);
+	if (ret == -1 || ret == 0)
+		return CMSISDAP_ERR_USBHID_TIMEOUT;
+
+	*length = ret;
+	return OK;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#if defined(_WIN32)
+#pragma comment(lib, "setupapi.lib")
+#if defined(_DEBUG)
+#pragma comment(lib, "hidapid.lib")
+#else
+#pragma comment(lib, "hidapi.lib")
+#endif
+#endif
+#include <hidapi.h>
+#include <memory>
+
+#include "DAPTransport.h"
+
+class HidTransport : public DAPTransport
+{
+public:
+	static std::shared_ptr<HidTransport> open(uint16_t vid, uint16_t pid);
+	virtual ~HidTransport();
+
+	virtual int32_t write(const uint8_t* data, uint32_t length);
+	virtual int32_t read(uint8_t* data, uint32_t capacity, uint32_t* length);
+
+private:
+	HidTransport(hid_device* handle) : hidHandle(handle) {}
+
+	hid_device* hidHandle;
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+
+/*
+ * Values persisted per key in a JSON file, so that the file can be edited by hand.
+ * Key needs operator== and, like Value, a cereal serialize().
+ */
+template <class Key, class Value>
+class JsonCache
+{
+public:
+	struct Entry
+	{
+		Key key;
+		Value value;
+
+		template <class Archive>
+		void serialize(Archive & archive)
+		{
+			archive(CEREAL_NVP(key), CEREAL_NVP(value));
+		}
+	};
+
+	// name is used in the error messages
+	JsonCache(const std::string& _path, const char* _name) : path(_path), name(_name) {}
+
+	// A missing file is an empty cache
+	errno_t load()
+	{
+		entries.clear();
+
+		std::ifstream file(path);
+		if (!file)
+			return OK;
+
+		try
+		{
+			cereal::JSONInputArchive archive(file);
+			archive(CEREAL_NVP(entries));
+		}
+		catch (cereal::Exception& e)
+		{
+			_ERRPRT("Invalid %s, ignored. (%s: %s)\n", name, path.c_str(), e.what());
+			entries.clear();
+			return EINVAL;
+		}
+		return OK;
+	}
+
+	errno_t save()
+	{
+		std::ofstream file(path, std::ios::trunc);
+		if (!file)
+		{
+			_ERRPRT("Failed to write %s. (%s)\n", name, path.c_str());
+			return EFAULT;
+		}
+
+		{
+			cereal::JSONOutputArchive archive(file);
+			archive(CEREAL_NVP(entries));
+		}
+		return OK;
+	}
+
+	bool find(const Key& key, Value* value) const
+	{
+		for (auto& e : entries)
+		{
+			if (e.key == key)
+			{
+				*value = e.value;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void store(const Key& key, const Value& value)
+	{
+		for (auto& e : entries)
+		{
+			if (e.key == key)
+			{
+				e.value = value;
+				return;
+			}
+		}
+		entries.push_back({ key, value });
+	}
+
+private:
+	std::string path;
+	const char* name;
+	std::vector<Entry> entries;
+};
@@ -0,0 +1,30 @@
+#include "stdafx.h"
+#include "LoopbackTransport.h"
+
+#include <algorithm>
+
+int32_t LoopbackTransport::write(const uint8_t* data, uint32_t length)
+{
+	if (length < 2)
+		return CMSISDAP_ERR_INVALID_TX_LEN;
+
+	std::vector<uint8_t> response(_CMSISDAP_MAX_PACKET_SIZE - 1);
+	uint32_t size = handler->execute(data + 1, length - 1, response.data(), (uint32_t)response.size());
+	response.resize(size);
+	responses.push_back(response);
+	return OK;
+}
+
+int32_t LoopbackTransport::read(uint8_t* data, uint32_t capacity, uint32_t* length)
+{
+	if (responses.empty())
+		return CMSISDAP_ERR_TRANSPORT_TIMEOUT;
+
+	std::vector<uint8_t>& response = responses.front();
+	uint32_t size = std::min<uint32_t>((uint32_t)response.size(), capacity);
+	std::copy(response.begin(), response.begin() + size, data);
+	responses.pop_front();
+
+	*length = size;
+	return OK;
+}
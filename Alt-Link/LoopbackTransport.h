@@ -0,0 +1,24 @@
+#pragma once
+
+#include <memory>
+#include <deque>
+#include <vector>
+
+#include "DAPTransport.h"
+
+/*
+ * In-process transport. Commands are executed by the handler as soon as they are
+ * written, and the responses are queued until read.
+ */
+class LoopbackTransport : public DAPTransport
+{
+public:
+	LoopbackTransport(std::shared_ptr<DAPCommandHandler> _handler) : handler(_handler) {}
+
+	virtual int32_t write(const uint8_t* data, uint32_t length);
+	virtual int32_t read(uint8_t* data, uint32_t capacity, uint32_t* length);
+
+private:
+	std::shared_ptr<DAPCommandHandler> handler;
+	std::deque<std::vector<uint8_t>> responses;
+};
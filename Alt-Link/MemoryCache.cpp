@@ -0,0 +1,215 @@
+#include "stdafx.h"
+#include "MemoryCache.h"
+
+#include <algorithm>
+#include <cstring>
+
+MemoryCache::MemoryCache(std::shared_ptr<ADIv5::MEM_AP> _mem, uint32_t _pageSize) : mem(_mem), pageSize(_pageSize)
+{
+	ASSERT_RELEASE(mem != nullptr);
+	ASSERT_RELEASE(pageSize >= 4 && (pageSize & (pageSize - 1)) == 0);
+
+	clearRegions();
+}
+
+void MemoryCache::Stats::print() const
+{
+	_DBGPRT("  Memory cache hit ratio %.1f%% (hit: %llu miss: %llu)\n",
+		hitRatio() * 100.0, (unsigned long long)hits, (unsigned long long)misses);
+	_DBGPRT("    bypassed: %llu fill errors: %llu invalidated: %llu\n",
+		(unsigned long long)bypasses, (unsigned long long)fillErrors, (unsigned long long)invalidations);
+	_DBGPRT("    read ahead: %llu pages (used: %llu)\n",
+		(unsigned long long)prefetches, (unsigned long long)prefetchHits);
+}
+
+void MemoryCache::addRegion(uint64_t start, uint64_t size, bool cacheable)
+{
+	regions.push_back({ start, start + size, cacheable });
+	invalidate();
+}
+
+void MemoryCache::clearRegions()
+{
+	regions.clear();
+
+	// ARMv7-M の Peripheral, Device, System 領域はキャッシュしない
+	regions.push_back({ 0x00000000, 0x40000000, true });	// Code, SRAM
+	regions.push_back({ 0x60000000, 0xA0000000, true });	// RAM
+	invalidate();
+}
+
+bool MemoryCache::isPageCacheable(uint64_t page) const
+{
+	// ページに掛かる最後の領域がページ全体を含むときだけ属性が一意に決まる
+	for (auto it = regions.rbegin(); it != regions.rend(); ++it)
+	{
+		if (it->end <= page || page + pageSize <= it->start)
+			continue;
+		return it->cacheable && it->start <= page && page + pageSize <= it->end;
+	}
+	return false;
+}
+
+bool MemoryCache::isCacheable(uint64_t addr, uint32_t len) const
+{
+	if (len == 0)
+		return false;
+
+	for (uint64_t page = addr & ~(uint64_t)(pageSize - 1); page < addr + len; page += pageSize)
+	{
+		if (!isPageCacheable(page))
+			return false;
+	}
+	return true;
+}
+
+void MemoryCache::setEnabled(bool _enabled)
+{
+	enabled = _enabled;
+	if (!enabled)
+		invalidate();
+}
+
+void MemoryCache::setHalted(bool _halted)
+{
+	if (!_halted)
+		invalidate();
+	halted = _halted;
+}
+
+bool MemoryCache::isAvailable(uint64_t addr, uint32_t len)
+{
+	if (enabled && halted && isCacheable(addr, len))
+		return true;
+
+	stats.bypasses++;
+	return false;
+}
+
+errno_t MemoryCache::fill(uint64_t page, uint32_t count, uint32_t readAhead)
+{
+	std::vector<uint32_t> words((size_t)(count + readAhead) * pageSize / 4);
+	errno_t ret = mem->readBlock64(page, words.data(), words.size());
+	if (ret != OK && readAhead > 0)
+	{
+		// 先読みした範囲だけが読めないのかもしれない
+		readAhead = 0;
+		words.resize((size_t)count * pageSize / 4);
+		ret = mem->readBlock64(page, words.data(), words.size());
+	}
+	if (ret != OK)
+	{
+		stats.fillErrors++;
+		return ret;
+	}
+
+	for (uint32_t i = 0; i < count + readAhead; i++)
+	{
+		Page& p = pages[page + (uint64_t)i * pageSize];
+		p.prefetched = (i >= count);
+		p.data.resize(pageSize);
+		for (uint32_t j = 0; j < pageSize / 4; j++)
+		{
+			uint32_t word = words[i * pageSize / 4 + j];
+			p.data[j * 4] = word & 0xFF;
+			p.data[j * 4 + 1] = (word >> 8) & 0xFF;
+			p.data[j * 4 + 2] = (word >> 16) & 0xFF;
+			p.data[j * 4 + 3] = (word >> 24) & 0xFF;
+		}
+	}
+	stats.prefetches += readAhead;
+	return OK;
+}
+
+errno_t MemoryCache::read(uint64_t addr, uint32_t len, uint8_t* data)
+{
+	ASSERT_RELEASE(data != nullptr);
+
+	if (len == 0)
+		return OK;
+
+	// 前回の読み出しの続き (重なりを含む) なら連続アクセス
+	if (streamLength > 0 && addr > streamStart && addr <= streamEnd)
+		streamLength++;
+	else
+		streamLength = 1;
+	streamStart = addr;
+	streamEnd = addr + len;
+
+	uint64_t mask = ~(uint64_t)(pageSize - 1);
+	uint64_t first = addr & mask;
+	uint64_t last = (addr + len - 1) & mask;
+
+	if (pages.size() + (last - first) / pageSize + 1 + MAX_READ_AHEAD > MAX_PAGES)
+		pages.clear();
+
+	for (uint64_t page = first; page <= last; page += pageSize)
+	{
+		auto it = pages.find(page);
+		if (it != pages.end())
+		{
+			stats.hits++;
+			if (it->second.prefetched)
+			{
+				stats.prefetchHits++;
+				it->second.prefetched = false;
+			}
+			continue;
+		}
+
+		// 続けて欠けているページはまとめて読む
+		uint32_t count = 1;
+		while (page + (uint64_t)count * pageSize <= last && pages.find(page + (uint64_t)count * pageSize) == pages.end())
+			count++;
+
+		// 連続アクセス中は後続のページも同じブロック転送で読んでおく
+		uint32_t readAhead = 0;
+		uint32_t depth = streamLength - 1;
+		if (depth > MAX_READ_AHEAD)
+			depth = MAX_READ_AHEAD;
+		while (readAhead < depth)
+		{
+			uint64_t next = page + (uint64_t)(count + readAhead) * pageSize;
+			if (!isPageCacheable(next) || pages.find(next) != pages.end())
+				break;
+			readAhead++;
+		}
+
+		errno_t ret = fill(page, count, readAhead);
+		if (ret != OK)
+			return ret;
+		stats.misses += count;
+		page += (uint64_t)(count - 1) * pageSize;
+	}
+
+	uint64_t end = addr + len;
+	while (addr < end)
+	{
+		uint64_t page = addr & mask;
+		auto it = pages.find(page);
+		ASSERT_RELEASE(it != pages.end());
+
+		uint32_t offset = (uint32_t)(addr - page);
+		uint32_t n = (uint32_t)std::min<uint64_t>(end - addr, pageSize - offset);
+		memcpy(data, it->second.data.data() + offset, n);
+		addr += n;
+		data += n;
+	}
+	return OK;
+}
+
+void MemoryCache::invalidate()
+{
+	if (!pages.empty())
+		stats.invalidations++;
+	pages.clear();
+}
+
+void MemoryCache::invalidate(uint64_t addr, uint32_t len)
+{
+	for (uint64_t page = addr & ~(uint64_t)(pageSize - 1); page < addr + len; page += pageSize)
+	{
+		if (pages.erase(page) > 0)
+			stats.invalidations++;
+	}
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+#include "ADIv5.h"
+
+/*
+ * Page-granular read cache in front of the system memory MEM-AP.
+ * Only used while the core is halted; regions that are not cacheable (MMIO etc.) always go to the MEM-AP.
+ * Sequential reads are detected and the following pages are fetched in the same block transfer.
+ */
+class MemoryCache
+{
+public:
+	struct Region
+	{
+		uint64_t start;
+		uint64_t end;	// exclusive
+		bool cacheable;
+	};
+
+	struct Stats
+	{
+		uint64_t hits = 0;			// pages
+		uint64_t misses = 0;		// pages
+		uint64_t fillErrors = 0;
+		uint64_t bypasses = 0;		// reads outside cacheable regions or while running
+		uint64_t invalidations = 0;
+		uint64_t prefetches = 0;	// pages read ahead
+		uint64_t prefetchHits = 0;	// pages read ahead and used later
+
+		double hitRatio() const { return (hits + misses) == 0 ? 0.0 : (double)hits / (double)(hits + misses); }
+		void print() const;
+	};
+
+	static const uint32_t DEFAULT_PAGE_SIZE = 256;
+	static const size_t MAX_PAGES = 1024;
+	static const uint32_t MAX_READ_AHEAD = 4;	// pages
+
+	MemoryCache(std::shared_ptr<ADIv5::MEM_AP> _mem, uint32_t _pageSize = DEFAULT_PAGE_SIZE);
+
+	// Later regions take precedence.  The default follows the ARMv7-M memory map (Code, SRAM and RAM are cacheable).
+	void addRegion(uint64_t start, uint64_t size, bool cacheable);
+	void clearRegions();
+	bool isCacheable(uint64_t addr, uint32_t len) const;
+
+	void setEnabled(bool _enabled);
+	bool isEnabled() const { return enabled; }
+
+	// Leaving the halted state drops every page
+	void setHalted(bool _halted);
+	bool isAvailable(uint64_t addr, uint32_t len);
+
+	errno_t read(uint64_t addr, uint32_t len, uint8_t* data);
+	void invalidate();
+	void invalidate(uint64_t addr, uint32_t len);
+
+	const Stats& getStats() const { return stats; }
+	void resetStats() { stats = Stats(); }
+
+private:
+	std::shared_ptr<ADIv5::MEM_AP> mem;
+	uint32_t pageSize;
+	std::vector<Region> regions;
+	struct Page
+	{
+		std::vector<uint8_t> data;
+		bool prefetched;
+	};
+	std::map<uint64_t, Page> pages;
+	bool enabled = true;
+	bool halted = false;
+	Stats stats;
+
+	// 直前の読み出しに続くアクセスが何回続いたか
+	uint64_t streamStart = 0;
+	uint64_t streamEnd = 0;
+	uint32_t streamLength = 0;
+
+	bool isPageCacheable(uint64_t page) const;
+	errno_t fill(uint64_t page, uint32_t count, uint32_t readAhead);
+};
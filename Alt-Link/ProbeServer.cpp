@@ -0,0 +1,99 @@
+#include "stdafx.h"
+#include "ProbeServer.h"
+#include "TcpTransport.h"
+
+#include <Poco/Net/ServerSocket.h>
+#include <Poco/Net/TCPServerConnection.h>
+#include <Poco/Net/TCPServerConnectionFactory.h>
+
+class ProbeServer::Connection : public Poco::Net::TCPServerConnection
+{
+public:
+	Connection(const Poco::Net::StreamSocket& socket, std::shared_ptr<Shared> _shared)
+		: TCPServerConnection(socket), shared(_shared) {}
+
+	void run(void)
+	{
+		{
+			std::lock_guard<std::mutex> lock(shared->mutex);
+			if (shared->attached)
+			{
+				_ERRPRT("Probe is already in use, connection refused.\n");
+				return;
+			}
+			shared->attached = true;
+		}
+
+		socket().setNoDelay(true);
+		serve();
+
+		std::lock_guard<std::mutex> lock(shared->mutex);
+		shared->attached = false;
+	}
+
+private:
+	std::shared_ptr<Shared> shared;
+
+	void serve(void)
+	{
+		while (1)
+		{
+			uint8_t request[_CMSISDAP_MAX_PACKET_SIZE];
+			uint8_t response[_CMSISDAP_MAX_PACKET_SIZE];
+			uint32_t length;
+
+			// 先頭はレポート ID
+			request[0] = 0;
+			int32_t ret = TcpTransport::receiveFrame(socket(), &request[1], sizeof(request) - 1, &length);
+			if (ret != OK)
+				break;	// closed
+
+			{
+				std::lock_guard<std::mutex> lock(shared->mutex);
+				ret = shared->transport->write(request, length + 1);
+				if (ret == OK)
+					ret = shared->transport->read(response, sizeof(response), &length);
+			}
+			if (ret != OK)
+			{
+				_ERRPRT("Probe transfer failed. (0x%08x)\n", ret);
+				break;
+			}
+
+			ret = TcpTransport::sendFrame(socket(), response, length);
+			if (ret != OK)
+				break;
+		}
+	}
+};
+
+class ProbeServer::ConnectionFactory : public Poco::Net::TCPServerConnectionFactory
+{
+public:
+	ConnectionFactory(std::shared_ptr<Shared> _shared) : shared(_shared) {}
+
+	virtual Poco::Net::TCPServerConnection* createConnection(const Poco::Net::StreamSocket& socket)
+	{
+		return new Connection(socket, shared);
+	}
+
+private:
+	std::shared_ptr<Shared> shared;
+};
+
+ProbeServer::ProbeServer(std::shared_ptr<DAPTransport> transport, uint16_t port)
+	: shared(std::make_shared<Shared>())
+{
+	shared->transport = transport;
+
+	Poco::Net::ServerSocket socket(port);
+	socket.listen();
+
+	server = std::make_shared<Poco::Net::TCPServer>(new ConnectionFactory(shared), socket);
+	server->start();
+}
+
+ProbeServer::~ProbeServer()
+{
+	server->stop();
+}
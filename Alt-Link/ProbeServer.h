@@ -0,0 +1,37 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+
+#include <Poco/Net/TCPServer.h>
+
+#include "DAPTransport.h"
+
+/*
+ * Shares a probe over TCP for TcpTransport clients.
+ * Frames are forwarded to the transport one at a time and answered in order.
+ * Only one client is served at a time, since clients would otherwise interleave the DAP/AP state
+ * (SELECT, TAR, CSW) behind each other's back. A second connection is closed while one is attached.
+ */
+class ProbeServer
+{
+public:
+	ProbeServer(std::shared_ptr<DAPTransport> transport, uint16_t port);
+	~ProbeServer();
+
+	// Port actually bound, useful when started with port 0
+	uint16_t port() const { return server->port(); }
+
+private:
+	struct Shared
+	{
+		std::shared_ptr<DAPTransport> transport;
+		std::mutex mutex;
+		bool attached = false;
+	};
+	class Connection;
+	class ConnectionFactory;
+
+	std::shared_ptr<Shared> shared;
+	std::shared_ptr<Poco::Net::TCPServer> server;
+};
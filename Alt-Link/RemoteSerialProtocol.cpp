@@ -2,9 +2,11 @@
 #include "stdafx.h"
 #include "RemoteSerialProtocol.h"
 #include "Converter.h"
+#include "TraceTransport.h"
 
 #include <sstream>
 #include <iterator>
+#include <algorithm>
 
 void RemoteSerialProtocol::processQuery(const std::string& payload)
 {
@@ -213,13 +215,14 @@ void RemoteSerialProtocol::interruptReceived()
 {
 	//sendAck();
 
+	TraceTransport::annotate("(interrupt)");
+
 	uint8_t signal;
 	int32_t result = targetInterface.interrupt(&signal);
 
 	if (result == 0)
 	{
-		//"T050B:EC3D0040;0D:E03D0040;0F:D8070040;"
-		sendPacket(makePacket("S" + Converter::toHex(signal)));
+		sendStopReply(signal);
 		running = false;
 	}
 }
@@ -228,6 +231,9 @@ void RemoteSerialProtocol::packetReceived(const std::string& payload)
 {
 	sendAck();
 
+	// バイナリデータは含めず、コマンドとアドレスまでを記録する
+	TraceTransport::annotate(payload.substr(0, std::min<size_t>(payload.find(':'), 64)));
+
 	switch (payload[0])
 	{
 	case 'q':
@@ -246,8 +252,11 @@ void RemoteSerialProtocol::packetReceived(const std::string& payload)
 		{
 			targetInterface.setCurrentPC(std::stoll(payload.substr(1), nullptr, 16));
 		}
-		targetInterface.resume();
-		running = true;
+		int32_t ret = targetInterface.resume();
+		if (ret != OK)
+			sendError(ret);
+		else
+			running = true;
 		break;
 	}
 	case 's':
@@ -257,8 +266,11 @@ void RemoteSerialProtocol::packetReceived(const std::string& payload)
 			targetInterface.setCurrentPC(std::stoll(payload.substr(1), nullptr, 16));
 		}
 		uint8_t signal;
-		uint8_t result = targetInterface.step(&signal);
-		sendPacket(makePacket("S" + Converter::toHex(signal)));
+		int32_t ret = targetInterface.step(&signal);
+		if (ret != OK)
+			sendError(ret);
+		else
+			sendStopReply(signal);
 		break;
 	}
 	case 'H':
@@ -354,6 +366,81 @@ void RemoteSerialProtocol::packetReceived(const std::string& payload)
 		processBreakWatchPoint(payload);
 		break;
 	}
+	case 'v':
+	{
+		processVCont(payload);
+		break;
+	}
+	default:
+		sendNotSupported();
+	}
+}
+
+void RemoteSerialProtocol::processVCont(const std::string& payload)
+{
+	if (payload == "vCont?")
+	{
+		// GDB は c, C, s, S が揃っていないと vCont を使わない. シグナルは無視する
+		sendPacket(makePacket("vCont;c;C;s;S;r"));
+		return;
+	}
+	if (payload.find("vCont;") != 0)
+	{
+		sendNotSupported();
+		return;
+	}
+
+	// スレッドは 1 つだけなので最初の動作だけを見る
+	std::string action = payload.substr(6, payload.find(';', 6) - 6);
+	action = action.substr(0, action.find(':'));
+	if (action.empty())
+	{
+		sendError();
+		return;
+	}
+
+	switch (action[0])
+	{
+	case 'c':
+	case 'C':
+	{
+		int32_t ret = targetInterface.resume();
+		if (ret != OK)
+			sendError(ret);
+		else
+			running = true;
+		break;
+	}
+	case 's':
+	case 'S':
+	{
+		uint8_t signal;
+		int32_t ret = targetInterface.step(&signal);
+		if (ret != OK)
+			sendError(ret);
+		else
+			sendStopReply(signal);
+		break;
+	}
+	case 'r':	// range step
+	{
+		uint64_t start, end;
+		auto delimiter = Converter::extract(action, 1, ',', false, &start);
+		if (delimiter == action.npos || delimiter + 1 >= action.length())
+		{
+			sendError();
+			break;
+		}
+		Converter::toInteger(action.substr(delimiter + 1), &end);
+
+		uint8_t signal;
+		int32_t ret = targetInterface.rangeStep(start, end, &signal);
+		if (ret != OK)
+			sendError(ret);
+		else
+			sendStopReply(signal);
+		break;
+	}
 	default:
 		sendNotSupported();
 	}
@@ -427,6 +514,20 @@ int32_t RemoteSerialProtocol::sendPacket(const PacketTransfer::Packet& packet)
 	return send(packet.toString());
 }
 
+int32_t RemoteSerialProtocol::sendStopReply(uint8_t signal)
+{
+	// PC, SP などを付けて、停止直後の 'p' / 'g' を省く
+	//"T050B:EC3D0040;0D:E03D0040;0F:D8070040;"
+	std::vector<std::pair<uint32_t, uint32_t>> regs;
+	if (targetInterface.readExpeditedRegisters(&regs) != OK)
+		return sendPacket(makePacket("S" + Converter::toHex(signal)));
+
+	std::string reply = "T" + Converter::toHex(signal);
+	for (auto& reg : regs)
+		reply += Converter::toHex((uint8_t)reg.first) + ":" + Converter::toHex(reg.second) + ";";
+	return sendPacket(makePacket(reply));
+}
+
 void RemoteSerialProtocol::idle()
 {
 	if (running)
@@ -437,7 +538,7 @@ void RemoteSerialProtocol::idle()
 		auto ret = targetInterface.isRunning(&_running, &signal);
 		if (ret == OK && _running == false)
 		{
-			sendPacket(makePacket("S" + Converter::toHex(signal)));
+			sendStopReply(signal);
 			running = false;
 		}
 	}
@@ -22,6 +22,7 @@ private:
 	void processQuery(const std::string& payload);
 	void processBreakWatchPoint(const std::string& payload);
 	void processWriteMemory(const std::string& payload, bool isBinary = false);
+	void processVCont(const std::string& payload);
 
 	int32_t sendAck();
 	int32_t sendNack();
@@ -31,6 +32,7 @@ private:
 	int32_t sendNotSupported();
 	int32_t resend();
 	int32_t sendPacket(const PacketTransfer::Packet& packet);
+	int32_t sendStopReply(uint8_t signal);
 
 	PacketTransfer::Packet lastPacket;
 	TargetInterface& targetInterface;
@@ -0,0 +1,63 @@
+#include "stdafx.h"
+#include "ReplayTransport.h"
+
+#include <algorithm>
+
+std::shared_ptr<ReplayTransport> ReplayTransport::open(const std::string& path)
+{
+	auto reader = TraceReader::open(path);
+	if (reader == nullptr)
+		return nullptr;
+
+	return std::shared_ptr<ReplayTransport>(new ReplayTransport(reader));
+}
+
+bool ReplayTransport::next(TraceRecord* record)
+{
+	do
+	{
+		if (!reader->next(record))
+			return false;
+		index++;
+	} while (record->type == TraceRecord::MARK);
+	return true;
+}
+
+int32_t ReplayTransport::write(const uint8_t* data, uint32_t length)
+{
+	TraceRecord record;
+	if (!next(&record))
+	{
+		_ERRPRT("Replay: end of trace.\n");
+		return CMSISDAP_ERR_TRANSPORT_WRITE;
+	}
+
+	if (record.type != TraceRecord::TX || length < 1
+		|| record.payload.size() != length - 1 || !std::equal(record.payload.begin(), record.payload.end(), data + 1))
+	{
+		_ERRPRT("Replay: command does not match the trace. (record %llu)\n", (unsigned long long)index);
+		return CMSISDAP_ERR_TRACE_MISMATCH;
+	}
+	return OK;
+}
+
+int32_t ReplayTransport::read(uint8_t* data, uint32_t capacity, uint32_t* length)
+{
+	TraceRecord record;
+	if (!next(&record))
+		return CMSISDAP_ERR_TRANSPORT_TIMEOUT;
+
+	if (record.type == TraceRecord::RX_ERROR && record.payload.size() == 4)
+		return record.payload[0] | (record.payload[1] << 8) | (record.payload[2] << 16) | (record.payload[3] << 24);
+
+	if (record.type != TraceRecord::RX)
+	{
+		_ERRPRT("Replay: response expected. (record %llu)\n", (unsigned long long)index);
+		return CMSISDAP_ERR_TRACE_MISMATCH;
+	}
+
+	uint32_t size = std::min<uint32_t>((uint32_t)record.payload.size(), capacity);
+	std::copy(record.payload.begin(), record.payload.begin() + size, data);
+	*length = size;
+	return OK;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <string>
+
+#include "TraceTransport.h"
+
+/*
+ * Serves responses from a trace recorded by TraceTransport.
+ * Commands written must match the recorded ones, otherwise the replay fails.
+ */
+class ReplayTransport : public DAPTransport
+{
+public:
+	static std::shared_ptr<ReplayTransport> open(const std::string& path);
+
+	virtual int32_t write(const uint8_t* data, uint32_t length);
+	virtual int32_t read(uint8_t* data, uint32_t capacity, uint32_t* length);
+	virtual uint32_t maxOutstanding(uint32_t packetCount) const { return std::max<uint32_t>(packetCount, reader->getOutstanding()); }
+
+private:
+	ReplayTransport(std::shared_ptr<TraceReader> _reader) : reader(_reader), index(0) {}
+
+	bool next(TraceRecord* record);
+
+	std::shared_ptr<TraceReader> reader;
+	uint64_t index;
+};
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+
+#include "JsonCache.h"
+
+struct SpeedCacheKey
+{
+	std::string serial;
+	uint32_t idcode;
+
+	bool operator==(const SpeedCacheKey& other) const { return serial == other.serial && idcode == other.idcode; }
+
+	template <class Archive>
+	void serialize(Archive & archive)
+	{
+		archive(CEREAL_NVP(serial), CEREAL_NVP(idcode));
+	}
+};
+
+/*
+ * SWJ clock [Hz] settled by auto-tuning, persisted per probe serial number and target DP IDCODE.
+ */
+class SpeedCache : public JsonCache<SpeedCacheKey, uint32_t>
+{
+public:
+	SpeedCache(const std::string& path) : JsonCache(path, "speed cache") {}
+};
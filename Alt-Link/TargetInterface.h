@@ -13,8 +13,10 @@ public:
 	virtual void setTargetThreadId() = 0;
 	virtual void setCurrentPC(const uint64_t addr) = 0;
 
-	virtual void resume() = 0;
+	virtual int32_t resume() = 0;
 	virtual int32_t step(uint8_t* signal) = 0;
+	// Steps while PC is in [start, end) and reports only the last stop
+	virtual int32_t rangeStep(uint64_t start, uint64_t end, uint8_t* signal) = 0;
 	virtual int32_t interrupt(uint8_t* signal) = 0;
 	virtual errno_t isRunning(bool* running, uint8_t* signal) = 0;
 
@@ -49,6 +51,8 @@ public:
 	virtual errno_t writeRegister(const uint32_t n, const uint64_t data1, const uint64_t data2) = 0; // 128-bit
 	virtual errno_t readGenericRegisters(std::vector<uint32_t>* array) = 0;
 	virtual errno_t writeGenericRegisters(const std::vector<uint32_t>& array) = 0;
+	// Registers sent with a stop reply (regnum, value), read in one go
+	virtual errno_t readExpeditedRegisters(std::vector<std::pair<uint32_t, uint32_t>>* regs) = 0;
 
 	virtual errno_t readMemory(uint64_t addr, uint32_t len, std::vector<uint8_t>* array) = 0;
 	virtual errno_t readMemory(uint64_t addr, uint32_t len, std::vector<uint32_t>* array) = 0;
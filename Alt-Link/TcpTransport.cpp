@@ -0,0 +1,119 @@
+#include "stdafx.h"
+#include "TcpTransport.h"
+
+#include <algorithm>
+
+#include <Poco/Net/SocketAddress.h>
+#include <Poco/Net/NetException.h>
+
+#define _TCP_TIMEOUT 1000			/* ms */
+#define _TCP_PIPELINE_DEPTH 16		/* commands */
+
+std::shared_ptr<TcpTransport> TcpTransport::connect(const std::string& host, uint16_t port)
+{
+	try
+	{
+		Poco::Net::StreamSocket socket;
+		socket.connect(Poco::Net::SocketAddress(host, port), Poco::Timespan(_TCP_TIMEOUT * 1000));
+		socket.setNoDelay(true);
+		socket.setReceiveTimeout(Poco::Timespan(_TCP_TIMEOUT * 1000));
+		return std::shared_ptr<TcpTransport>(new TcpTransport(socket));
+	}
+	catch (Poco::Exception& e)
+	{
+		_DBGPRT("Failed to connect to %s:%u. (%s)\n", host.c_str(), port, e.displayText().c_str());
+		return std::shared_ptr<TcpTransport>();
+	}
+}
+
+int32_t TcpTransport::write(const uint8_t* data, uint32_t length)
+{
+	if (length < 2)
+		return CMSISDAP_ERR_INVALID_TX_LEN;
+
+	// drop the report ID
+	return sendFrame(socket, data + 1, length - 1);
+}
+
+int32_t TcpTransport::read(uint8_t* data, uint32_t capacity, uint32_t* length)
+{
+	return receiveFrame(socket, data, capacity, length);
+}
+
+uint32_t TcpTransport::maxOutstanding(uint32_t packetCount) const
+{
+	return std::max<uint32_t>(packetCount, _TCP_PIPELINE_DEPTH);
+}
+
+int32_t TcpTransport::sendFrame(Poco::Net::StreamSocket& socket, const uint8_t* data, uint32_t length)
+{
+	uint8_t frame[2 + _CMSISDAP_MAX_PACKET_SIZE];
+	if (length > sizeof(frame) - 2)
+		return CMSISDAP_ERR_INVALID_TX_LEN;
+
+	frame[0] = length & 0xFF;
+	frame[1] = (length >> 8) & 0xFF;
+	std::copy(data, data + length, &frame[2]);
+
+	try
+	{
+		uint32_t sent = 0;
+		while (sent < length + 2)
+		{
+			int n = socket.sendBytes(&frame[sent], length + 2 - sent);
+			if (n <= 0)
+				return CMSISDAP_ERR_TRANSPORT_WRITE;
+			sent += n;
+		}
+	}
+	catch (Poco::Exception&)
+	{
+		return CMSISDAP_ERR_TRANSPORT_WRITE;
+	}
+	return OK;
+}
+
+static int32_t receiveFully(Poco::Net::StreamSocket& socket, uint8_t* data, uint32_t length)
+{
+	uint32_t received = 0;
+	while (received < length)
+	{
+		int n = socket.receiveBytes(&data[received], length - received);
+		if (n <= 0)
+			return CMSISDAP_ERR_TRANSPORT_TIMEOUT;
+		received += n;
+	}
+	return OK;
+}
+
+int32_t TcpTransport::receiveFrame(Poco::Net::StreamSocket& socket, uint8_t* data, uint32_t capacity, uint32_t* length)
+{
+	try
+	{
+		uint8_t header[2];
+		int32_t ret = receiveFully(socket, header, sizeof(header));
+		if (ret != OK)
+			return ret;
+
+		uint32_t size = header[0] | (header[1] << 8);
+		if (size > _CMSISDAP_MAX_PACKET_SIZE)
+			return CMSISDAP_ERR_DAP_RES;
+
+		uint8_t frame[_CMSISDAP_MAX_PACKET_SIZE];
+		ret = receiveFully(socket, frame, size);
+		if (ret != OK)
+			return ret;
+
+		// 切り詰めると壊れたコマンドや応答として扱われてしまう
+		if (size > capacity)
+			return CMSISDAP_ERR_DAP_RES;
+
+		*length = size;
+		std::copy(frame, frame + size, data);
+	}
+	catch (Poco::Exception&)
+	{
+		return CMSISDAP_ERR_TRANSPORT_TIMEOUT;
+	}
+	return OK;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include <Poco/Net/StreamSocket.h>
+
+#include "DAPTransport.h"
+
+/*
+ * CMSIS-DAP commands over a TCP stream, served by ProbeServer.
+ * Each frame is a 16-bit little-endian length followed by the command or response
+ * (without the report ID).
+ */
+class TcpTransport : public DAPTransport
+{
+public:
+	static std::shared_ptr<TcpTransport> connect(const std::string& host, uint16_t port);
+
+	virtual int32_t write(const uint8_t* data, uint32_t length);
+	virtual int32_t read(uint8_t* data, uint32_t capacity, uint32_t* length);
+
+	// Requests are queued in the socket, so more than packetCount can be in flight
+	virtual uint32_t maxOutstanding(uint32_t packetCount) const;
+
+	static int32_t sendFrame(Poco::Net::StreamSocket& socket, const uint8_t* data, uint32_t length);
+	static int32_t receiveFrame(Poco::Net::StreamSocket& socket, uint8_t* data, uint32_t capacity, uint32_t* length);
+
+private:
+	TcpTransport(const Poco::Net::StreamSocket& _socket) : socket(_socket) {}
+
+	Poco::Net::StreamSocket socket;
+};
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+
+#include "ADIv5.h"
+#include "JsonCache.h"
+
+/*
+ * AP/ROM table topology found by ADIv5::scanAPs(), persisted per target.
+ * Entries are keyed by a few cheap identification reads (ADIv5::TopologyKey),
+ * so identical boards share one entry.
+ */
+class TopologyCache : public JsonCache<ADIv5::TopologyKey, ADIv5::Topology>
+{
+public:
+	TopologyCache(const std::string& path) : JsonCache(path, "topology cache") {}
+};
@@ -0,0 +1,225 @@
+#include "stdafx.h"
+#include "TraceTransport.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+#define TRACE_MAGIC		"ALTTRACE"
+#define TRACE_VERSION	1
+
+std::mutex TraceTransport::tracesMutex;
+std::vector<TraceTransport*> TraceTransport::traces;
+
+static void put16(std::ostream& s, uint16_t value)
+{
+	uint8_t b[2] = { (uint8_t)(value & 0xFF), (uint8_t)(value >> 8) };
+	s.write((const char*)b, sizeof(b));
+}
+
+static void put32(std::ostream& s, uint32_t value)
+{
+	uint8_t b[4] = { (uint8_t)(value & 0xFF), (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24) };
+	s.write((const char*)b, sizeof(b));
+}
+
+static bool get16(std::istream& s, uint16_t* value)
+{
+	uint8_t b[2];
+	if (!s.read((char*)b, sizeof(b)))
+		return false;
+	*value = b[0] | (b[1] << 8);
+	return true;
+}
+
+static bool get32(std::istream& s, uint32_t* value)
+{
+	uint8_t b[4];
+	if (!s.read((char*)b, sizeof(b)))
+		return false;
+	*value = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+	return true;
+}
+
+std::shared_ptr<TraceReader> TraceReader::open(const std::string& path)
+{
+	auto reader = std::shared_ptr<TraceReader>(new TraceReader());
+	reader->file.open(path, std::ios::binary);
+	if (!reader->file)
+		return nullptr;
+
+	char magic[8];
+	uint16_t version;
+	if (!reader->file.read(magic, sizeof(magic)) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0
+		|| !get16(reader->file, &version) || version != TRACE_VERSION
+		|| !get16(reader->file, &reader->outstanding))
+	{
+		_ERRPRT("Invalid trace file. (%s)\n", path.c_str());
+		return nullptr;
+	}
+	return reader;
+}
+
+bool TraceReader::next(TraceRecord* record)
+{
+	uint8_t type;
+	uint32_t delta;
+	uint16_t length;
+	if (!file.read((char*)&type, 1) || !get32(file, &delta) || !get16(file, &length))
+		return false;
+
+	record->payload.resize(length);
+	if (length > 0 && !file.read((char*)record->payload.data(), length))
+		return false;
+
+	time += delta;
+	record->type = type;
+	record->time = time;
+	return true;
+}
+
+std::shared_ptr<TraceTransport> TraceTransport::create(std::shared_ptr<DAPTransport> transport, const std::string& path)
+{
+	if (transport == nullptr)
+		return nullptr;
+
+	auto trace = std::shared_ptr<TraceTransport>(new TraceTransport(transport));
+	trace->file.open(path, std::ios::binary | std::ios::trunc);
+	if (!trace->file)
+	{
+		_ERRPRT("Failed to create trace file. (%s)\n", path.c_str());
+		return nullptr;
+	}
+
+	// 再生時に同じ順序で送受信するため、同時発行数の下限を残しておく
+	trace->file.write(TRACE_MAGIC, 8);
+	put16(trace->file, TRACE_VERSION);
+	put16(trace->file, (uint16_t)std::min<uint32_t>(transport->maxOutstanding(0), 0xFFFF));
+	trace->last = std::chrono::steady_clock::now();
+
+	std::lock_guard<std::mutex> lock(tracesMutex);
+	traces.push_back(trace.get());
+	return trace;
+}
+
+TraceTransport::~TraceTransport()
+{
+	std::lock_guard<std::mutex> lock(tracesMutex);
+	traces.erase(std::remove(traces.begin(), traces.end(), this), traces.end());
+}
+
+void TraceTransport::record(uint8_t type, const uint8_t* data, uint32_t length)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto now = std::chrono::steady_clock::now();
+	auto delta = std::chrono::duration_cast<std::chrono::microseconds>(now - last).count();
+	last = now;
+
+	length = std::min<uint32_t>(length, 0xFFFF);
+	file.put((char)type);
+	put32(file, (uint32_t)std::min<int64_t>(delta, 0xFFFFFFFF));
+	put16(file, (uint16_t)length);
+	file.write((const char*)data, length);
+	file.flush();
+}
+
+int32_t TraceTransport::write(const uint8_t* data, uint32_t length)
+{
+	if (length >= 1)
+		record(TraceRecord::TX, data + 1, length - 1);
+	return transport->write(data, length);
+}
+
+int32_t TraceTransport::read(uint8_t* data, uint32_t capacity, uint32_t* length)
+{
+	int32_t ret = transport->read(data, capacity, length);
+	if (ret != OK)
+	{
+		uint8_t code[4] = { (uint8_t)(ret & 0xFF), (uint8_t)(ret >> 8), (uint8_t)(ret >> 16), (uint8_t)(ret >> 24) };
+		record(TraceRecord::RX_ERROR, code, sizeof(code));
+		return ret;
+	}
+
+	record(TraceRecord::RX, data, *length);
+	return OK;
+}
+
+void TraceTransport::annotate(const std::string& label)
+{
+	std::lock_guard<std::mutex> lock(tracesMutex);
+	for (auto trace : traces)
+		trace->record(TraceRecord::MARK, (const uint8_t*)label.data(), (uint32_t)label.size());
+}
+
+errno_t TraceTransport::summarize(const std::string& path)
+{
+	auto reader = TraceReader::open(path);
+	if (reader == nullptr)
+		return EINVAL;
+
+	struct Stat
+	{
+		uint32_t count;
+		uint64_t roundTrips;
+		uint64_t time;
+	};
+	std::map<std::string, Stat> stats;
+
+	// "m20000000,4" と "m20000100,4" は同じ操作として集計する
+	auto kind = [](const std::string& label) {
+		if (label.empty() || label[0] == '(')
+			return label;
+		if (label[0] == 'q' || label[0] == 'Q' || label[0] == 'v')
+			return label.substr(0, label.find_first_of(":;,"));
+		return label.substr(0, 1);
+	};
+
+	std::string current = "(none)";
+	uint64_t start = 0;
+	uint64_t end = 0;
+	uint64_t roundTrips = 0;
+	auto flush = [&]() {
+		if (roundTrips == 0 && current == "(none)")
+			return;
+		Stat& s = stats[kind(current)];
+		s.count++;
+		s.roundTrips += roundTrips;
+		s.time += end - start;
+	};
+
+	TraceRecord record;
+	uint64_t totalRoundTrips = 0;
+	while (reader->next(&record))
+	{
+		if (record.type == TraceRecord::MARK)
+		{
+			flush();
+			current = record.label();
+			start = end = record.time;
+			roundTrips = 0;
+			continue;
+		}
+
+		end = record.time;
+		if (record.type == TraceRecord::TX)
+		{
+			roundTrips++;
+			totalRoundTrips++;
+		}
+	}
+	flush();
+
+	_DBGPRT("%-24s %8s %12s %12s %12s %10s\n", "Operation", "Count", "RoundTrips", "Trips/Op", "Time[ms]", "ms/Op");
+	for (auto& s : stats)
+	{
+		_DBGPRT("%-24s %8u %12llu %12.1f %12.3f %10.3f\n",
+			s.first.c_str(), s.second.count,
+			(unsigned long long)s.second.roundTrips,
+			(double)s.second.roundTrips / s.second.count,
+			s.second.time / 1000.0,
+			s.second.time / 1000.0 / s.second.count);
+	}
+	_DBGPRT("Total round trips: %llu, elapsed: %.3f ms\n", (unsigned long long)totalRoundTrips, end / 1000.0);
+	return OK;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "DAPTransport.h"
+
+/*
+ * Trace file format (little endian)
+ *   header : "ALTTRACE" u16 version, u16 outstanding
+ *   record : u8 type, u32 delta [us], u16 length, payload
+ * TX payloads exclude the report ID. RX_ERROR carries the error code as i32.
+ * MARK records name the host operation (e.g. a GDB packet) that caused the following traffic.
+ */
+struct TraceRecord
+{
+	enum Type
+	{
+		TX			= 1,
+		RX			= 2,
+		RX_ERROR	= 3,
+		MARK		= 4
+	};
+
+	uint8_t type;
+	uint64_t time;	// [us] since the start of the trace
+	std::vector<uint8_t> payload;
+
+	std::string label() const { return std::string(payload.begin(), payload.end()); }
+};
+
+class TraceReader
+{
+public:
+	static std::shared_ptr<TraceReader> open(const std::string& path);
+
+	bool next(TraceRecord* record);
+	uint16_t getOutstanding() const { return outstanding; }
+
+private:
+	TraceReader() : outstanding(0), time(0) {}
+
+	std::ifstream file;
+	uint16_t outstanding;
+	uint64_t time;
+};
+
+/*
+ * Records all traffic of the wrapped transport to a trace file.
+ */
+class TraceTransport : public DAPTransport
+{
+public:
+	static std::shared_ptr<TraceTransport> create(std::shared_ptr<DAPTransport> transport, const std::string& path);
+	virtual ~TraceTransport();
+
+	virtual int32_t write(const uint8_t* data, uint32_t length);
+	virtual int32_t read(uint8_t* data, uint32_t capacity, uint32_t* length);
+	virtual uint32_t maxOutstanding(uint32_t packetCount) const { return transport->maxOutstanding(packetCount); }
+
+	// Adds a MARK record to every open trace
+	static void annotate(const std::string& label);
+
+	// Prints round trips and time spent per marked operation
+	static errno_t summarize(const std::string& path);
+
+private:
+	TraceTransport(std::shared_ptr<DAPTransport> _transport) : transport(_transport) {}
+
+	void record(uint8_t type, const uint8_t* data, uint32_t length);
+
+	std::shared_ptr<DAPTransport> transport;
+	std::ofstream file;
+	std::mutex mutex;
+	std::chrono::steady_clock::time_point last;
+
+	static std::mutex tracesMutex;
+	static std::vector<TraceTransport*> traces;
+};
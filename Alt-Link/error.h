@@ -18,5 +18,12 @@
 #define CMSISDAP_ERR_NO_ACK						14
 #define CMSISDAP_ERR_ACKFAULT					15
 #define CMSISDAP_ERR_ACKWAIT					16
+#define CMSISDAP_ERR_TRANSPORT_CONNECT			17
+#define CMSISDAP_ERR_TRANSPORT_WRITE			18
+#define CMSISDAP_ERR_TRANSPORT_TIMEOUT			19
+#define CMSISDAP_ERR_TRACE_MISMATCH				20
+#define CMSISDAP_ERR_VALUE_MISMATCH				21
+#define CMSISDAP_ERR_VERIFY						22
+#define CMSISDAP_ERR_PROTOCOL					23
 
 #define ERSP_NOT_SUPPORTED						-1
\ No newline at end of file